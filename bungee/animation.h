@@ -0,0 +1,124 @@
+//=============================================================================================
+// Keyframe animation: scalar channels (a coordinate of a translation, an angle, a material parameter...)
+// interpolated between keys and written to a float the channel targets.
+// All channels live in one structure of arrays and are evaluated together once per rendered frame:
+// the per channel work is two straight-line loops the compiler turns into SIMD code, with the key
+// search moved out of them into a cursor that only moves when a channel crosses a key.
+// Nothing here touches OpenGL.
+//=============================================================================================
+#pragma once
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+//---------------------------
+class AnimationTracks {
+//---------------------------
+public:
+    enum Interpolation {
+        Linear,
+        Smooth      // cubic Hermite through the keys with Catmull-Rom tangents
+    };
+
+private:
+    // keys of every channel, those of channel c in [keyFirst[c], keyFirst[c] + keyCount[c])
+    std::vector<float> keyTime, keyValue, keyTangent;   // tangent: d value / d time at the key
+    std::vector<int> keyFirst, keyCount;
+
+    // channels
+    std::vector<float *> target;
+    std::vector<float> start, period, loop;             // loop: 1 repeats the keys, 0 holds the last one
+    std::vector<unsigned char> smooth;
+
+    // the loaded segment of every channel, as the batched loops read it; it serves local times in
+    // [validFrom, validTo), which reaches to infinity before the first key and after the last one
+    std::vector<float> validFrom, validTo, segStart, segInvSpan, segV0, segV1, segM0, segM1, localTime, value;
+
+    float lastTime = NAN;
+
+    // loads the segment of channel c that contains local time t, clamped to the first and last key
+    void Seek(int c, float t) {
+        const float * times = &keyTime[keyFirst[c]];
+        int n = keyCount[c];
+        int k = (int)(std::upper_bound(times, times + n, t) - times) - 1;
+        k = k < 0 ? 0 : k > n - 2 ? n - 2 : k;
+        if (n == 1) k = 0;
+        int i = keyFirst[c] + k, j = n > 1 ? i + 1 : i;
+        validFrom[c] = k == 0 ? -INFINITY : keyTime[i];
+        validTo[c] = k >= n - 2 ? INFINITY : keyTime[j];
+        float span = keyTime[j] - keyTime[i];
+        segStart[c] = keyTime[i];
+        segInvSpan[c] = span > 0 ? 1 / span : 0;
+        segV0[c] = keyValue[i];
+        segV1[c] = keyValue[j];
+        if (smooth[c]) {
+            segM0[c] = keyTangent[i] * span;
+            segM1[c] = keyTangent[j] * span;
+        }
+        else segM0[c] = segM1[c] = keyValue[j] - keyValue[i];  // makes the Hermite curve a line
+    }
+
+public:
+    // adds a channel that writes into *_target; times must be increasing, at least one key.
+    // A looping channel repeats its keys with the period of the last key time minus the first.
+    int AddChannel(float * _target, const std::vector<float>& times, const std::vector<float>& values,
+                   Interpolation interpolation = Linear, bool repeat = false) {
+        int c = (int)target.size(), n = (int)times.size(), first = (int)keyTime.size();
+        for (int k = 0; k < n; k++) {
+            int prev = k > 0 ? k - 1 : k, next = k < n - 1 ? k + 1 : k;
+            float dt = times[next] - times[prev];
+            keyTime.push_back(times[k]);
+            keyValue.push_back(values[k]);
+            keyTangent.push_back(dt > 0 ? (values[next] - values[prev]) / dt : 0);
+        }
+        keyFirst.push_back(first);
+        keyCount.push_back(n);
+        target.push_back(_target);
+        start.push_back(times[0]);
+        period.push_back(times[n - 1] > times[0] ? times[n - 1] - times[0] : 1);
+        loop.push_back(repeat && times[n - 1] > times[0] ? 1.0f : 0.0f);
+        smooth.push_back(interpolation == Smooth);
+        for (std::vector<float> * v : { &validFrom, &validTo, &segStart, &segInvSpan, &segV0, &segV1, &segM0, &segM1, &localTime, &value })
+            v->push_back(0);
+        Seek(c, times[0]);
+        lastTime = NAN;
+        return c;
+    }
+
+    int Channels() const { return (int)target.size(); }
+
+    // evaluates every channel at time and writes the targets; nothing to do if time has not changed
+    void Evaluate(float time) {
+        if (time == lastTime) return;
+        lastTime = time;
+        const int n = (int)target.size();
+        // plain pointers: stores through vector members would make the compiler reload them every iteration
+        float * __restrict local = localTime.data(), * __restrict result = value.data();
+
+        // local times: looping channels wrap into [start, start + period)
+        const float * t0 = start.data(), * span = period.data(), * repeat = loop.data();
+        for (int c = 0; c < n; c++) {
+            float t = time - t0[c], periods = t / span[c], whole = (float)(int)periods;   // floor without a libm call
+            whole -= periods < whole ? 1 : 0;
+            local[c] = t0[c] + t - repeat[c] * whole * span[c];
+        }
+
+        // only the channels that crossed a key since the last frame load another segment
+        for (int c = 0; c < n; c++)
+            if (local[c] < validFrom[c] || local[c] >= validTo[c]) Seek(c, local[c]);
+
+        // Hermite basis on the loaded segments
+        const float * from = segStart.data(), * invSpan = segInvSpan.data();
+        const float * v0 = segV0.data(), * v1 = segV1.data(), * m0 = segM0.data(), * m1 = segM1.data();
+        for (int c = 0; c < n; c++) {
+            float s = (local[c] - from[c]) * invSpan[c];
+            s = s < 0 ? 0 : s;
+            s = s > 1 ? 1 : s;
+            float s2 = s * s, s3 = s2 * s;
+            result[c] = (2 * s3 - 3 * s2 + 1) * v0[c] + (s3 - 2 * s2 + s) * m0[c] +
+                        (3 * s2 - 2 * s3) * v1[c] + (s3 - s2) * m1[c];
+        }
+
+        for (int c = 0; c < n; c++) *target[c] = result[c];
+    }
+};
@@ -0,0 +1,189 @@
+//=============================================================================================
+// bungee_terrain.h on top of the header-only generators; all state lives in the bungee_terrain handle
+//=============================================================================================
+#include "bungee_terrain.h"
+#include "terrain.h"
+#include "noise.h"
+#include "jobs.h"
+#include <atomic>
+#include <new>
+#include <system_error>
+
+struct bungee_terrain {
+    unsigned int seed;
+    double amplitude;
+    int harmonics;
+    bungee_terrain_options options;
+    std::vector<double> phases;         // the first terrainPhasesUsed entries of the app's table
+};
+
+static const char * styleName(bungee_terrain_style style) {
+    switch (style) {
+    case BUNGEE_TERRAIN_CLASSIC: return "classic";
+    case BUNGEE_TERRAIN_SMOOTH: return "smooth";
+    case BUNGEE_TERRAIN_BANDPASS: return "bandpass";
+    case BUNGEE_TERRAIN_RIDGED: return "ridged";
+    default: return nullptr;
+    }
+}
+
+//---------------------------
+struct StridedWriter {
+//---------------------------
+// writes sample (i, j) given the height and its derivatives per unit of u and v
+    char * height, * normal, * position;
+    size_t heightStride, heightRow, normalStride, normalRow, positionStride, positionRow;
+    double u0, v0, du, dv;
+    float worldSize;
+
+    static void layout(const bungee_terrain_buffer& buffer, size_t element, int resU, char *& data, size_t& stride, size_t& row) {
+        data = (char *)buffer.data;
+        stride = buffer.stride ? buffer.stride : element;
+        row = buffer.row_stride ? buffer.row_stride : stride * resU;
+    }
+
+    StridedWriter(const bungee_terrain_output& output, const bungee_terrain_rect& rect, float _worldSize) {
+        layout(output.height, sizeof(float), rect.res_u, height, heightStride, heightRow);
+        layout(output.normal, 3 * sizeof(float), rect.res_u, normal, normalStride, normalRow);
+        layout(output.position, 3 * sizeof(float), rect.res_u, position, positionStride, positionRow);
+        u0 = rect.u0;
+        v0 = rect.v0;
+        du = rect.res_u > 1 ? (rect.u1 - rect.u0) / (rect.res_u - 1) : 0;
+        dv = rect.res_v > 1 ? (rect.v1 - rect.v0) / (rect.res_v - 1) : 0;
+        worldSize = _worldSize;
+    }
+
+    void operator()(int i, int j, double h, double dhdu, double dhdv) const {
+        if (height) *(float *)(height + i * heightRow + j * heightStride) = (float)h;
+        if (normal) {
+            double nx = -dhdu / worldSize, nz = -dhdv / worldSize, scale = 1 / sqrt(nx * nx + 1 + nz * nz);
+            float * n = (float *)(normal + i * normalRow + j * normalStride);
+            n[0] = (float)(nx * scale);
+            n[1] = (float)scale;
+            n[2] = (float)(nz * scale);
+        }
+        if (position) {
+            float * p = (float *)(position + i * positionRow + j * positionStride);
+            p[0] = (float)((u0 + j * du - 0.5) * worldSize);
+            p[1] = (float)h;
+            p[2] = (float)((v0 + i * dv - 0.5) * worldSize);
+        }
+    }
+};
+
+// rows [rowBegin, rowEnd) of rect
+static void generateRows(const bungee_terrain& terrain, const bungee_terrain_rect& rect, const StridedWriter& write,
+                         int rowBegin, int rowEnd) {
+    const int resU = rect.res_u, resV = rect.res_v;
+    if (terrain.options.style == BUNGEE_TERRAIN_NOISE) {
+        NoiseOptions noise;
+        std::vector<float> x(resU), y(resU), h(resU), dx(resU), dy(resU);
+        for (int i = rowBegin; i < rowEnd; i++) {
+            for (int j = 0; j < resU; j++) {
+                x[j] = (float)(rect.u0 + (resU > 1 ? (rect.u1 - rect.u0) * j / (resU - 1) : 0));
+                y[j] = (float)(rect.v0 + (resV > 1 ? (rect.v1 - rect.v0) * i / (resV - 1) : 0));
+            }
+            gradientNoise(terrain.seed, noise, resU, x.data(), y.data(), h.data(), dx.data(), dy.data());
+            for (int j = 0; j < resU; j++) write(i, j, h[j], dx[j], dy[j]);
+        }
+        return;
+    }
+    // the Fourier gradient is per radian of x = u * pi - pi
+    auto perUnit = [&](int i, int j, double h, double gx, double gy) { write(i, j, h, gx * M_PI, gy * M_PI); };
+    withTerrainSpectrum(styleName(terrain.options.style), [&](auto spectrum) {
+        typedef decltype(spectrum) Spectrum;
+        const int n = terrain.harmonics;
+        double spanU = rect.u1 - rect.u0, spanV = rect.v1 - rect.v0;
+        if (terrain.options.phases == BUNGEE_TERRAIN_PHASE_HASH)
+            terrainSampleRect<Spectrum>(HashPhases(terrain.seed), terrain.amplitude, n, rect.u0, rect.v0, spanU, spanV,
+                                        resU, resV, rowBegin, rowEnd, perUnit);
+        else
+            terrainSampleRect<Spectrum>(TablePhases(terrain.phases.data(), n), terrain.amplitude, n, rect.u0, rect.v0,
+                                        spanU, spanV, resU, resV, rowBegin, rowEnd, perUnit);
+    });
+}
+
+extern "C" {
+
+void bungee_terrain_default_options(bungee_terrain_options * options) {
+    if (!options) return;
+    options->style = BUNGEE_TERRAIN_CLASSIC;
+    options->phases = BUNGEE_TERRAIN_PHASE_TABLE;
+    options->world_size = terrainWorldSize;
+    options->threads = 0;
+}
+
+bungee_terrain * bungee_terrain_create(unsigned int seed, double amplitude, int harmonics,
+                                       const bungee_terrain_options * options) {
+    bungee_terrain_options chosen;
+    bungee_terrain_default_options(&chosen);
+    if (options) chosen = *options;
+    bool noise = chosen.style == BUNGEE_TERRAIN_NOISE;
+    if ((!noise && (!styleName(chosen.style) || harmonics < 1)) || !(chosen.world_size > 0)) return nullptr;
+    if (chosen.phases != BUNGEE_TERRAIN_PHASE_TABLE && chosen.phases != BUNGEE_TERRAIN_PHASE_HASH) return nullptr;
+    try {
+        bungee_terrain * terrain = new bungee_terrain;
+        terrain->seed = seed;
+        terrain->amplitude = amplitude;
+        terrain->harmonics = harmonics;
+        terrain->options = chosen;
+        if (!noise && chosen.phases == BUNGEE_TERRAIN_PHASE_TABLE) {
+            terrain->phases.resize(terrainPhasesUsed(harmonics));
+            seedTerrainPhases(seed, terrain->phases.data(), (int)terrain->phases.size());
+        }
+        return terrain;
+    }
+    catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void bungee_terrain_destroy(bungee_terrain * terrain) { delete terrain; }
+
+int bungee_terrain_generate(const bungee_terrain * terrain, const bungee_terrain_rect * rect,
+                            const bungee_terrain_output * output) {
+    if (!terrain || !rect || !output || rect->res_u < 1 || rect->res_v < 1) return BUNGEE_TERRAIN_INVALID_ARGUMENT;
+    StridedWriter write(*output, *rect, terrain->options.world_size);
+    if (!write.height && !write.normal && !write.position) return BUNGEE_TERRAIN_OK;
+
+    // bands of rows, a few per thread so uneven ones balance
+    int threads = terrain->options.threads > 0 ? terrain->options.threads : defaultThreadCount();
+    int bands = std::min(rect->res_v, threads > 1 ? threads * 4 : 1);
+    // a worker cannot throw out of parallelFor, so errors in the bands are caught there and the first one kept
+    std::atomic<int> error(BUNGEE_TERRAIN_OK);
+    auto fail = [&](int code) {
+        int none = BUNGEE_TERRAIN_OK;
+        error.compare_exchange_strong(none, code);
+    };
+    try {
+        parallelFor(bands, [&](int band) {
+            if (error != BUNGEE_TERRAIN_OK) return;
+            try {
+                generateRows(*terrain, *rect, write, (int)((long long)rect->res_v * band / bands),
+                             (int)((long long)rect->res_v * (band + 1) / bands));
+            }
+            catch (const std::bad_alloc&) {
+                fail(BUNGEE_TERRAIN_OUT_OF_MEMORY);
+            }
+        }, threads);
+    }
+    catch (const std::bad_alloc&) {
+        fail(BUNGEE_TERRAIN_OUT_OF_MEMORY);
+    }
+    catch (const std::system_error&) {
+        fail(BUNGEE_TERRAIN_THREADS_UNAVAILABLE);
+    }
+    return error;
+}
+
+const char * bungee_terrain_error_string(int error) {
+    switch (error) {
+    case BUNGEE_TERRAIN_OK: return "no error";
+    case BUNGEE_TERRAIN_INVALID_ARGUMENT: return "invalid argument";
+    case BUNGEE_TERRAIN_OUT_OF_MEMORY: return "out of memory";
+    case BUNGEE_TERRAIN_THREADS_UNAVAILABLE: return "worker threads cannot be started";
+    default: return "unknown error";
+    }
+}
+
+}
@@ -0,0 +1,93 @@
+/*=============================================================================================
+ * C interface of the terrain generator, built as the static library bungeeterrain.
+ * A generator is made from (seed, amplitude, harmonics, options) and is immutable afterwards: any number
+ * of threads may fill buffers from the same generator at once, and the library keeps no global state.
+ * The caller owns every output buffer; samples are written in place through byte strides, so heights,
+ * normals and positions can go straight into separate arrays or into the fields of an interleaved vertex.
+ * The same seed, amplitude and harmonics give the terrain the bungee app renders with --seed.
+ *
+ *     struct Vertex { float position[3], normal[3], uv[2]; } vertices[65 * 65];
+ *     bungee_terrain_output out = { 0 };
+ *     out.position.data = vertices[0].position; out.position.stride = sizeof(struct Vertex);
+ *     out.normal.data = vertices[0].normal;     out.normal.stride = sizeof(struct Vertex);
+ *     bungee_terrain_rect rect = { 0, 0, 1, 1, 65, 65 };
+ *     bungee_terrain_generate(generator, &rect, &out);
+ *=============================================================================================*/
+#ifndef BUNGEE_TERRAIN_H
+#define BUNGEE_TERRAIN_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct bungee_terrain bungee_terrain;
+
+typedef enum bungee_terrain_style {
+    BUNGEE_TERRAIN_CLASSIC,         /* Fourier sum, A / |k| */
+    BUNGEE_TERRAIN_SMOOTH,          /* Fourier sum, A / |k|^2 */
+    BUNGEE_TERRAIN_BANDPASS,        /* Fourier sum, A / |k| for 4 <= |k| <= 16 */
+    BUNGEE_TERRAIN_RIDGED,          /* -|classic| */
+    BUNGEE_TERRAIN_NOISE            /* multi-octave gradient noise, amplitude and harmonics unused */
+} bungee_terrain_style;
+
+typedef enum bungee_terrain_phases {
+    BUNGEE_TERRAIN_PHASE_TABLE,     /* from the seeded table, as the app */
+    BUNGEE_TERRAIN_PHASE_HASH       /* hashed from the seed and the wave vector, no table */
+} bungee_terrain_phases;
+
+typedef struct bungee_terrain_options {
+    bungee_terrain_style style;
+    bungee_terrain_phases phases;
+    float world_size;               /* world units per unit of u and v, for positions and normals */
+    int threads;                    /* threads a call may use, 0: one per core, 1: the calling thread only */
+} bungee_terrain_options;
+
+/* a rectangle of parameter space, [u0, u1] x [v0, v1], sampled at res_u x res_v points including the corners.
+ * Tile (tx, tz) of an endless terrain is [tx, tx + 1] x [tz, tz + 1]. */
+typedef struct bungee_terrain_rect {
+    double u0, v0, u1, v1;
+    int res_u, res_v;
+} bungee_terrain_rect;
+
+/* sample (i, j), row i along v and column j along u, goes to data + i * row_stride + j * stride (in bytes).
+ * stride 0 means tightly packed elements, row_stride 0 means rows of res_u strides. */
+typedef struct bungee_terrain_buffer {
+    float * data;                   /* NULL: not wanted */
+    size_t stride, row_stride;
+} bungee_terrain_buffer;
+
+typedef struct bungee_terrain_output {
+    bungee_terrain_buffer height;   /* 1 float */
+    bungee_terrain_buffer normal;   /* 3 floats, unit world space normal of the surface (x, height, z) */
+    bungee_terrain_buffer position; /* 3 floats, x = (u - 0.5) * world_size, height, z = (v - 0.5) * world_size */
+} bungee_terrain_output;
+
+enum {
+    BUNGEE_TERRAIN_OK = 0,
+    BUNGEE_TERRAIN_INVALID_ARGUMENT = -1,
+    BUNGEE_TERRAIN_OUT_OF_MEMORY = -2,
+    BUNGEE_TERRAIN_THREADS_UNAVAILABLE = -3
+};
+
+/* classic style, phase table, the app's world size of 15 and every core */
+void bungee_terrain_default_options(bungee_terrain_options * options);
+
+/* NULL if the arguments are invalid (harmonics < 1 for the Fourier styles, world_size <= 0) or memory runs out;
+ * options may be NULL for the defaults */
+bungee_terrain * bungee_terrain_create(unsigned int seed, double amplitude, int harmonics,
+                                       const bungee_terrain_options * options);
+
+void bungee_terrain_destroy(bungee_terrain * terrain);
+
+/* fills the wanted buffers of output for rect; returns BUNGEE_TERRAIN_OK or a negative error code, after which
+ * the buffers may be partly written */
+int bungee_terrain_generate(const bungee_terrain * terrain, const bungee_terrain_rect * rect,
+                            const bungee_terrain_output * output);
+
+const char * bungee_terrain_error_string(int error);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,732 @@
+//=============================================================================================
+// Drainage of the terrain, to place rivers and lakes: depressions filled by priority-flood, D8 or
+// D-infinity flow directions on the filled surface, flow accumulation and drainage basins over a grid of
+// cells in a square of parameter space. Water leaves the grid at its border.
+// The grid is stored tile by tile, as the nav grid. Every tile is sampled and flooded on its own, in
+// parallel, from its perimeter cells; the spill heights between the watersheds of those cells, and
+// between perimeter cells of neighbouring tiles, make a small graph, and a priority-flood over that graph
+// from the border gives the level every watershed fills up to (Barnes: Parallel priority-flood depression
+// filling for trillion cell digital elevation models, 2016).
+// Flats left by the filling drain toward their outlets. A cell's accumulation is computed once all of its
+// donors are done: every tile works through its ready cells in parallel with the others and hands over
+// the cells that become ready in other tiles between rounds.
+// When the terrain of a tile changes only that tile is sampled and flooded again.
+// Results do not depend on the thread count.
+// Nothing here touches OpenGL.
+//=============================================================================================
+#pragma once
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "jobs.h"
+#include "largebuffer.h"
+
+// heights at (u0 + j * step, v0 + i * step), j < nu, i < nv, row-major into h
+typedef std::function<void(double u0, double v0, double step, int nu, int nv, float * h)> FlowSampler;
+
+enum FlowMethod {
+    FlowD8,                 // all the water of a cell to its steepest downhill neighbour
+    FlowDInfinity           // split between the two neighbours of the steepest facet (Tarboton 1997)
+};
+
+struct FlowOptions {
+    double u0 = 0, v0 = 0, size = 1;    // square of parameter space covered
+    int resolution = 1024;              // cells along a side
+    int tileCells = 256;                // tile edge in cells, 8..1024
+    FlowMethod method = FlowD8;
+    int threads = 0;                    // 0: one per core
+    HugePages pages = TransparentHugePages;
+};
+
+// seconds spent in the stages of the last Build or Rebuild
+struct FlowTimings {
+    double flood = 0, spill = 0, directions = 0, accumulation = 0;
+    int rounds = 0;                     // of handing over ready cells between tiles
+};
+
+//---------------------------
+class MonotoneQueue {
+//---------------------------
+// (height, cell) pairs, lowest first, for floods that never push below the last pop: a radix heap on the
+// bits of the heights, an element in the bucket of the highest bit in which it differs from the last pop
+    std::vector<std::pair<uint32_t, int>> buckets[33];
+    uint32_t last = 0;
+    size_t count = 0;
+
+    static uint32_t Key(float h) {     // unsigned order of the keys is the order of the heights
+        uint32_t bits;
+        memcpy(&bits, &h, sizeof(bits));
+        return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+    }
+    static float Height(uint32_t key) {
+        uint32_t bits = key & 0x80000000u ? key & 0x7FFFFFFFu : ~key;
+        float h;
+        memcpy(&h, &bits, sizeof(h));
+        return h;
+    }
+    int Bucket(uint32_t key) const { return key == last ? 0 : 32 - std::countl_zero(key ^ last); }
+
+public:
+    bool empty() const { return count == 0; }
+
+    void push(float h, int cell) {
+        uint32_t key = Key(h);
+        buckets[Bucket(key)].push_back({ key, cell });
+        count++;
+    }
+
+    std::pair<float, int> pop() {
+        if (buckets[0].empty()) {
+            int b = 1;
+            while (buckets[b].empty()) b++;
+            last = buckets[b][0].first;
+            for (const auto& element : buckets[b]) last = std::min(last, element.first);
+            for (const auto& element : buckets[b]) buckets[Bucket(element.first)].push_back(element);
+            buckets[b].clear();
+        }
+        std::pair<uint32_t, int> top = buckets[0].back();
+        buckets[0].pop_back();
+        count--;
+        return { Height(top.first), top.second };
+    }
+};
+
+//---------------------------
+class FlowGrid {
+//---------------------------
+public:
+    // neighbour k of cell (x, y) is (x + dx[k], y + dy[k]); k counts counterclockwise from east, +y is south
+    static constexpr int dx[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+    static constexpr int dy[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+
+private:
+    static const uint8_t outlet = 8;        // direction of a cell that drains off the grid
+    static const uint8_t unresolved = 9;    // on a flat, until the flats are drained
+    static const size_t none = ~(size_t)0;
+
+    struct Spill {
+        int a, b;                           // watersheds, base[t] + perimeter index
+        float height;                       // lowest level at which water passes between them
+    };
+
+    // the lowest spill between every pair of watersheds a flood meets, open addressing on a << 16 | b
+    struct SpillTable {
+        static const uint32_t empty = ~0u;
+        std::vector<uint32_t> keys = std::vector<uint32_t>(1024, empty);
+        std::vector<float> levels = std::vector<float>(1024);
+        size_t used = 0;
+
+        void Add(uint32_t a, uint32_t b, float level) {
+            uint32_t key = a < b ? a << 16 | b : b << 16 | a, mask = (uint32_t)keys.size() - 1, slot = key * 0x9E3779B1u;
+            for (slot = (slot ^ slot >> 16) & mask; keys[slot] != empty; slot = (slot + 1) & mask) {
+                if (keys[slot] == key) {
+                    levels[slot] = std::min(levels[slot], level);
+                    return;
+                }
+            }
+            keys[slot] = key;
+            levels[slot] = level;
+            if (++used * 2 > keys.size()) {
+                std::vector<uint32_t> oldKeys(keys.size() * 2, empty);
+                std::vector<float> oldLevels(levels.size() * 2);
+                oldKeys.swap(keys);
+                oldLevels.swap(levels);
+                used = 0;
+                for (size_t s = 0; s < oldKeys.size(); s++)
+                    if (oldKeys[s] != empty) Add(oldKeys[s] >> 16, oldKeys[s] & 0xFFFF, oldLevels[s]);
+            }
+        }
+    };
+
+    struct Tile {
+        int w = 0, h = 0;                   // cells inside the grid
+        std::vector<Spill> spills;          // between watersheds of the tile, the lowest of every pair
+        std::vector<Spill> links;           // between its perimeter cells and those of later tiles
+        std::vector<size_t> ready;          // cells whose donors are all accumulated
+    };
+
+    FlowOptions options;
+    FlowSampler sampler;
+    int T = 0, tilesPerSide = 0;
+    double step = 0;
+    LargeBuffer<float> height, localFill, filled, accumulation, share;   // share: D-infinity only
+    LargeBuffer<uint16_t> watershed;        // perimeter cell of its tile the local flood reached the cell from
+    LargeBuffer<uint8_t> direction, inflow;  // inflow: the donors of a cell, bit k for neighbour k
+    std::unique_ptr<std::atomic<uint8_t>[]> pending;    // donors not yet accumulated
+    std::vector<Tile> tiles;
+    std::vector<int> base;                  // first watershed of every tile
+    std::vector<float> spill;               // level of every watershed
+    FlowTimings timings;
+
+    static int PerimeterCount(int w, int h) { return h == 1 ? w : 2 * w + (w > 1 ? 2 : 1) * (h - 2); }
+    static int PerimeterIndex(int w, int h, int i, int j) {
+        if (i == 0) return j;
+        if (i == h - 1) return w + j;
+        if (j == 0) return 2 * w + i - 1;
+        if (j == w - 1) return 2 * w + h - 2 + i - 1;
+        return -1;
+    }
+    static std::pair<int, int> PerimeterCell(int w, int h, int p) {    // (i, j) of perimeter index p
+        if (p < w) return { 0, p };
+        if (p < 2 * w) return { h - 1, p - w };
+        if (p < 2 * w + h - 2) return { p - 2 * w + 1, 0 };
+        return { p - 2 * w - (h - 2) + 1, w - 1 };
+    }
+
+    size_t CellIndex(int x, int y) const {
+        int tx = x / T, ty = y / T;
+        return ((size_t)ty * tilesPerSide + tx) * T * T + (y - ty * T) * T + (x - tx * T);
+    }
+
+    // the cells around local cell (i, j) of tile t in the order of dx, dy; none outside the grid
+    void Around(int t, int i, int j, size_t around[8]) const {
+        const Tile& tile = tiles[t];
+        size_t c = (size_t)t * T * T + i * T + j;
+        if (i > 0 && j > 0 && i + 1 < tile.h && j + 1 < tile.w) {
+            for (int k = 0; k < 8; k++) around[k] = c + dy[k] * T + dx[k];
+            return;
+        }
+        int x = t % tilesPerSide * T + j, y = t / tilesPerSide * T + i, n = options.resolution;
+        for (int k = 0; k < 8; k++) {
+            int nx = x + dx[k], ny = y + dy[k];
+            around[k] = nx >= 0 && ny >= 0 && nx < n && ny < n ? CellIndex(nx, ny) : none;
+        }
+    }
+
+    // directions the water of cell c leaves in and their shares, none to two of them
+    int Outflow(size_t c, int k[2], float part[2]) const {
+        uint8_t d = direction[c];
+        if (d >= 8) return 0;
+        k[0] = d;
+        part[0] = options.method == FlowDInfinity ? share[c] : 1;
+        if (part[0] >= 1) return 1;
+        k[1] = (d + 1) & 7;
+        part[1] = 1 - part[0];
+        return 2;
+    }
+    // the neighbour that gets most of the water of c, 8 if none
+    int MainOutflow(size_t c) const {
+        int k[2];
+        float part[2];
+        int n = Outflow(c, k, part);
+        return n == 0 ? 8 : n == 2 && part[1] > part[0] ? k[1] : k[0];
+    }
+
+    // samples tile t and floods it from its perimeter: every cell gets the watershed of the perimeter
+    // cell that reached it and the level it fills up to inside the tile
+    void BuildTile(int t) {
+        const int tx = t % tilesPerSide, ty = t / tilesPerSide;
+        Tile& tile = tiles[t];
+        const int w = tile.w, h = tile.h;
+        const size_t offset = (size_t)t * T * T;
+        float * z = &height[offset], * fill = &localFill[offset];
+        uint16_t * label = &watershed[offset];
+        std::vector<float> rows((size_t)w * h);
+        sampler(options.u0 + (tx * T + 0.5) * step, options.v0 + (ty * T + 0.5) * step, step, w, h, rows.data());
+        for (int i = 0; i < h; i++) std::copy(&rows[(size_t)i * w], &rows[(size_t)i * w] + w, z + i * T);
+
+        // priority-flood, with cells below the level of the one that reached them in a plain queue (Barnes 2014)
+        MonotoneQueue open;
+        std::vector<int> pit;
+        size_t pitHead = 0;
+        std::vector<uint8_t> visited(T * T, 0);
+        const int perimeter = PerimeterCount(w, h);
+        for (int p = 0; p < perimeter; p++) {
+            std::pair<int, int> cell = PerimeterCell(w, h, p);
+            int c = cell.first * T + cell.second;
+            visited[c] = 1;
+            label[c] = (uint16_t)p;
+            fill[c] = z[c];
+            open.push(z[c], c);
+        }
+        SpillTable met;
+        while (!open.empty() || pitHead < pit.size()) {
+            int c = pitHead < pit.size() ? pit[pitHead++] : open.pop().second;
+            if (pitHead == pit.size()) {
+                pit.clear();
+                pitHead = 0;
+            }
+            const int i = c / T, j = c % T;
+            for (int k = 0; k < 8; k++) {
+                int ni = i + dy[k], nj = j + dx[k];
+                if (ni < 0 || nj < 0 || ni >= h || nj >= w) continue;
+                int n = ni * T + nj;
+                if (visited[n]) {
+                    if (label[n] != label[c])
+                        met.Add(label[c], label[n], std::max(fill[c], fill[n]));
+                    continue;
+                }
+                visited[n] = 1;
+                label[n] = label[c];
+                if (z[n] <= fill[c]) {
+                    fill[n] = fill[c];
+                    pit.push_back(n);
+                }
+                else {
+                    fill[n] = z[n];
+                    open.push(z[n], n);
+                }
+            }
+        }
+        tile.spills.clear();
+        for (size_t s = 0; s < met.keys.size(); s++)
+            if (met.keys[s] != SpillTable::empty)
+                tile.spills.push_back({ base[t] + (int)(met.keys[s] >> 16), base[t] + (int)(met.keys[s] & 0xFFFF), met.levels[s] });
+    }
+
+    // perimeter cells of tile t joined to the neighbouring cells of later tiles
+    void LinkTile(int t) {
+        Tile& tile = tiles[t];
+        tile.links.clear();
+        const int x0 = t % tilesPerSide * T, y0 = t / tilesPerSide * T, n = options.resolution;
+        for (int p = 0; p < PerimeterCount(tile.w, tile.h); p++) {
+            std::pair<int, int> cell = PerimeterCell(tile.w, tile.h, p);
+            int x = x0 + cell.second, y = y0 + cell.first;
+            for (int k = 0; k < 8; k++) {
+                int nx = x + dx[k], ny = y + dy[k];
+                if (nx < 0 || ny < 0 || nx >= n || ny >= n) continue;
+                int other = ny / T * tilesPerSide + nx / T;
+                if (other <= t) continue;
+                const Tile& neighbour = tiles[other];
+                int q = PerimeterIndex(neighbour.w, neighbour.h, ny - ny / T * T, nx - nx / T * T);
+                tile.links.push_back({ base[t] + p, base[other] + q,
+                                       std::max(height[CellIndex(x, y)], height[CellIndex(nx, ny)]) });
+            }
+        }
+    }
+
+    // level of every watershed: a priority-flood over the spill graph from the border of the grid
+    void SolveSpills() {
+        const int nTiles = (int)tiles.size(), nodes = base[nTiles], n = options.resolution;
+        std::vector<int> first(nodes + 1, 0);
+        for (const Tile& tile : tiles)
+            for (const std::vector<Spill> * edges : { &tile.spills, &tile.links })
+                for (const Spill& s : *edges) {
+                    first[s.a + 1]++;
+                    first[s.b + 1]++;
+                }
+        for (int a = 0; a < nodes; a++) first[a + 1] += first[a];
+        std::vector<int> fillPos(first.begin(), first.end() - 1), to(first[nodes]);
+        std::vector<float> over(first[nodes]);
+        for (const Tile& tile : tiles)
+            for (const std::vector<Spill> * edges : { &tile.spills, &tile.links })
+                for (const Spill& s : *edges) {
+                    to[fillPos[s.a]] = s.b;
+                    over[fillPos[s.a]++] = s.height;
+                    to[fillPos[s.b]] = s.a;
+                    over[fillPos[s.b]++] = s.height;
+                }
+
+        spill.assign(nodes, INFINITY);
+        MonotoneQueue open;
+        for (int t = 0; t < nTiles; t++) {
+            const Tile& tile = tiles[t];
+            const int x0 = t % tilesPerSide * T, y0 = t / tilesPerSide * T;
+            if (x0 > 0 && y0 > 0 && x0 + tile.w < n && y0 + tile.h < n) continue;
+            for (int p = 0; p < PerimeterCount(tile.w, tile.h); p++) {
+                std::pair<int, int> cell = PerimeterCell(tile.w, tile.h, p);
+                int x = x0 + cell.second, y = y0 + cell.first;
+                if (x > 0 && y > 0 && x < n - 1 && y < n - 1) continue;
+                spill[base[t] + p] = height[(size_t)t * T * T + cell.first * T + cell.second];
+                open.push(spill[base[t] + p], base[t] + p);
+            }
+        }
+        while (!open.empty()) {
+            std::pair<float, int> top = open.pop();
+            if (top.first > spill[top.second]) continue;
+            for (int e = first[top.second]; e < first[top.second + 1]; e++) {
+                float level = std::max(top.first, over[e]);
+                if (level < spill[to[e]]) {
+                    spill[to[e]] = level;
+                    open.push(level, to[e]);
+                }
+            }
+        }
+    }
+
+    // the filled surface, steepest descent on it, flats drained toward their outlets
+    void Directions() {
+        const int nTiles = (int)tiles.size(), n = options.resolution;
+        const bool dinf = options.method == FlowDInfinity;
+        std::vector<std::vector<size_t>> flats(nTiles);
+        parallelFor(nTiles, [&](int t) {
+            const size_t offset = (size_t)t * T * T;
+            for (int i = 0; i < tiles[t].h; i++)
+                for (int j = 0; j < tiles[t].w; j++) {
+                    size_t c = offset + i * T + j;
+                    filled[c] = std::max(localFill[c], spill[base[t] + watershed[c]]);
+                }
+        }, options.threads);
+        parallelFor(nTiles, [&](int t) {
+            const Tile& tile = tiles[t];
+            const size_t offset = (size_t)t * T * T;
+            const int x0 = t % tilesPerSide * T, y0 = t / tilesPerSide * T;
+            size_t around[8];
+            for (int i = 0; i < tile.h; i++) {
+                for (int j = 0; j < tile.w; j++) {
+                    size_t c = offset + i * T + j;
+                    Around(t, i, j, around);
+                    const float z = filled[c];
+                    int best = -1;
+                    float steepest = 0, part = 1;
+                    if (!dinf) {
+                        for (int k = 0; k < 8; k++) {
+                            if (around[k] == none) continue;
+                            float slope = (z - filled[around[k]]) * (k & 1 ? (float)M_SQRT1_2 : 1.0f);
+                            if (slope > steepest) {
+                                steepest = slope;
+                                best = k;
+                            }
+                        }
+                    }
+                    else {
+                        // facet f between the cardinal and the diagonal neighbour, r the angle of the flow from the
+                        // cardinal one, clamped to the facet: s2 < 0 is r < 0, s2 > s1 is r > pi / 4
+                        for (int f = 0; f < 8; f++) {
+                            int cardinal = (f + (f & 1)) & 7, diagonal = f | 1;
+                            if (around[cardinal] == none || around[diagonal] == none) continue;
+                            double e1 = filled[around[cardinal]], e2 = filled[around[diagonal]];
+                            double s1 = z - e1, s2 = e1 - e2, r, slope;
+                            if (s2 < 0) {
+                                r = 0;
+                                slope = s1;
+                            }
+                            else if (s2 > s1) {
+                                r = M_PI / 4;
+                                slope = (z - e2) * M_SQRT1_2;
+                            }
+                            else {
+                                slope = sqrt(s1 * s1 + s2 * s2);
+                                if (slope <= steepest) continue;
+                                r = atan2(s2, s1);
+                            }
+                            if (slope > steepest) {
+                                steepest = (float)slope;
+                                // the share of the lower numbered direction of the facet
+                                best = f;
+                                part = (float)(f & 1 ? r / (M_PI / 4) : 1 - r / (M_PI / 4));
+                            }
+                        }
+                        if (best >= 0 && part <= 0) {
+                            best = (best + 1) & 7;
+                            part = 1;
+                        }
+                    }
+                    int x = x0 + j, y = y0 + i;
+                    bool border = x == 0 || y == 0 || x == n - 1 || y == n - 1;
+                    direction[c] = best >= 0 ? (uint8_t)best : border ? outlet : unresolved;
+                    if (dinf) share[c] = part;
+                    inflow[c] = direction[c] == unresolved;
+                    if (inflow[c]) flats[t].push_back(c);
+                }
+            }
+        }, options.threads);
+        // breadth first over every flat from its outlets, each cell toward the one that reached it. Tiles run
+        // in parallel, each writing only its own cells, and hand over those of a flat that continue in another
+        // tile between rounds; inflow marks the cells of flats meanwhile
+        std::vector<std::vector<std::pair<size_t, uint8_t>>> claims(nTiles), handover(nTiles);
+        parallelFor(nTiles, [&](int t) {
+            size_t around[8];
+            for (size_t c : flats[t]) {
+                size_t local = c % ((size_t)T * T);
+                Around(t, (int)(local / T), (int)(local % T), around);
+                for (int k = 0; k < 8; k++) {
+                    if (around[k] != none && !inflow[around[k]] && filled[around[k]] == filled[c]) {
+                        claims[t].push_back({ c, (uint8_t)k });
+                        break;
+                    }
+                }
+            }
+        }, options.threads);
+        for (;;) {
+            std::vector<int> active;
+            for (int t = 0; t < nTiles; t++)
+                if (!claims[t].empty()) active.push_back(t);
+            if (active.empty()) break;
+            parallelFor((int)active.size(), [&](int a) {
+                const int t = active[a];
+                std::vector<size_t> queue;
+                for (const std::pair<size_t, uint8_t>& claim : claims[t]) {
+                    if (direction[claim.first] != unresolved) continue;
+                    direction[claim.first] = claim.second;
+                    if (dinf) share[claim.first] = 1;
+                    queue.push_back(claim.first);
+                }
+                claims[t].clear();
+                size_t around[8];
+                for (size_t head = 0; head < queue.size(); head++) {
+                    size_t c = queue[head], local = c % ((size_t)T * T);
+                    Around(t, (int)(local / T), (int)(local % T), around);
+                    for (int k = 0; k < 8; k++) {
+                        size_t m = around[k];
+                        if (m == none || !inflow[m] || filled[m] != filled[c]) continue;
+                        if (m / ((size_t)T * T) != (size_t)t) handover[t].push_back({ m, (uint8_t)((k + 4) & 7) });
+                        else if (direction[m] == unresolved) {
+                            direction[m] = (uint8_t)((k + 4) & 7);
+                            if (dinf) share[m] = 1;
+                            queue.push_back(m);
+                        }
+                    }
+                }
+            }, options.threads);
+            for (int t : active) {
+                for (const std::pair<size_t, uint8_t>& claim : handover[t]) claims[claim.first / ((size_t)T * T)].push_back(claim);
+                handover[t].clear();
+            }
+        }
+        parallelFor(nTiles, [&](int t) {     // none should be left, as every flat has an outlet
+            for (size_t c : flats[t])
+                if (direction[c] == unresolved) direction[c] = outlet;
+        }, options.threads);
+    }
+
+    // a cell accumulates itself and the shares of its donors, once all of them are done
+    void Accumulate() {
+        const int nTiles = (int)tiles.size();
+        const bool dinf = options.method == FlowDInfinity;
+        parallelFor(nTiles, [&](int t) {
+            const size_t offset = (size_t)t * T * T;
+            size_t around[8];
+            tiles[t].ready.clear();
+            for (int i = 0; i < tiles[t].h; i++) {
+                for (int j = 0; j < tiles[t].w; j++) {
+                    size_t c = offset + i * T + j;
+                    Around(t, i, j, around);
+                    uint8_t donors = 0;
+                    for (int k = 0; k < 8; k++) {
+                        if (around[k] == none) continue;
+                        int out[2];
+                        float part[2];
+                        int outflows = Outflow(around[k], out, part);
+                        for (int o = 0; o < outflows; o++)
+                            if (out[o] == ((k + 4) & 7)) donors |= 1 << k;
+                    }
+                    inflow[c] = donors;
+                    pending[c].store((uint8_t)std::popcount(donors), std::memory_order_relaxed);
+                    if (donors == 0) tiles[t].ready.push_back(c);
+                }
+            }
+        }, options.threads);
+
+        std::vector<std::vector<size_t>> handover(nTiles);
+        timings.rounds = 0;
+        for (;;) {
+            std::vector<int> active;
+            for (int t = 0; t < nTiles; t++)
+                if (!tiles[t].ready.empty()) active.push_back(t);
+            if (active.empty()) break;
+            timings.rounds++;
+            parallelFor((int)active.size(), [&](int a) {
+                const int t = active[a], w = tiles[t].w, h = tiles[t].h;
+                std::vector<size_t> stack;
+                stack.swap(tiles[t].ready);
+                size_t around[8];
+                while (!stack.empty()) {
+                    size_t c = stack.back(), local = c % ((size_t)T * T);
+                    stack.pop_back();
+                    const int i = (int)(local / T), j = (int)(local % T);
+                    Around(t, i, j, around);
+                    float sum = 1;
+                    for (int k = 0; k < 8; k++) {
+                        if (!(inflow[c] >> k & 1)) continue;
+                        size_t donor = around[k];
+                        float part = !dinf ? 1 : direction[donor] == ((k + 4) & 7) ? share[donor] : 1 - share[donor];
+                        sum += part * accumulation[donor];
+                    }
+                    accumulation[c] = sum;
+                    int out[2];
+                    float part[2];
+                    int outflows = Outflow(c, out, part);
+                    for (int o = 0; o < outflows; o++) {
+                        size_t r = around[out[o]];
+                        int ri = i + dy[out[o]], rj = j + dx[out[o]];
+                        // only this thread counts down cells inside the tile, away from its border
+                        if (ri > 0 && rj > 0 && ri < h - 1 && rj < w - 1) {
+                            uint8_t left = pending[r].load(std::memory_order_relaxed) - 1;
+                            pending[r].store(left, std::memory_order_relaxed);
+                            if (left == 0) stack.push_back(r);
+                            continue;
+                        }
+                        if (pending[r].fetch_sub(1, std::memory_order_acq_rel) != 1) continue;
+                        if (ri >= 0 && rj >= 0 && ri < h && rj < w) stack.push_back(r);
+                        else handover[t].push_back(r);
+                    }
+                }
+            }, options.threads);
+            for (int t : active) {
+                for (size_t r : handover[t]) tiles[r / ((size_t)T * T)].ready.push_back(r);
+                handover[t].clear();
+            }
+        }
+    }
+
+    // everything after the local floods
+    void Finish() {
+        auto seconds = [](std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        };
+        auto start = std::chrono::steady_clock::now();
+        SolveSpills();
+        timings.spill = seconds(start);
+        start = std::chrono::steady_clock::now();
+        Directions();
+        timings.directions = seconds(start);
+        start = std::chrono::steady_clock::now();
+        Accumulate();
+        timings.accumulation = seconds(start);
+    }
+
+public:
+    // samples and analyses the whole grid; false if the memory cannot be had
+    bool Build(const FlowOptions& _options, const FlowSampler& _sampler) {
+        options = _options;
+        sampler = _sampler;
+        options.resolution = std::max(options.resolution, 1);
+        T = std::min(std::max(options.tileCells, 8), 1024);     // perimeter indices fit 16 bits
+        tilesPerSide = (options.resolution + T - 1) / T;
+        step = options.size / options.resolution;
+        const size_t cells = (size_t)tilesPerSide * tilesPerSide * T * T;
+        if (!height.Allocate(cells, options.pages) || !localFill.Allocate(cells, options.pages) ||
+            !filled.Allocate(cells, options.pages) || !accumulation.Allocate(cells, options.pages) ||
+            !watershed.Allocate(cells, options.pages) || !direction.Allocate(cells, options.pages) ||
+            !inflow.Allocate(cells, options.pages)) return false;
+        if (options.method == FlowDInfinity && !share.Allocate(cells, options.pages)) return false;
+        pending.reset(new std::atomic<uint8_t>[cells]);
+        tiles.assign(tilesPerSide * tilesPerSide, Tile());
+        base.assign(tiles.size() + 1, 0);
+        for (int t = 0; t < (int)tiles.size(); t++) {
+            tiles[t].w = std::min(T, options.resolution - t % tilesPerSide * T);
+            tiles[t].h = std::min(T, options.resolution - t / tilesPerSide * T);
+            base[t + 1] = base[t] + PerimeterCount(tiles[t].w, tiles[t].h);
+        }
+        auto start = std::chrono::steady_clock::now();
+        parallelFor((int)tiles.size(), [&](int t) { BuildTile(t); }, options.threads);
+        parallelFor((int)tiles.size(), [&](int t) { LinkTile(t); }, options.threads);
+        timings.flood = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        Finish();
+        return true;
+    }
+
+    // samples and floods again the tiles that overlap [u0, u1] x [v0, v1] of parameter space, after the
+    // terrain there changed, and redoes the stages after the floods; returns the number of tiles flooded
+    int Rebuild(double u0, double v0, double u1, double v1) {
+        if (tiles.empty()) return 0;
+        auto tileOf = [&](double p, double origin) {
+            return std::min(std::max((int)floor((p - origin) / (step * T)), 0), tilesPerSide - 1);
+        };
+        int tx0 = tileOf(u0, options.u0), tx1 = tileOf(u1, options.u0), ty0 = tileOf(v0, options.v0), ty1 = tileOf(v1, options.v0);
+        std::vector<int> changed, relink;
+        for (int ty = ty0; ty <= ty1; ty++)
+            for (int tx = tx0; tx <= tx1; tx++) changed.push_back(ty * tilesPerSide + tx);
+        // links are kept by the earlier tile of the two: those of a changed tile and of its earlier neighbours
+        for (int ty = std::max(ty0 - 1, 0); ty <= ty1; ty++)
+            for (int tx = std::max(tx0 - 1, 0); tx <= std::min(tx1 + 1, tilesPerSide - 1); tx++) relink.push_back(ty * tilesPerSide + tx);
+        auto start = std::chrono::steady_clock::now();
+        parallelFor((int)changed.size(), [&](int i) { BuildTile(changed[i]); }, options.threads);
+        parallelFor((int)relink.size(), [&](int i) { LinkTile(relink[i]); }, options.threads);
+        timings.flood = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        Finish();
+        return (int)changed.size();
+    }
+
+    int Resolution() const { return options.resolution; }
+    int TilesPerSide() const { return tilesPerSide; }
+    const FlowTimings& Timings() const { return timings; }
+
+    // cell (x, y) covers parameter space from (u0 + x * size / resolution, v0 + y * size / resolution)
+    float Height(int x, int y) const { return height[CellIndex(x, y)]; }
+    float Filled(int x, int y) const { return filled[CellIndex(x, y)]; }
+    float LakeDepth(int x, int y) const { return Filled(x, y) - Height(x, y); }
+    // cells draining through the cell, itself included
+    float Accumulation(int x, int y) const { return accumulation[CellIndex(x, y)]; }
+    // neighbour that gets most of the water, -1 if it drains off the grid
+    int Direction(int x, int y) const {
+        int k = MainOutflow(CellIndex(x, y));
+        return k < 8 ? k : -1;
+    }
+    // of the flow counterclockwise from east in radians, -1 if it drains off the grid
+    float Angle(int x, int y) const {
+        size_t c = CellIndex(x, y);
+        if (direction[c] >= 8) return -1;
+        return (float)((direction[c] + (options.method == FlowDInfinity ? 1 - share[c] : 0)) * M_PI / 4);
+    }
+
+    // row-major into resolution x resolution floats
+    void AccumulationGrid(float * out) const {
+        const int n = options.resolution;
+        parallelFor(n, [&](int y) {
+            for (int x = 0; x < n; x++) out[(size_t)y * n + x] = Accumulation(x, y);
+        }, options.threads);
+    }
+
+    // drainage basin of every cell, following the main outflow: the row-major index y * resolution + x of
+    // the border cell it leaves the grid at, row-major into resolution x resolution ints
+    void Basins(int * out) const {
+        const int n = options.resolution, nTiles = (int)tiles.size();
+        // inside a tile: the outlet, or -(first cell past the tile + 1)
+        parallelFor(nTiles, [&](int t) {
+            const Tile& tile = tiles[t];
+            const int x0 = t % tilesPerSide * T, y0 = t / tilesPerSide * T;
+            for (int i = 0; i < tile.h; i++)
+                for (int j = 0; j < tile.w; j++) out[(size_t)(y0 + i) * n + x0 + j] = INT_MIN;
+            std::vector<size_t> path;
+            for (int i = 0; i < tile.h; i++) {
+                for (int j = 0; j < tile.w; j++) {
+                    int x = x0 + j, y = y0 + i, value;
+                    for (;;) {
+                        size_t at = (size_t)y * n + x;
+                        if (out[at] != INT_MIN) {
+                            value = out[at];
+                            break;
+                        }
+                        path.push_back(at);
+                        int k = MainOutflow(CellIndex(x, y));
+                        if (k == 8) {
+                            value = (int)at;
+                            break;
+                        }
+                        x += dx[k];
+                        y += dy[k];
+                        if (x < x0 || y < y0 || x >= x0 + tile.w || y >= y0 + tile.h) {
+                            value = -((int)((size_t)y * n + x) + 1);
+                            break;
+                        }
+                    }
+                    for (size_t at : path) out[at] = value;
+                    path.clear();
+                }
+            }
+        }, options.threads);
+        // across tiles, where the chains enter only perimeter cells
+        std::vector<size_t> path;
+        for (int t = 0; t < nTiles; t++) {
+            const Tile& tile = tiles[t];
+            const int x0 = t % tilesPerSide * T, y0 = t / tilesPerSide * T;
+            for (int p = 0; p < PerimeterCount(tile.w, tile.h); p++) {
+                std::pair<int, int> cell = PerimeterCell(tile.w, tile.h, p);
+                size_t at = (size_t)(y0 + cell.first) * n + x0 + cell.second;
+                while (out[at] < 0) {
+                    path.push_back(at);
+                    at = (size_t)(-out[at] - 1);
+                }
+                for (size_t on : path) out[on] = out[at];
+                path.clear();
+            }
+        }
+        parallelFor(n, [&](int y) {
+            for (int x = 0; x < n; x++) {
+                int& value = out[(size_t)y * n + x];
+                if (value < 0) value = out[-value - 1];
+            }
+        }, options.threads);
+    }
+};
@@ -5,6 +5,9 @@
 //=============================================================================================
 #include "framework.h"
 
+// Command line arguments, before any window is opened: return true if the program is done
+bool onCommandLine(int argc, char * argv[]);
+
 // Initialization
 void onInitialization();
 
@@ -28,6 +31,8 @@ void onIdle();
 
 // Entry point of the application
 int main(int argc, char * argv[]) {
+	if (onCommandLine(argc, argv)) return 0;
+
 	// Initialize GLUT, Glew and OpenGL 
 	glutInit(&argc, argv);
 
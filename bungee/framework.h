@@ -11,6 +11,8 @@
 #include <math.h>
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
@@ -31,16 +33,16 @@ struct vec2 {
 //--------------------------
 	float x, y;
 
-	vec2(float x0 = 0, float y0 = 0) { x = x0; y = y0; }
-	vec2 operator*(float a) const { return vec2(x * a, y * a); }
-	vec2 operator/(float a) const { return vec2(x / a, y / a); }
-	vec2 operator+(const vec2& v) const { return vec2(x + v.x, y + v.y); }
-	vec2 operator-(const vec2& v) const { return vec2(x - v.x, y - v.y); }
-	vec2 operator*(const vec2& v) const { return vec2(x * v.x, y * v.y); }
-	vec2 operator-() const { return vec2(-x, -y); }
+	constexpr vec2(float x0 = 0, float y0 = 0) : x(x0), y(y0) {}
+	constexpr vec2 operator*(float a) const { return vec2(x * a, y * a); }
+	constexpr vec2 operator/(float a) const { return vec2(x / a, y / a); }
+	constexpr vec2 operator+(const vec2& v) const { return vec2(x + v.x, y + v.y); }
+	constexpr vec2 operator-(const vec2& v) const { return vec2(x - v.x, y - v.y); }
+	constexpr vec2 operator*(const vec2& v) const { return vec2(x * v.x, y * v.y); }
+	constexpr vec2 operator-() const { return vec2(-x, -y); }
 };
 
-inline float dot(const vec2& v1, const vec2& v2) {
+constexpr float dot(const vec2& v1, const vec2& v2) {
 	return (v1.x * v2.x + v1.y * v2.y);
 }
 
@@ -48,58 +50,63 @@ inline float length(const vec2& v) { return sqrtf(dot(v, v)); }
 
 inline vec2 normalize(const vec2& v) { return v * (1 / length(v)); }
 
-inline vec2 operator*(float a, const vec2& v) { return vec2(v.x * a, v.y * a); }
+constexpr vec2 operator*(float a, const vec2& v) { return vec2(v.x * a, v.y * a); }
 
 //--------------------------
 struct vec3 {
 //--------------------------
 	float x, y, z;
 
-	vec3(float x0 = 0, float y0 = 0, float z0 = 0) { x = x0; y = y0; z = z0; }
-	vec3(vec2 v) { x = v.x; y = v.y; z = 0; }
+	constexpr vec3(float x0 = 0, float y0 = 0, float z0 = 0) : x(x0), y(y0), z(z0) {}
+	constexpr vec3(const vec2& v) : x(v.x), y(v.y), z(0) {}
 
-	vec3 operator*(float a) const { return vec3(x * a, y * a, z * a); }
-	vec3 operator/(float a) const { return vec3(x / a, y / a, z / a); }
-	vec3 operator+(const vec3& v) const { return vec3(x + v.x, y + v.y, z + v.z); }
-	vec3 operator-(const vec3& v) const { return vec3(x - v.x, y - v.y, z - v.z); }
-	vec3 operator*(const vec3& v) const { return vec3(x * v.x, y * v.y, z * v.z); }
-	vec3 operator-()  const { return vec3(-x, -y, -z); }
+	constexpr vec3 operator*(float a) const { return vec3(x * a, y * a, z * a); }
+	constexpr vec3 operator/(float a) const { return vec3(x / a, y / a, z / a); }
+	constexpr vec3 operator+(const vec3& v) const { return vec3(x + v.x, y + v.y, z + v.z); }
+	constexpr vec3 operator-(const vec3& v) const { return vec3(x - v.x, y - v.y, z - v.z); }
+	constexpr vec3 operator*(const vec3& v) const { return vec3(x * v.x, y * v.y, z * v.z); }
+	constexpr vec3 operator-()  const { return vec3(-x, -y, -z); }
 };
 
-inline float dot(const vec3& v1, const vec3& v2) { return (v1.x * v2.x + v1.y * v2.y + v1.z * v2.z); }
+constexpr float dot(const vec3& v1, const vec3& v2) { return (v1.x * v2.x + v1.y * v2.y + v1.z * v2.z); }
 
 inline float length(const vec3& v) { return sqrtf(dot(v, v)); }
 
 inline vec3 normalize(const vec3& v) { return v * (1 / length(v)); }
 
-inline vec3 cross(const vec3& v1, const vec3& v2) {
+constexpr vec3 cross(const vec3& v1, const vec3& v2) {
 	return vec3(v1.y * v2.z - v1.z * v2.y, v1.z * v2.x - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x);
 }
 
-inline vec3 operator*(float a, const vec3& v) { return vec3(v.x * a, v.y * a, v.z * a); }
+constexpr vec3 operator*(float a, const vec3& v) { return vec3(v.x * a, v.y * a, v.z * a); }
 
 //--------------------------
 struct vec4 {
 //--------------------------
 	float x, y, z, w;
 
-	vec4(float x0 = 0, float y0 = 0, float z0 = 0, float w0 = 0) { x = x0; y = y0; z = z0; w = w0; }
-	float& operator[](int j) { return *(&x + j); }
-	float operator[](int j) const { return *(&x + j); }
+	constexpr vec4(float x0 = 0, float y0 = 0, float z0 = 0, float w0 = 0) : x(x0), y(y0), z(z0), w(w0) {}
+	// a switch instead of pointer arithmetic, which constant evaluation rejects; constant indices fold away
+	constexpr float& operator[](int j) {
+		switch (j) { case 0: return x; case 1: return y; case 2: return z; default: return w; }
+	}
+	constexpr float operator[](int j) const {
+		switch (j) { case 0: return x; case 1: return y; case 2: return z; default: return w; }
+	}
 
-	vec4 operator*(float a) const { return vec4(x * a, y * a, z * a, w * a); }
-	vec4 operator/(float d) const { return vec4(x / d, y / d, z / d, w / d); }
-	vec4 operator+(const vec4& v) const { return vec4(x + v.x, y + v.y, z + v.z, w + v.w); }
-	vec4 operator-(const vec4& v)  const { return vec4(x - v.x, y - v.y, z - v.z, w - v.w); }
-	vec4 operator*(const vec4& v) const { return vec4(x * v.x, y * v.y, z * v.z, w * v.w); }
-	void operator+=(const vec4 right) { x += right.x; y += right.y; z += right.z; w += right.w; }
+	constexpr vec4 operator*(float a) const { return vec4(x * a, y * a, z * a, w * a); }
+	constexpr vec4 operator/(float d) const { return vec4(x / d, y / d, z / d, w / d); }
+	constexpr vec4 operator+(const vec4& v) const { return vec4(x + v.x, y + v.y, z + v.z, w + v.w); }
+	constexpr vec4 operator-(const vec4& v)  const { return vec4(x - v.x, y - v.y, z - v.z, w - v.w); }
+	constexpr vec4 operator*(const vec4& v) const { return vec4(x * v.x, y * v.y, z * v.z, w * v.w); }
+	constexpr void operator+=(const vec4& right) { x += right.x; y += right.y; z += right.z; w += right.w; }
 };
 
-inline float dot(const vec4& v1, const vec4& v2) {
+constexpr float dot(const vec4& v1, const vec4& v2) {
 	return (v1.x * v2.x + v1.y * v2.y + v1.z * v2.z + v1.w * v2.w);
 }
 
-inline vec4 operator*(float a, const vec4& v) {
+constexpr vec4 operator*(float a, const vec4& v) {
 	return vec4(v.x * a, v.y * a, v.z * a, v.w * a);
 }
 
@@ -108,43 +115,37 @@ struct mat4 { // row-major matrix 4x4
 //---------------------------
 	vec4 rows[4];
 public:
-	mat4() {}
-	mat4(float m00, float m01, float m02, float m03,
+	constexpr mat4() {}
+	constexpr mat4(float m00, float m01, float m02, float m03,
 		float m10, float m11, float m12, float m13,
 		float m20, float m21, float m22, float m23,
-		float m30, float m31, float m32, float m33) {
-		rows[0][0] = m00; rows[0][1] = m01; rows[0][2] = m02; rows[0][3] = m03;
-		rows[1][0] = m10; rows[1][1] = m11; rows[1][2] = m12; rows[1][3] = m13;
-		rows[2][0] = m20; rows[2][1] = m21; rows[2][2] = m22; rows[2][3] = m23;
-		rows[3][0] = m30; rows[3][1] = m31; rows[3][2] = m32; rows[3][3] = m33;
-	}
-	mat4(vec4 it, vec4 jt, vec4 kt, vec4 ot) {
-		rows[0] = it; rows[1] = jt; rows[2] = kt; rows[3] = ot;
-	}
+		float m30, float m31, float m32, float m33) :
+		rows{ vec4(m00, m01, m02, m03), vec4(m10, m11, m12, m13), vec4(m20, m21, m22, m23), vec4(m30, m31, m32, m33) } {}
+	constexpr mat4(const vec4& it, const vec4& jt, const vec4& kt, const vec4& ot) : rows{ it, jt, kt, ot } {}
 
-	vec4& operator[](int i) { return rows[i]; }
-	vec4 operator[](int i) const { return rows[i]; }
+	constexpr vec4& operator[](int i) { return rows[i]; }
+	constexpr const vec4& operator[](int i) const { return rows[i]; }
 	operator float*() const { return (float*)this; }
 };
 
-inline vec4 operator*(const vec4& v, const mat4& mat) {
+constexpr vec4 operator*(const vec4& v, const mat4& mat) {
 	return v[0] * mat[0] + v[1] * mat[1] + v[2] * mat[2] + v[3] * mat[3];
 }
 
-inline mat4 operator*(const mat4& left, const mat4& right) {
+constexpr mat4 operator*(const mat4& left, const mat4& right) {
 	mat4 result;
 	for (int i = 0; i < 4; i++) result.rows[i] = left.rows[i] * right;
 	return result;
 }
 
-inline mat4 TranslateMatrix(vec3 t) {
+constexpr mat4 TranslateMatrix(const vec3& t) {
 	return mat4(vec4(1,   0,   0,   0),
 			    vec4(0,   1,   0,   0),
 				vec4(0,   0,   1,   0),
 				vec4(t.x, t.y, t.z, 1));
 }
 
-inline mat4 ScaleMatrix(vec3 s) {
+constexpr mat4 ScaleMatrix(const vec3& s) {
 	return mat4(vec4(s.x, 0,   0,   0),
 			    vec4(0,   s.y, 0,   0),
 				vec4(0,   0,   s.z, 0),
@@ -160,6 +161,11 @@ inline mat4 RotationMatrix(float angle, vec3 w) {
 			    vec4(0, 0, 0, 1));
 }
 
+// The math above is usable in constant expressions
+static_assert(dot(cross(vec3(1, 0, 0), vec3(0, 1, 0)), vec3(0, 0, 1)) == 1, "constexpr vec3");
+static_assert(TranslateMatrix(vec3(1, 2, 3))[3][2] == 3, "constexpr mat4");
+static_assert((vec4(1, 2, 3, 1) * (TranslateMatrix(vec3(1, 1, 1)) * ScaleMatrix(vec3(2, 2, 2))))[0] == 4, "constexpr mat4 product");
+
 //---------------------------
 class Texture {
 //---------------------------
@@ -228,7 +234,10 @@ public:
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampling);
 	}
 
-	~Texture() {
+	// textures made on demand create their image here, when a program that samples them is bound
+	virtual void Prepare() {}
+
+	virtual ~Texture() {
 		if (textureId > 0) glDeleteTextures(1, &textureId);
 	}
 };
@@ -237,9 +246,14 @@ public:
 class GPUProgram {
 //--------------------------
 	unsigned int shaderProgramId = 0;
-	unsigned int vertexShader = 0, geometryShader = 0, fragmentShader = 0;
+	unsigned int vertexShader = 0, geometryShader = 0, fragmentShader = 0, computeShader = 0;
 	bool waitError = true;
 
+	struct ActiveUniform { int location, type, size; };
+	std::unordered_map<std::string, ActiveUniform> uniforms;	// what the linker kept, array elements also by index
+	std::unordered_map<std::string, unsigned int> blocks;		// active uniform blocks
+	std::unordered_set<std::string> reported;					// names set but not active, reported once
+
 	void getErrorInfo(unsigned int handle) { // shader error report
 		int logLen, written;
 		glGetShaderiv(handle, GL_INFO_LOG_LENGTH, &logLen);
@@ -273,10 +287,47 @@ class GPUProgram {
 		return true;
 	}
 
-	int getLocation(const std::string& name) {	// get the address of a GPU uniform variable
-		int location = glGetUniformLocation(shaderProgramId, name.c_str());
-		if (location < 0) printf("uniform %s cannot be set\n", name.c_str());
-		return location;
+	// uniforms and blocks of the linked program; what the compiler optimized out is not among them
+	void reflect() {
+		uniforms.clear();
+		blocks.clear();
+		reported.clear();
+		int count = 0, maxLength = 0;
+		glGetProgramiv(shaderProgramId, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(shaderProgramId, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+		std::vector<char> buffer(maxLength + 1);
+		for (int i = 0; i < count; i++) {
+			int length = 0, size = 0;
+			GLenum type = 0;
+			glGetActiveUniform(shaderProgramId, i, (int)buffer.size(), &length, &size, &type, &buffer[0]);
+			std::string name(&buffer[0], length);
+			int location = glGetUniformLocation(shaderProgramId, name.c_str());
+			if (location < 0) continue;		// member of a uniform block
+			uniforms[name] = { location, (int)type, size };
+			if (name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0) {	// an array: its name and elements
+				std::string array = name.substr(0, name.size() - 3);
+				uniforms[array] = { location, (int)type, size };
+				for (int e = 1; e < size; e++) {
+					std::string element = array + "[" + std::to_string(e) + "]";
+					uniforms[element] = { glGetUniformLocation(shaderProgramId, element.c_str()), (int)type, 1 };
+				}
+			}
+		}
+		glGetProgramiv(shaderProgramId, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+		glGetProgramiv(shaderProgramId, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+		buffer.resize(maxLength + 1);
+		for (int i = 0; i < count; i++) {
+			int length = 0;
+			glGetActiveUniformBlockName(shaderProgramId, i, (int)buffer.size(), &length, &buffer[0]);
+			blocks[std::string(&buffer[0], length)] = i;
+		}
+	}
+
+	int getLocation(const std::string& name) {	// get the address of a GPU uniform variable, -1 if the program does not use it
+		auto uniform = uniforms.find(name);
+		if (uniform != uniforms.end()) return uniform->second.location;
+		if (reported.insert(name).second) printf("uniform %s is not used by the program, it is not set\n", name.c_str());
+		return -1;
 	}
 
 public:
@@ -344,16 +395,55 @@ public:
 		// program packaging
 		glLinkProgram(shaderProgramId);
 		if (!checkLinking(shaderProgramId)) return false;
+		reflect();
 
 		// make this program run
 		glUseProgram(shaderProgramId);
 		return true;
 	}
 
+#if defined(GL_COMPUTE_SHADER)
+	// Compute shaders need OpenGL 4.3, which macOS does not provide
+	bool createCompute(const char * const computeShaderSource) {
+		if (computeShader == 0) computeShader = glCreateShader(GL_COMPUTE_SHADER);
+		if (!computeShader) {
+			printf("Error in compute shader creation\n");
+			exit(1);
+		}
+		glShaderSource(computeShader, 1, (const GLchar**)&computeShaderSource, NULL);
+		glCompileShader(computeShader);
+		if (!checkShader(computeShader, "Compute shader error")) return false;
+
+		shaderProgramId = glCreateProgram();
+		if (!shaderProgramId) {
+			printf("Error in shader program creation\n");
+			exit(1);
+		}
+		glAttachShader(shaderProgramId, computeShader);
+		glLinkProgram(shaderProgramId);
+		if (!checkLinking(shaderProgramId)) return false;
+		reflect();
+
+		glUseProgram(shaderProgramId);
+		return true;
+	}
+#endif
+
 	void Use() { 		// make this program run
 		glUseProgram(shaderProgramId);
 	}
 
+	// true if the linked program reads the uniform (or sampler); setting one it does not read does nothing
+	bool uses(const std::string& name) const { return uniforms.count(name) > 0; }
+
+	int activeUniforms() const { return (int)uniforms.size(); }
+
+	// connects the uniform block to a buffer binding point if the program has it
+	void bindUniformBlock(const std::string& name, unsigned int binding) {
+		auto block = blocks.find(name);
+		if (block != blocks.end()) glUniformBlockBinding(shaderProgramId, block->second, binding);
+	}
+
 	void setUniform(int i, const std::string& name) {
 		int location = getLocation(name);
 		if (location >= 0) glUniform1i(location, i);
@@ -384,9 +474,10 @@ public:
 		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, mat);
 	}
 
-	void setUniform(const Texture& texture, const std::string& samplerName, unsigned int textureUnit = 0) {
+	void setUniform(Texture& texture, const std::string& samplerName, unsigned int textureUnit = 0) {
 		int location = getLocation(samplerName);
-		if (location >= 0) {
+		if (location >= 0) {		// a texture is made and bound only for a program that samples it
+			texture.Prepare();
 			glUniform1i(location, textureUnit);
 			glActiveTexture(GL_TEXTURE0 + textureUnit);
 			glBindTexture(GL_TEXTURE_2D, texture.textureId);
@@ -0,0 +1,138 @@
+//=============================================================================================
+// Minimal CPU parallelism for the generators: a blocking parallel for over an index range
+// and a queue of cancellable background jobs
+//=============================================================================================
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if defined(__APPLE__)
+#include <pthread.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Number of worker threads to use when the caller does not say
+inline int defaultThreadCount() {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? (int)n : 1;
+}
+
+// Calls body(i) for every i in [0, count) and returns when all calls are done.
+// Indices are handed out one by one, so uneven work items balance themselves.
+// If a thread cannot be started the exception is rethrown once the started threads have been joined;
+// a body run on the worker threads must not throw.
+template<class F> void parallelFor(int count, F body, int nThreads = 0) {
+    if (nThreads <= 0) nThreads = defaultThreadCount();
+    if (nThreads > count) nThreads = count;
+    if (nThreads <= 1) {
+        for (int i = 0; i < count; i++) body(i);
+        return;
+    }
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) body(i);
+    };
+    std::vector<std::thread> threads;
+    try {
+        threads.reserve(nThreads - 1);
+        for (int t = 1; t < nThreads; t++) threads.emplace_back(worker);
+        worker();
+    }
+    catch (...) {   // a thread that did not start or a throwing body on this thread: stop, join the started ones
+        next = count;
+        for (std::thread& thread : threads) thread.join();
+        throw;
+    }
+    for (std::thread& thread : threads) thread.join();
+}
+
+// Shared between a queued job and whoever queued it; setting it drops the job if it has not started yet
+typedef std::shared_ptr<std::atomic<bool>> CancelToken;
+
+inline CancelToken makeCancelToken() { return std::make_shared<std::atomic<bool>>(false); }
+
+// Lets the scheduler prefer the render thread over the calling thread
+inline void lowerThreadPriority() {
+#if defined(__APPLE__)
+    pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#elif defined(__linux__)
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+#endif
+}
+
+//---------------------------
+class JobQueue {
+//---------------------------
+// Background workers that run the queued job of the lowest priority value first, equal priorities in
+// queueing order. A job whose token is set before it starts is dropped; a running one may poll its token.
+    struct Job {
+        float priority;
+        unsigned long long order;
+        CancelToken token;
+        std::function<void()> work;
+        bool operator<(const Job& job) const {  // heap order: the top is the most urgent
+            return priority != job.priority ? priority > job.priority : order > job.order;
+        }
+    };
+    std::vector<Job> heap;
+    unsigned long long queued = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<std::thread> threads;
+
+    void Work(bool lowPriority) {
+        if (lowPriority) lowerThreadPriority();
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !heap.empty(); });
+                if (stopping) return;
+                std::pop_heap(heap.begin(), heap.end());
+                job = std::move(heap.back());
+                heap.pop_back();
+            }
+            if (!*job.token) job.work();
+        }
+    }
+
+public:
+    JobQueue(int nThreads = 0, bool lowPriority = true) {
+        if (nThreads <= 0) nThreads = defaultThreadCount();
+        for (int t = 0; t < nThreads; t++) threads.emplace_back(&JobQueue::Work, this, lowPriority);
+    }
+
+    void Push(float priority, CancelToken token, std::function<void()> work) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            heap.push_back({ priority, queued++, token, std::move(work) });
+            std::push_heap(heap.begin(), heap.end());
+        }
+        wake.notify_one();
+    }
+
+    // jobs not started yet, cancelled ones included until a worker drops them
+    int Pending() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return (int)heap.size();
+    }
+
+    // drops the jobs that have not started and waits for the running ones
+    ~JobQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads) thread.join();
+    }
+};
@@ -0,0 +1,229 @@
+//=============================================================================================
+// Page backed buffers for the big generation arrays (the phase table, tessellation grids):
+// mapped straight from the OS on huge page boundaries, transparent or explicit huge pages to cut TLB
+// misses, and no initialization, so the first thread that writes a page decides its NUMA node.
+// Generators fill them in parallel with each thread writing the pages it computes; read-shared tables
+// are spread over the nodes with FirstTouch. Placement reports where the pages ended up.
+// Nothing here touches OpenGL.
+//=============================================================================================
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "jobs.h"
+#if defined(__APPLE__) || defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#if defined(__APPLE__)
+#include <mach/vm_statistics.h>
+#elif defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+enum HugePages {
+    NoHugePages,
+    TransparentHugePages,   // a hint: the kernel backs the mapping with huge pages where it can
+    ExplicitHugePages       // from the reserved pool (Linux hugetlbfs, macOS superpages), transparent if that fails
+};
+
+const size_t hugePageSize = 2 << 20;
+
+inline size_t basePageSize() {
+#if defined(__APPLE__) || defined(__linux__)
+    return (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return 4096;
+#endif
+}
+
+//---------------------------
+template<class T> class LargeBuffer {
+//---------------------------
+// count elements of T, left unconstructed: the generators write every one of them
+    static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_destructible<T>::value,
+                  "LargeBuffer holds plain data only");
+    T * ptr = nullptr;
+    size_t count = 0, bytes = 0, pageSize = 0;   // bytes: the size of the mapping
+    bool mapped = false, huge = false;
+
+    void Release() {
+#if defined(__APPLE__) || defined(__linux__)
+        if (mapped) munmap(ptr, bytes);
+        else
+#endif
+        if (ptr) ::operator delete(ptr, std::align_val_t(64));
+        ptr = nullptr;
+        count = bytes = 0;
+        mapped = huge = false;
+    }
+
+public:
+    LargeBuffer() {}
+    LargeBuffer(size_t n, HugePages pages = TransparentHugePages) { Allocate(n, pages); }
+    LargeBuffer(const LargeBuffer&) = delete;
+    LargeBuffer& operator=(const LargeBuffer&) = delete;
+    LargeBuffer(LargeBuffer&& buffer) { *this = std::move(buffer); }
+    LargeBuffer& operator=(LargeBuffer&& buffer) {
+        if (this != &buffer) {
+            Release();
+            ptr = buffer.ptr; count = buffer.count; bytes = buffer.bytes; pageSize = buffer.pageSize;
+            mapped = buffer.mapped; huge = buffer.huge;
+            buffer.ptr = nullptr;
+            buffer.count = buffer.bytes = 0;
+            buffer.mapped = buffer.huge = false;
+        }
+        return *this;
+    }
+    ~LargeBuffer() { Release(); }
+
+    // drops the old contents; false if the memory cannot be had
+    bool Allocate(size_t n, HugePages pages = TransparentHugePages) {
+        Release();
+        count = n;
+        pageSize = basePageSize();
+        size_t need = n * sizeof(T);
+        if (need == 0) return true;
+        bool big = need >= hugePageSize && pages != NoHugePages;
+#if defined(__APPLE__) || defined(__linux__)
+        if (big) {
+            size_t rounded = (need + hugePageSize - 1) / hugePageSize * hugePageSize;
+            void * p = MAP_FAILED;
+            if (pages == ExplicitHugePages) {
+#if defined(__linux__) && defined(MAP_HUGETLB)
+                p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#elif defined(__APPLE__) && defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+                p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+#endif
+                if (p == MAP_FAILED) printf("Explicit huge pages are not available, using transparent ones\n");
+            }
+            if (p != MAP_FAILED) {
+                ptr = (T *)p;
+                bytes = rounded;
+                pageSize = hugePageSize;
+                mapped = huge = true;
+                return true;
+            }
+            // over-allocate by a huge page and trim, so the mapping starts on a huge page boundary
+            char * raw = (char *)mmap(nullptr, rounded + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (raw != MAP_FAILED) {
+                char * aligned = (char *)(((size_t)raw + hugePageSize - 1) / hugePageSize * hugePageSize);
+                if (aligned > raw) munmap(raw, aligned - raw);
+                if (raw + hugePageSize > aligned) munmap(aligned + rounded, raw + hugePageSize - aligned);
+#if defined(MADV_HUGEPAGE)
+                if (madvise(aligned, rounded, MADV_HUGEPAGE) == 0) {
+                    pageSize = hugePageSize;
+                    huge = true;
+                }
+#endif
+                ptr = (T *)aligned;
+                bytes = rounded;
+                mapped = true;
+                return true;
+            }
+        }
+        else {
+            size_t rounded = (need + pageSize - 1) / pageSize * pageSize;
+            void * p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED) {
+                ptr = (T *)p;
+                bytes = rounded;
+                mapped = true;
+                return true;
+            }
+        }
+#endif
+        ptr = (T *)::operator new(need, std::align_val_t(64), std::nothrow);
+        if (!ptr) {
+            printf("%.1f MB cannot be allocated\n", need / 1048576.0);
+            count = 0;
+            return false;
+        }
+        bytes = need;
+        return true;
+    }
+
+    T * data() { return ptr; }
+    const T * data() const { return ptr; }
+    size_t size() const { return count; }
+    T& operator[](size_t i) { return ptr[i]; }
+    const T& operator[](size_t i) const { return ptr[i]; }
+
+    // granularity of placement: a thread that writes a page first gets all of it on its node
+    size_t PageSize() const { return pageSize; }
+    bool Huge() const { return huge; }
+
+    // rows of rowLength elements to hand to one thread when filling rows of them in parallel: whole pages,
+    // so each page is first written by the thread that computes it, unless that leaves threads idle
+    int RowsPerJob(size_t rowLength, int nThreads = 0) const {
+        if (nThreads <= 0) nThreads = defaultThreadCount();
+        size_t rowBytes = rowLength * sizeof(T), rows = rowLength ? count / rowLength : 0;
+        size_t perPage = rowBytes ? (pageSize + rowBytes - 1) / rowBytes : 1, fair = rows / nThreads;
+        size_t result = perPage < fair ? perPage : fair;
+        return result > 0 ? (int)result : 1;
+    }
+
+    // writes a zero into every page from parallel workers, a page at a time, which spreads a table
+    // that every thread reads over the nodes of the workers; pages written before keep their node
+    void FirstTouch(int nThreads = 0) {
+        if (!ptr) return;
+        char * base = (char *)ptr;
+        size_t used = count * sizeof(T), pages = (used + pageSize - 1) / pageSize;
+        parallelFor((int)pages, [&](int page) { base[page * pageSize] = 0; }, nThreads);
+    }
+
+    // the mapping in /proc/self/smaps: how much of it the kernel backs with huge pages, -1 if unknown
+    long HugeBytes() const {
+        long result = -1;
+#if defined(__linux__)
+        FILE * file = fopen("/proc/self/smaps", "r");
+        if (!file) return -1;
+        char line[256];
+        bool inside = false;
+        while (fgets(line, sizeof(line), file)) {
+            unsigned long from, to;
+            if (sscanf(line, "%lx-%lx ", &from, &to) == 2) {
+                inside = from <= (unsigned long)ptr && (unsigned long)ptr < to;
+                continue;
+            }
+            long kb;
+            if (inside && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) result = (result < 0 ? 0 : result) + kb * 1024;
+            if (inside && sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1 && kb > 0) result = (result < 0 ? 0 : result) + kb * 1024;
+        }
+        fclose(file);
+#endif
+        return result;
+    }
+
+    // prints the size, huge page backing and the NUMA node of the pages (sampled, at most 4096 of them)
+    void Placement(const char * name) const {
+        printf("%s: %.1f MB, %s", name, count * sizeof(T) / 1048576.0,
+               huge ? "huge pages" : "base pages");
+        long hugeBytes = HugeBytes();
+        if (hugeBytes >= 0) printf(" (%.1f MB backed)", hugeBytes / 1048576.0);
+#if defined(__linux__) && defined(SYS_move_pages)
+        const int maxNodes = 64, maxSamples = 4096;
+        size_t step = basePageSize(), used = count * sizeof(T);
+        while (used / step > maxSamples) step *= 2;
+        std::vector<void *> pages;
+        for (size_t offset = 0; offset < used; offset += step) pages.push_back((char *)ptr + offset);
+        std::vector<int> status(pages.size(), -1);
+        int nodes[maxNodes] = {}, absent = 0;
+        // move_pages with no target nodes only queries, without libnuma
+        if (!pages.empty() && syscall(SYS_move_pages, 0, (unsigned long)pages.size(), pages.data(), nullptr, status.data(), 0) == 0) {
+            for (int node : status) {
+                if (node >= 0 && node < maxNodes) nodes[node]++;
+                else absent++;
+            }
+            for (int node = 0; node < maxNodes; node++)
+                if (nodes[node]) printf(", node %d: %.0f%%", node, 100.0 * nodes[node] / pages.size());
+            if (absent) printf(", not touched: %.0f%%", 100.0 * absent / pages.size());
+            printf("\n");
+            return;
+        }
+#endif
+        printf(", node placement unknown\n");
+    }
+};
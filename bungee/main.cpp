@@ -8,39 +8,65 @@
 // Light: point or directional sources
 //=============================================================================================
 #include "framework.h"
+#include "terrain.h"
+#include "seedstats.h"
+#include "noise.h"
+#include "jobs.h"
+#include "animation.h"
+#include "largebuffer.h"
+#include "scatter.h"
+#include "navgrid.h"
+#include "flow.h"
+#include "meshlets.h"
+#include "proctexture.h"
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
  
 //---------------------------
 template<class T> struct Dnum { // Dual numbers for automatic derivation
 //---------------------------
     float f; // function value
     T d;  // derivatives
-    Dnum(float f0 = 0, T d0 = T(0)) { f = f0, d = d0; }
-    Dnum operator+(Dnum r) { return Dnum(f + r.f, d + r.d); }
-    Dnum operator-(Dnum r) { return Dnum(f - r.f, d - r.d); }
-    Dnum operator*(Dnum r) {
+    constexpr Dnum(float f0 = 0, T d0 = T(0)) : f(f0), d(d0) {}
+    constexpr Dnum operator+(const Dnum& r) const { return Dnum(f + r.f, d + r.d); }
+    constexpr Dnum operator-(const Dnum& r) const { return Dnum(f - r.f, d - r.d); }
+    constexpr Dnum operator*(const Dnum& r) const {
         return Dnum(f * r.f, f * r.d + d * r.f);
     }
-    Dnum operator/(Dnum r) {
+    constexpr Dnum operator/(const Dnum& r) const {
         return Dnum(f / r.f, (r.f * d - r.d * f) / r.f / r.f);
     }
 };
  
-// Elementary functions prepared for the chain rule as well
-template<class T> Dnum<T> Exp(Dnum<T> g) { return Dnum<T>(expf(g.f), expf(g.f)*g.d); }
-template<class T> Dnum<T> Sin(Dnum<T> g) { return  Dnum<T>(sinf(g.f), cosf(g.f)*g.d); }
-template<class T> Dnum<T> Cos(Dnum<T>  g) { return  Dnum<T>(cosf(g.f), -sinf(g.f)*g.d); }
-template<class T> Dnum<T> Tan(Dnum<T>  g) { return Sin(g) / Cos(g); }
-template<class T> Dnum<T> Sinh(Dnum<T> g) { return  Dnum<T>(sinh(g.f), cosh(g.f)*g.d); }
-template<class T> Dnum<T> Cosh(Dnum<T> g) { return  Dnum<T>(cosh(g.f), sinh(g.f)*g.d); }
-template<class T> Dnum<T> Tanh(Dnum<T> g) { return Sinh(g) / Cosh(g); }
-template<class T> Dnum<T> Log(Dnum<T> g) { return  Dnum<T>(logf(g.f), g.d / g.f); }
-template<class T> Dnum<T> Pow(Dnum<T> g, float n) {
+// Elementary functions prepared for the chain rule as well; every transcendental is evaluated once,
+// since calls that may set errno are not merged by the optimizer
+template<class T> Dnum<T> Exp(const Dnum<T>& g) { float e = expf(g.f); return Dnum<T>(e, e * g.d); }
+template<class T> Dnum<T> Sin(const Dnum<T>& g) { return  Dnum<T>(sinf(g.f), cosf(g.f)*g.d); }
+template<class T> Dnum<T> Cos(const Dnum<T>& g) { return  Dnum<T>(cosf(g.f), -sinf(g.f)*g.d); }
+template<class T> Dnum<T> Tan(const Dnum<T>& g) { float t = tanf(g.f); return Dnum<T>(t, (1 + t * t) * g.d); }
+template<class T> Dnum<T> Sinh(const Dnum<T>& g) { return  Dnum<T>(sinh(g.f), cosh(g.f)*g.d); }
+template<class T> Dnum<T> Cosh(const Dnum<T>& g) { return  Dnum<T>(cosh(g.f), sinh(g.f)*g.d); }
+template<class T> Dnum<T> Tanh(const Dnum<T>& g) { float t = tanhf(g.f); return Dnum<T>(t, (1 - t * t) * g.d); }
+template<class T> Dnum<T> Log(const Dnum<T>& g) { return  Dnum<T>(logf(g.f), g.d / g.f); }
+template<class T> Dnum<T> Pow(const Dnum<T>& g, float n) {
     return  Dnum<T>(powf(g.f, n), n * powf(g.f, n - 1) * g.d);
 }
  
 typedef Dnum<vec2> Dnum2;
  
+static_assert((Dnum2(2, vec2(1, 0)) * Dnum2(3, vec2(0, 1))).d.y == 2, "constexpr Dnum");
+ 
 const int tessellationLevel = 200;
+const int terrainHarmonics = 35;
+const double terrainAmplitude = 0.5;
  
 //---------------------------
 struct Camera { // 3D camera
@@ -86,17 +112,94 @@ struct Light {
 };
  
 //---------------------------
-class CheckerBoardTexture : public Texture {
+struct LightProbe {
+//---------------------------
+// Directional lights and an ambient sky projected onto the 9 real spherical harmonics of bands 0..2 and
+// convolved with the diffuse lobe, so the fragment shader evaluates any number of them with 9 terms.
+// The lights use the two-sided |N.L| lobe of PhongShader, whose band 1 vanishes; the sky uses the clamped
+// cosine lobe, scaled so that a uniform sky of radiance La gives exactly La, as an ambient term should.
+    vec3 diffuse[9];    // multiplied by the diffuse color
+    vec3 ambient[9];    // multiplied by ka
+ 
+    static void Basis(const vec3& d, float Y[9]) {
+        Y[0] = 0.282095f;
+        Y[1] = 0.488603f * d.y; Y[2] = 0.488603f * d.z; Y[3] = 0.488603f * d.x;
+        Y[4] = 1.092548f * d.x * d.y; Y[5] = 1.092548f * d.y * d.z; Y[6] = 0.315392f * (3 * d.z * d.z - 1);
+        Y[7] = 1.092548f * d.x * d.z; Y[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+    }
+ 
+    void Clear() { for (int i = 0; i < 9; i++) diffuse[i] = ambient[i] = vec3(0, 0, 0); }
+ 
+    // light from direction (toward the light) with radiance Le
+    void AddDirectional(const vec3& direction, const vec3& Le) {
+        const float lobe[3] = { 2 * (float)M_PI, 0, (float)M_PI / 2 };     // |cos| per band
+        float Y[9];
+        Basis(normalize(direction), Y);
+        for (int i = 0; i < 9; i++) diffuse[i] = diffuse[i] + Le * (lobe[i < 1 ? 0 : i < 4 ? 1 : 2] * Y[i]);
+    }
+ 
+    // radiance sky above the horizon (+y), ground below; only bands 0 and 1 of a hemisphere split are nonzero
+    void AddAmbient(const vec3& sky, const vec3& ground) {
+        ambient[0] = ambient[0] + (sky + ground) * (0.282095f * 2 * (float)M_PI);       // lobe 1 (pi / pi)
+        ambient[1] = ambient[1] + (sky - ground) * (0.488603f * (float)M_PI * 2 / 3);   // lobe 2/3 (2pi/3 / pi)
+    }
+};
+ 
+std::string textureCacheDirectory;      // procedural textures are kept here across runs, empty: not kept
+ 
+//---------------------------
+class ProceduralTexture : public Texture {
 //---------------------------
+// Synthesized by its generator the first time a program samples it, or read from the texture cache,
+// and uploaded as the compact format it was made in
+    std::shared_ptr<TextureGenerator> generator;
+    ProcTextureOptions options;
+    int sampling;
 public:
-    CheckerBoardTexture(const int width, const int height) : Texture() {
-        std::vector<vec4> image(width * height);
-        const vec4 yellow(1, 1, 0, 1), blue(0, 0, 1, 1);
-        for (int x = 0; x < width; x++) for (int y = 0; y < height; y++) {
-            image[y * width + x] = (x & 1) ^ (y & 1) ? yellow : blue;
-        }
-        create(width, height, image, GL_NEAREST);
+    ProceduralTexture(std::shared_ptr<TextureGenerator> _generator, int width, int height, TexelFormat format = TexelRGBA8,
+                      int _sampling = GL_LINEAR) : Texture(), generator(_generator), sampling(_sampling) {
+        options.width = width;
+        options.height = height;
+        options.format = format;
+    }
+ 
+    void Prepare() {
+        if (textureId > 0) return;
+        options.cacheDirectory = textureCacheDirectory;
+        std::vector<uint8_t> texels = synthesizeTexture(*generator, options);
+        glGenTextures(1, &textureId);
+        glBindTexture(GL_TEXTURE_2D, textureId);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if (options.format == TexelR16)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, options.width, options.height, 0, GL_RED, GL_UNSIGNED_SHORT, texels.data());
+        else glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, options.width, options.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, sampling);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, sampling);
+    }
+};
+ 
+//---------------------------
+class CheckerBoardTexture : public ProceduralTexture {
+//---------------------------
+    static std::shared_ptr<TextureGenerator> Checker() {
+        const float blue[4] = { 0, 0, 1, 1 }, yellow[4] = { 1, 1, 0, 1 };
+        return std::make_shared<CheckerGenerator>(1, blue, yellow);
     }
+public:
+    CheckerBoardTexture(const int width, const int height) : ProceduralTexture(Checker(), width, height, TexelRGBA8, GL_NEAREST) {}
+};
+ 
+//---------------------------
+struct ShadowState {
+//---------------------------
+// What PhongShader needs to look up the cascaded shadow map of one directional light
+    static const int maxCascades = 4;
+    unsigned int depthArray = 0;        // GL_TEXTURE_2D_ARRAY of depths, one layer per cascade
+    int nCascades = 0;
+    mat4 VP[maxCascades];               // world to light clip space of each layer
+    float end[maxCascades];             // cascade c covers eye distances up to end[c]
+    vec4 wLightPos;                     // of the light, to find it among the lights of the render state
 };
  
 //---------------------------
@@ -107,14 +210,29 @@ struct RenderState {
     std::vector<Light> lights;
     Texture *          texture;
     vec3               wEye;
+    LightProbe *       probe = nullptr;     // the lights that are not in lights, null if there are none
+    ShadowState *      shadows = nullptr;
+    bool               multiView = false;   // V and P are identities and the Views buffer holds the cameras
 };
  
+// Single pass multi-view rendering: the Views uniform buffer, bound at viewsBinding, holds the world to
+// clip matrices and eyes of up to maxViews cameras (6: a cube map), and the geometry stage of a multi-view
+// program sends every triangle to layer v of the target for each view v it may be seen in
+const int maxViews = 6;
+const int viewsBinding = 1;
+ 
 //---------------------------
 class Shader : public GPUProgram {
 //---------------------------
 public:
     virtual void Bind(RenderState state) = 0;
  
+    // program that draws the same geometry into a depth map, null if it casts no shadows
+    virtual GPUProgram * DepthProgram() { return nullptr; }
+ 
+    // program that draws the same geometry into all the views of a multi-view pass, null if it has none
+    virtual Shader * MultiView() { return nullptr; }
+ 
     void setUniformMaterial(const Material& material, const std::string& name) {
         setUniform(material.kd, name + ".kd");
         setUniform(material.ks, name + ".ks");
@@ -127,52 +245,135 @@ public:
         setUniform(light.Le, name + ".Le");
         setUniform(light.wLightPos, name + ".wLightPos");
     }
-};
  
-double E(double A, int one, int two) {
-    return one + two == 0 ? 0 : A / sqrt(powf(one, 2) + powf( two, 2));
-}
+    // the texture of the object, if the program samples it; a texture no program samples is never made
+    void setUniformTexture(Texture * texture, const std::string& samplerName, unsigned int textureUnit = 0) {
+        if (texture && uses(samplerName)) setUniform(*texture, samplerName, textureUnit);
+    }
+};
  
 double* coeffs;
+LargeBuffer<double> coeffTable;         // backs coeffs
  
 double A;
  
+unsigned int terrainSeed = (unsigned int)time(0);
+ 
+std::string terrainStyle = "classic";   // spectrum name, see withTerrainSpectrum
+ 
+bool noiseTerrain = false;              // gradient noise instead of the Fourier sum
+ 
+bool gridNormals = false;               // Fourier terrain normals from height differences
+ 
+bool gpuBake = false;                   // Fourier terrain vertex buffer from a compute shader
+ 
+float impostorDistance = 0;             // objects farther than this from the eye are impostors, 0: never
+float impostorAngle = 5;                // degrees of view direction change before an impostor is captured again
+ 
+int shadowCascades = 0;                 // cascades of the shadow map of the first light, 0: no shadows
+ 
+int probeExactLights = -1;              // brightest lights evaluated exactly, the rest in a LightProbe; -1: no probe
+ 
+bool streamTerrain = false;             // endless terrain of tiles generated ahead of the camera
+float flightSpeed = 0;                  // world units per second the camera flies forward when streaming
+ 
+enum HeightMapFormat { NoHeightMap, HeightMapR16, HeightMapR32F };
+HeightMapFormat heightMapFormat = NoHeightMap;  // vertex pulling from a height texture instead of a VBO
+ 
+HugePages hugePages = TransparentHugePages;     // pages of the phase table and the tessellation grids
+bool reportPlacement = false;                   // print the page placement of those buffers
+ 
+bool overdrawMode = false;              // fragment counts instead of the shaded image
+ 
+bool scatterInstances = false;          // trees and rocks placed on the terrain by blue noise
+ 
+int terrainCopies = 1;                  // terrain objects, all of them sharing one mesh
+ 
+int multiViews = 0;                     // cameras rendered into a texture array besides the main one
+bool separateViews = false;             // those rendered a traversal per camera instead of in one pass
+ 
+bool clusterCulling = false;            // surfaces drawn as meshlets, skipping those out of view or facing away
+MeshletCullStats clusterStats;          // of the frames since the last report
+ 
+template<class Spectrum = TerrainSpectrum>
 void getTerrainInfo(float x, float y, int n, double &height, vec3& norm) {
-    x = x * M_PI - M_PI;
-    y = y * M_PI - M_PI;
-    double total = 0;
-    
-    for (float one = 0; one <= n; one++) {
-        for (float two = 0; two <= n; two++) {
-            double e= E(A, one, two);
-            double c = cosf(one * x + two * y + coeffs[(int)one * n + (int)two]);
-            total += e * c;
-        }
-    }
+    double dx, dy;
+    terrainSample<Spectrum>(TablePhases(coeffs, n), A, n, x, y, height, dx, dy);
+    norm = vec3(-dx, 1, -dy);
+}
  
-    height = total;
-    
-    double dx = 0;
-    
-    for (float one = 0; one <= n; one++) {
-        for (float two = 0; two <= n; two++) {
-            double e= E(A, one, two);
-            double c = -1 * sinf(one * x + two * y + coeffs[(int)one * n + (int)two]) * one;
-            dx += e * c;
-        }
+template<class Spectrum = TerrainSpectrum>
+double getTerrainHeight(float x, float y, int n) {
+    return terrainHeight<Spectrum>(TablePhases(coeffs, n), A, n, x, y);
+}
+ 
+// every generator thread reads the phase table, so its pages are spread over the nodes before seeding
+void initTerrainPhases() {
+    A = terrainAmplitude;
+    coeffTable.Allocate(terrainPhaseCount, hugePages);
+    coeffTable.FirstTouch();
+    coeffs = coeffTable.data();
+    seedTerrainPhases(terrainSeed, coeffs, terrainPhaseCount);
+}
+ 
+// heights at (u0 + j * step, v0 + i * step), j < nu, i < nv, row-major into h
+typedef std::function<void(double u0, double v0, double step, int nu, int nv, float * h)> HeightGridFunction;
+ 
+// the rendered terrain on whole grids, for the scattering and the flow analysis
+HeightGridFunction terrainHeightGrid() {
+    HeightGridFunction heightGrid;
+    if (noiseTerrain) {
+        unsigned int seed = terrainSeed;
+        heightGrid = [seed](double u0, double v0, double step, int nu, int nv, float * h) {
+            NoiseOptions noise;
+            std::vector<float> u(nu * nv), v(nu * nv), dhdu(nu * nv), dhdv(nu * nv);
+            for (int i = 0; i < nu * nv; i++) {
+                u[i] = (float)(u0 + i % nu * step);
+                v[i] = (float)(v0 + i / nu * step);
+            }
+            gradientNoise(seed, noise, nu * nv, u.data(), v.data(), h, dhdu.data(), dhdv.data());
+        };
     }
-    
-    double dy = 0;
-    
-    for (float one = 0; one <= n; one++) {
-        for (float two = 0; two <= n; two++) {
-            double e= E(A, one, two);
-            double c = -1 * sinf(one * x + two * y + coeffs[(int)one * n + (int)two]) * two;
-            dy += e * c;
-        }
+    else withTerrainSpectrum(terrainStyle, [&](auto spectrum) {
+        typedef decltype(spectrum) Spectrum;
+        heightGrid = [](double u0, double v0, double step, int nu, int nv, float * h) {
+            terrainSampleRect<Spectrum>(TablePhases(coeffs, terrainHarmonics), A, terrainHarmonics, u0, v0,
+                                        step * (nu - 1), step * (nv - 1), nu, nv, 0, nv,
+                                        [&](int i, int j, double value, double, double) { h[i * nu + j] = (float)value; });
+        };
+    });
+    return heightGrid;
+}
+ 
+// the rendered terrain for the nav grid: analytic slopes, rise over run in world units
+NavSampler terrainNavSampler() {
+    NavSampler sampler;
+    if (noiseTerrain) {
+        unsigned int seed = terrainSeed;
+        sampler = [seed](double u0, double v0, double step, int n, float * height, float * slope) {
+            NoiseOptions noise;
+            std::vector<float> u(n * n), v(n * n), dhdu(n * n), dhdv(n * n);
+            for (int i = 0; i < n * n; i++) {
+                u[i] = (float)(u0 + i % n * step);
+                v[i] = (float)(v0 + i / n * step);
+            }
+            gradientNoise(seed, noise, n * n, u.data(), v.data(), height, dhdu.data(), dhdv.data());
+            for (int i = 0; i < n * n; i++) slope[i] = sqrtf(dhdu[i] * dhdu[i] + dhdv[i] * dhdv[i]) / terrainWorldSize;
+        };
     }
-    
-    norm = vec3(-dx, 1, -dy);
+    else withTerrainSpectrum(terrainStyle, [&](auto spectrum) {
+        typedef decltype(spectrum) Spectrum;
+        sampler = [](double u0, double v0, double step, int n, float * height, float * slope) {
+            terrainSampleRect<Spectrum>(TablePhases(coeffs, terrainHarmonics), A, terrainHarmonics, u0, v0,
+                                        step * (n - 1), step * (n - 1), n, n, 0, n,
+                                        [&](int i, int j, double h, double gx, double gy) {
+                height[i * n + j] = (float)h;
+                // the gradient is per radian of x = u * pi - pi
+                slope[i * n + j] = (float)(sqrt(gx * gx + gy * gy) * M_PI / terrainWorldSize);
+            });
+        };
+    });
+    return sampler;
 }
  
  
@@ -201,6 +402,7 @@ class PhongShader : public Shader {
         out vec3 wView;             // view in world space
         out vec3 wLight[8];            // light dir in world space
         out float wH;
+        out vec3 wPosition;
  
         void main() {
             gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
@@ -210,6 +412,7 @@ class PhongShader : public Shader {
                 wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
             }
             wView  = wEye * wPos.w - wPos.xyz;
+            wPosition = wPos.xyz / wPos.w;
             wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
             wH = h;
             //texcoord = vtxUV;
@@ -234,14 +437,39 @@ class PhongShader : public Shader {
         uniform Material material;
         uniform Light[8] lights;    // light sources
         uniform int   nLights;
+        uniform bool  useProbe;     // the rest of the lights and the ambient sky as spherical harmonics
+        uniform vec3  probeDiffuse[9], probeAmbient[9];
+        uniform int   nCascades;    // shadow map cascades of lights[shadowLight], 0: no shadows
+        uniform int   shadowLight;
+        uniform mat4  shadowVP[4];
+        uniform float cascadeEnd[4];
+        uniform sampler2DArrayShadow shadowMap;
  
         in  vec3 wNormal;       // interpolated world sp normal
         in  vec3 wView;         // interpolated world sp view
         in  vec3 wLight[8];     // interpolated world sp illum dir
         in float wH;
+        in  vec3 wPosition;     // interpolated world sp position
         
         out vec4 fragmentColor; // output goes to frame buffer
  
+        float visibility(int i) {   // 1: lit, 0: in the shadow of light i
+            float d = length(wView);
+            if (i != shadowLight || nCascades == 0 || d > cascadeEnd[nCascades - 1]) return 1.0;
+            int c = 0;
+            while (d > cascadeEnd[c]) c++;
+            vec4 p = vec4(wPosition, 1) * shadowVP[c];
+            p.xyz = p.xyz * 0.5 + 0.5;
+            return texture(shadowMap, vec4(p.xy, c, p.z));
+        }
+ 
+        vec3 evalProbe(vec3 coeffs[9], vec3 d) {   // the basis of LightProbe::Basis
+            return coeffs[0] * 0.282095
+                 + (coeffs[1] * d.y + coeffs[2] * d.z + coeffs[3] * d.x) * 0.488603
+                 + (coeffs[4] * d.x * d.y + coeffs[5] * d.y * d.z + coeffs[7] * d.x * d.z) * 1.092548
+                 + coeffs[6] * 0.315392 * (3 * d.z * d.z - 1) + coeffs[8] * 0.546274 * (d.x * d.x - d.y * d.y);
+        }
+ 
         void main() {
             vec3 c = wH * 0.7 * (material.kd - vec3(1,0,0)) + material.kd;
             vec3 N = normalize(wNormal);
@@ -256,13 +484,115 @@ class PhongShader : public Shader {
                   float cosd = abs(dot(N, H));
                 //float cost = max(dot(N,L), 0), cosd = max(dot(N,H), 0);
                 // kd and ka are modulated by the texture
-                radiance += (c * cost + material.ks * 1/4 * pow(cosd, material.shininess)) * lights[i].Le;
+                radiance += (c * cost + material.ks * 1/4 * pow(cosd, material.shininess)) * lights[i].Le * visibility(i);
             }
+            if (useProbe) radiance += c * max(evalProbe(probeDiffuse, N), 0) + material.ka * max(evalProbe(probeAmbient, N), 0);
             fragmentColor = vec4(radiance, 1);
         }
     )";
+    // multi-view pass: the vertex stage runs once with MVP = M, so gl_Position is the world position, and
+    // its outputs go by other names to this stage, which repeats the triangle for every view that does not
+    // cull it. wView moves from the eye of the vertex stage to the eye of the view and wLight is computed
+    // here, as the vertex stage's array of them cannot be an input of a 3.3 geometry stage.
+    static constexpr const char * multiViewGeometrySource = R"(
+        #version 330
+        precision highp float;
+ 
+        struct Light {
+            vec3 La, Le;
+            vec4 wLightPos;
+        };
+ 
+        layout(triangles) in;
+        layout(triangle_strip, max_vertices = 18) out;     // 3 * maxViews
+ 
+        layout(std140, row_major) uniform Views {
+            mat4 viewVP[6];     // world to clip space of each view
+            vec4 viewEye[6];    // eye of each view, world space
+            int  nViews;
+        };
+        uniform Light[8] lights;    // light sources
+        uniform int   nLights;
+        uniform vec3  wEye;         // the eye the vertex stage computed wView for
+ 
+        in vec3 vNormal[], vView[], vPosition[];
+        in float vH[];
+ 
+        out vec3 wNormal;            // normal in world space
+        out vec3 wView;             // view in world space
+        out vec3 wLight[8];            // light dir in world space
+        out float wH;
+        out vec3 wPosition;
+ 
+        // all three corners beyond the same clip plane
+        bool culled(vec4 a, vec4 b, vec4 c) {
+            return (a.x > a.w && b.x > b.w && c.x > c.w) || (a.x < -a.w && b.x < -b.w && c.x < -c.w) ||
+                   (a.y > a.w && b.y > b.w && c.y > c.w) || (a.y < -a.w && b.y < -b.w && c.y < -c.w) ||
+                   (a.z > a.w && b.z > b.w && c.z > c.w) || (a.z < -a.w && b.z < -b.w && c.z < -c.w);
+        }
+ 
+        void main() {
+            for (int v = 0; v < nViews; v++) {
+                vec4 clip[3];
+                for (int i = 0; i < 3; i++) clip[i] = gl_in[i].gl_Position * viewVP[v];
+                if (culled(clip[0], clip[1], clip[2])) continue;
+                for (int i = 0; i < 3; i++) {
+                    gl_Layer = v;
+                    gl_Position = clip[i];
+                    wNormal = vNormal[i];
+                    wView = vView[i] + viewEye[v].xyz - wEye;
+                    for (int l = 0; l < nLights; l++) wLight[l] = lights[l].wLightPos.xyz - vPosition[i] * lights[l].wLightPos.w;
+                    wH = vH[i];
+                    wPosition = vPosition[i];
+                    EmitVertex();
+                }
+                EndPrimitive();
+            }
+        }
+    )";
+    // depth map pass: the vertex stage of the lighting with a fragment stage that writes nothing of interest
+    const char * depthFragmentSource = R"(
+        #version 330
+        out vec4 fragmentColor;
+        void main() { fragmentColor = vec4(1, 1, 1, 1); }
+    )";
+ 
+    const char * vertexStage;
+    GPUProgram * depthProgram = nullptr;
+    std::string multiViewVertexStage;
+    PhongShader * multiView = nullptr;
+    static const int shadowMapUnit = 2;
+ 
+    // the lighting behind a vertex and a geometry stage
+    PhongShader(const char * vertex, const char * geometry) : vertexStage(vertex) {
+        create(vertex, fragmentSource, "fragmentColor", geometry);
+        bindUniformBlock("Views", viewsBinding);
+    }
+protected:
+    // same lighting with a different vertex stage
+    PhongShader(const char * customVertexSource) : vertexStage(customVertexSource) { create(customVertexSource, fragmentSource, "fragmentColor"); }
 public:
-    PhongShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+    PhongShader() : vertexStage(vertexSource) { create(vertexSource, fragmentSource, "fragmentColor"); }
+ 
+    GPUProgram * DepthProgram() {
+        if (!depthProgram) {
+            depthProgram = new GPUProgram();
+            depthProgram->create(vertexStage, depthFragmentSource, "fragmentColor");
+        }
+        return depthProgram;
+    }
+ 
+    // the vertex stage of this shader with its outputs renamed for multiViewGeometrySource
+    Shader * MultiView() {
+        if (!multiView) {
+            multiViewVertexStage = vertexStage;
+            multiViewVertexStage.insert(multiViewVertexStage.find('\n', multiViewVertexStage.find("#version")) + 1,
+                                        "#define wNormal vNormal\n#define wView vView\n#define wLight vLight\n"
+                                        "#define wH vH\n#define wPosition vPosition\n");
+            multiView = new PhongShader(multiViewVertexStage.c_str(), multiViewGeometrySource);
+        }
+        return multiView;
+    }
  
     void Bind(RenderState state) {
         Use();         // make this program run
@@ -271,20 +601,159 @@ public:
         setUniform(state.Minv, "Minv");
         setUniform(state.wEye, "wEye");
         setUniformMaterial(*state.material, "material");
+        setUniformTexture(state.texture, "diffuseTexture");
  
         setUniform((int)state.lights.size(), "nLights");
         for (unsigned int i = 0; i < state.lights.size(); i++) {
             setUniformLight(state.lights[i], std::string("lights[") + std::to_string(i) + std::string("]"));
         }
+        setUniform(state.probe ? 1 : 0, "useProbe");
+        if (state.probe && uses("probeDiffuse")) {
+            for (int i = 0; i < 9; i++) {
+                setUniform(state.probe->diffuse[i], "probeDiffuse[" + std::to_string(i) + "]");
+                setUniform(state.probe->ambient[i], "probeAmbient[" + std::to_string(i) + "]");
+            }
+        }
+ 
+        setUniform(shadowMapUnit, "shadowMap");
+        int shadowLight = -1;
+        if (state.shadows) {
+            const vec4& w = state.shadows->wLightPos;
+            for (unsigned int i = 0; i < state.lights.size(); i++) {
+                const vec4& p = state.lights[i].wLightPos;
+                if (p.x == w.x && p.y == w.y && p.z == w.z && p.w == w.w) shadowLight = i;
+            }
+        }
+        setUniform(shadowLight >= 0 ? state.shadows->nCascades : 0, "nCascades");
+        if (shadowLight >= 0 && uses("shadowMap")) {
+            setUniform(shadowLight, "shadowLight");
+            for (int c = 0; c < state.shadows->nCascades; c++) {
+                setUniform(state.shadows->VP[c], "shadowVP[" + std::to_string(c) + "]");
+                setUniform(state.shadows->end[c], "cascadeEnd[" + std::to_string(c) + "]");
+            }
+            glActiveTexture(GL_TEXTURE0 + shadowMapUnit);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, state.shadows->depthArray);
+            glActiveTexture(GL_TEXTURE0);
+        }
     }
 };
  
+//---------------------------
+class HeightFieldShader : public PhongShader {
+//---------------------------
+    // Vertex pulling: no vertex attributes, the grid position comes from gl_VertexID (position in the strip)
+    // and gl_InstanceID (strip), the height and its neighbours for the normal from the height map.
+    static constexpr const char * heightFieldVertexSource = R"(
+        #version 330
+        precision highp float;
+ 
+        struct Light {
+            vec3 La, Le;
+            vec4 wLightPos;
+        };
+ 
+        uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
+        uniform Light[8] lights;    // light sources
+        uniform int   nLights;
+        uniform vec3  wEye;         // pos of eye
+ 
+        uniform sampler2D heightMap;    // (N + 3) x (M + 3) texels: grid heights with a one texel halo
+        uniform vec2  gridSize;         // M, N quads along u, v
+        uniform vec2  heightDecode;     // height = texel * x + y
+        uniform vec2  heightRange;      // min, max of the heights in the grid
+        uniform float worldSize;
+ 
+        out vec3 wNormal;            // normal in world space
+        out vec3 wView;             // view in world space
+        out vec3 wLight[8];            // light dir in world space
+        out float wH;
+        out vec3 wPosition;
+ 
+        float height(ivec2 texel) { return texelFetch(heightMap, texel, 0).r * heightDecode.x + heightDecode.y; }
+ 
+        void main() {
+            ivec2 grid = ivec2(gl_VertexID / 2, gl_InstanceID + (gl_VertexID & 1));
+            ivec2 texel = grid + ivec2(1, 1);
+            float h = height(texel);
+            vec2 dhduv = vec2(height(texel + ivec2(1, 0)) - height(texel - ivec2(1, 0)),
+                              height(texel + ivec2(0, 1)) - height(texel - ivec2(0, 1))) * vec2(gridSize) / 2;
+            vec3 vtxNorm = vec3(-dhduv.x / 3.14159265, 1, -dhduv.y / 3.14159265);
+            vec2 uv = vec2(grid) / vec2(gridSize);
+            vec3 vtxPos = vec3(uv.x * worldSize - worldSize / 2, h, uv.y * worldSize - worldSize / 2);
+ 
+            gl_Position = vec4(vtxPos, 1) * MVP; // to NDC
+            vec4 wPos = vec4(vtxPos, 1) * M;
+            for(int i = 0; i < nLights; i++) {
+                wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
+            }
+            wView  = wEye * wPos.w - wPos.xyz;
+            wPosition = wPos.xyz / wPos.w;
+            wNormal = (Minv * vec4(vtxNorm, 0)).xyz;
+            wH = heightRange.y > heightRange.x ? (h - heightRange.x) / (heightRange.y - heightRange.x) : 0.0;
+        }
+    )";
+public:
+    HeightFieldShader() : PhongShader(heightFieldVertexSource) {}
+};
+ 
+//---------------------------
+class InstanceShader : public PhongShader {
+//---------------------------
+    // Per instance attributes: translation and uniform scale, rotation about the vertical axis
+    static constexpr const char * instanceVertexSource = R"(
+        #version 330
+        precision highp float;
+ 
+        struct Light {
+            vec3 La, Le;
+            vec4 wLightPos;
+        };
+ 
+        uniform mat4  MVP, M, Minv; // MVP, Model, Model-inverse
+        uniform Light[8] lights;    // light sources
+        uniform int   nLights;
+        uniform vec3  wEye;         // pos of eye
+ 
+        layout(location = 0) in vec3  vtxPos;           // pos in the space of the mesh
+        layout(location = 1) in vec3  vtxNorm;
+        layout(location = 3) in vec4  instance;         // translation in modeling space, scale
+        layout(location = 4) in float angle;
+ 
+        out vec3 wNormal;            // normal in world space
+        out vec3 wView;             // view in world space
+        out vec3 wLight[8];            // light dir in world space
+        out float wH;
+        out vec3 wPosition;
+ 
+        void main() {
+            float c = cos(angle), s = sin(angle);
+            vec3 pos = vec3(c * vtxPos.x + s * vtxPos.z, vtxPos.y, c * vtxPos.z - s * vtxPos.x) * instance.w + instance.xyz;
+            vec3 norm = vec3(c * vtxNorm.x + s * vtxNorm.z, vtxNorm.y, c * vtxNorm.z - s * vtxNorm.x);
+ 
+            gl_Position = vec4(pos, 1) * MVP; // to NDC
+            vec4 wPos = vec4(pos, 1) * M;
+            for(int i = 0; i < nLights; i++) {
+                wLight[i] = lights[i].wLightPos.xyz * wPos.w - wPos.xyz * lights[i].wLightPos.w;
+            }
+            wView  = wEye * wPos.w - wPos.xyz;
+            wPosition = wPos.xyz / wPos.w;
+            wNormal = (Minv * vec4(norm, 0)).xyz;
+            wH = 0;     // the plain material color
+        }
+    )";
+public:
+    InstanceShader() : PhongShader(instanceVertexSource) {}
+};
+ 
 //---------------------------
 class Geometry {
 //---------------------------
 protected:
     unsigned int vao, vbo;        // vertex array object
 public:
+    vec3 boundsCenter;            // bounding sphere in modeling space, radius 0 if unknown
+    float boundsRadius = 0;
+ 
     Geometry() {
         glGenVertexArrays(1, &vao);
         glBindVertexArray(vao);
@@ -292,7 +761,20 @@ public:
         glBindBuffer(GL_ARRAY_BUFFER, vbo);
     }
     virtual void Draw() = 0;
-    ~Geometry() {
+ 
+    // uniforms of its own the geometry gives the program about to draw it, before Draw or DrawVisible
+    virtual void SetUniforms(GPUProgram& program) {}
+ 
+    // the parts that may be seen from eye, in modeling space, through the frustum of MVP; all by default
+    virtual void DrawVisible(const mat4& MVP, const vec3& eye) { Draw(); }
+ 
+    // geometry made in two halves by GeometryCache: Generate() on a worker thread, then Finish() on the
+    // GL thread; nothing is drawn before
+    virtual bool Pending() { return false; }
+    virtual void Generate() {}
+    virtual void Finish() {}
+ 
+    virtual ~Geometry() {
         glDeleteBuffers(1, &vbo);
         glDeleteVertexArrays(1, &vao);
     }
@@ -301,24 +783,102 @@ public:
 //---------------------------
 class ParamSurface : public Geometry {
 //---------------------------
+public:
+    enum NormalMode {
+        AnalyticNormals,    // normals from sample()
+        GridNormals         // normals from central differences of the height grid
+    };
+ 
+protected:
     struct VertexData {
         vec3 position, normal;
         float h;
     };
  
+    static VertexData MakeVertexData(float u, float v, double h, const vec3& norm) {
+        VertexData vtxData;
+        vtxData.position = vec3(u * terrainWorldSize - terrainWorldSize / 2, h, v * terrainWorldSize - terrainWorldSize / 2);
+        vtxData.h = h;
+        vtxData.normal = norm;
+        return vtxData;
+    }
+ 
+    NormalMode normalMode = AnalyticNormals;
+ 
+    // same normal convention as getTerrainInfo: gradient per radian of x = u * pi - pi
+    static vec3 GradientNormal(double dhdu, double dhdv) { return vec3(-dhdu / M_PI, 1, -dhdv / M_PI); }
+ 
+private:
     unsigned int nVtxPerStrip, nStrips;
+    int deferredN = 0, deferredM = 0;           // the tessellation Generate() makes, 0: nothing deferred
+    LargeBuffer<VertexData> generated;
+    Meshlets meshlets;                          // with clusterCulling, of the strips in vbo
+    unsigned int ibo = 0;                       // their indices
+    std::vector<const void *> offsets;          // of the index ranges drawn, in bytes
+ 
+    // heights of the (N + 3) x (M + 3) grid with a one vertex halo around the tile, so border vertices
+    // get central differences from the same samples as the neighbouring tile's border
+    void GenGridData(int N, int M, VertexData * rows) {
+        const int W = M + 3;
+        LargeBuffer<double> h((N + 3) * W, hugePages);
+        parallelFor(N + 3, [&](int row) {
+            for (int j = -1; j <= M + 1; j++) h[row * W + j + 1] = sampleHeight((float)j / M, (float)(row - 1) / N);
+        });
+ 
+        parallelFor(N + 1, [&](int i) {
+            for (int j = 0; j <= M; j++) {
+                const double * c = &h[(i + 1) * W + j + 1];
+                double dhdu = (c[1] - c[-1]) * M / 2, dhdv = (c[W] - c[-W]) * N / 2;
+                rows[i * (M + 1) + j] = MakeVertexData((float)j / M, (float)i / N, c[0], GradientNormal(dhdu, dhdv));
+            }
+        });
+        ReportNormalError(N, M, rows);
+    }
+ 
+    // angle between the grid normals and the analytic ones on a 17 x 17 subset of the vertices
+    void ReportNormalError(int N, int M, const VertexData * rows) {
+        int stepN = N > 16 ? N / 16 : 1, stepM = M > 16 ? M / 16 : 1, count = 0;
+        double sum = 0, max = 0;
+        for (int i = 0; i <= N; i += stepN) {
+            for (int j = 0; j <= M; j += stepM) {
+                double h;
+                vec3 exact;
+                sample((float)j / M, (float)i / N, h, exact);
+                float cosAngle = dot(normalize(exact), normalize(rows[i * (M + 1) + j].normal));
+                double angle = acos(fmin(fmax(cosAngle, -1.0f), 1.0f)) * 180 / M_PI;
+                sum += angle;
+                if (angle > max) max = angle;
+                count++;
+            }
+        }
+        printf("Grid normals: mean error %.3f deg, max %.3f deg over %d vertices\n", sum / count, max, count);
+    }
+ 
 public:
     ParamSurface() { nVtxPerStrip = nStrips = 0; }
  
+    ~ParamSurface() { if (ibo) glDeleteBuffers(1, &ibo); }
+ 
     virtual void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) = 0;
  
+    // height and normal at (u, v) in [0,1]^2
+    virtual void sample(float u, float v, double& h, vec3& norm) = 0;
+ 
+    // height alone, for surfaces that have a cheaper way than sample()
+    virtual double sampleHeight(float u, float v) {
+        double h;
+        vec3 norm;
+        sample(u, v, h, norm);
+        return h;
+    }
+ 
     VertexData GenVertexData(float u, float v) {
         VertexData vtxData;
         //Dnum2 X, Y, Z;
         //Dnum2 U(u, vec2(1, 0)), V(v, vec2(0, 1));
         vec3 norm;
         double h;
-        getTerrainInfo(u, v, 35, h, norm);
+        sample(u, v, h, norm);
         //eval(U, V, X, Y, Z);
         //double h;
         
@@ -329,23 +889,60 @@ public:
         //Z = V - 7.5;
         //Y = h;
         
-        vtxData.position = vec3(u * 15 - 7.5, h, v * 15 - 7.5);
-        vtxData.h = h;
         //vtxData.position = vec3(X.f, Y.f, Z.f);
         //vec3 drdU(X.d.x, Y.d.x, Z.d.x), drdV(X.d.y, Y.d.y, Z.d.y);
-        vtxData.normal = norm/*cross(drdU, drdV)*/;
+        vtxData = MakeVertexData(u, v, h, norm/*cross(drdU, drdV)*/);
         return vtxData;
     }
  
+    // vertices (j / M, v), j = 0..M, of a row; surfaces that can evaluate whole rows at once override it
+    virtual void GenRowData(float v, int M, VertexData * row) {
+        for (int j = 0; j <= M; j++) row[j] = GenVertexData((float)j / M, v);
+    }
+ 
+    // rows and strips are generated in parallel, sample() and GenRowData() must not write shared state
     void create(int N = tessellationLevel, int M = tessellationLevel) {
-        nVtxPerStrip = (M + 1) * 2;
-        nStrips = N;
-        std::vector<VertexData> vtxData;    // vertices on the CPU
-        for (int i = 0; i < N; i++) {
-            for (int j = 0; j <= M; j++) {
-                vtxData.push_back(GenVertexData((float)j / M, (float)i / N));
-                vtxData.push_back(GenVertexData((float)j / M, (float)(i + 1) / N));
+        LargeBuffer<VertexData> vtxData = GenerateStrips(N, M);
+        Upload(N, M, vtxData.data());
+    }
+ 
+    // create() left for GeometryCache to do in halves
+    void Defer(int N = tessellationLevel, int M = tessellationLevel) {
+        deferredN = N;
+        deferredM = M;
+    }
+    bool Pending() { return deferredN > 0; }
+    void Generate() { generated = GenerateStrips(deferredN, deferredM); }
+    void Finish() {
+        Upload(deferredN, deferredM, generated.data());
+        generated = LargeBuffer<VertexData>();
+        deferredN = deferredM = 0;
+    }
+ 
+    // the vertices of N strips of M quads with h normalized, the part of create() that needs no GL
+    LargeBuffer<VertexData> GenerateStrips(int N, int M) {
+        LargeBuffer<VertexData> rows((N + 1) * (M + 1), hugePages);  // every grid vertex once
+        if (normalMode == GridNormals) GenGridData(N, M, rows.data());
+        else {
+            int rowsPerJob = rows.RowsPerJob(M + 1);
+            parallelFor(N / rowsPerJob + 1, [&](int job) {
+                for (int i = job * rowsPerJob; i <= N && i < (job + 1) * rowsPerJob; i++)
+                    GenRowData((float)i / N, M, &rows[i * (M + 1)]);
+            });
+        }
+        LargeBuffer<VertexData> vtxData((M + 1) * 2 * N, hugePages);    // vertices on the CPU
+        int stripsPerJob = vtxData.RowsPerJob((M + 1) * 2);
+        parallelFor((N + stripsPerJob - 1) / stripsPerJob, [&](int job) {
+            for (int i = job * stripsPerJob; i < N && i < (job + 1) * stripsPerJob; i++) {
+                for (int j = 0; j <= M; j++) {
+                    vtxData[(i * (M + 1) + j) * 2] = rows[i * (M + 1) + j];
+                    vtxData[(i * (M + 1) + j) * 2 + 1] = rows[(i + 1) * (M + 1) + j];
+                }
             }
+        });
+        if (reportPlacement) {
+            rows.Placement("Tessellation grid");
+            vtxData.Placement("Strip vertices");
         }
         
         float min = vtxData[0].h, max = vtxData[0].h;
@@ -360,8 +957,16 @@ public:
         
         for (int i = 0; i < vtxData.size(); i++)
             vtxData[i].h = (vtxData[i].h - min) / (max - min);
-        
-        glBufferData(GL_ARRAY_BUFFER, nVtxPerStrip * nStrips * sizeof(VertexData), vtxData.data(), GL_STATIC_DRAW);
+        return vtxData;
+    }
+ 
+    // vertex buffer of N strips of M quads, from vtxData or left for the GPU to fill if it is null
+    void Upload(int N, int M, const VertexData * vtxData) {
+        nVtxPerStrip = (M + 1) * 2;
+        nStrips = N;
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, nVtxPerStrip * nStrips * sizeof(VertexData), vtxData, GL_STATIC_DRAW);
         // Enable the vertex attribute arrays
         glEnableVertexAttribArray(0);  // attribute array 0 = POSITION
         glEnableVertexAttribArray(1);  // attribute array 1 = NORMAL
@@ -370,27 +975,221 @@ public:
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, position));
         glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, normal));
         glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, h));
+        if (vtxData) SetBounds(vtxData, nVtxPerStrip * nStrips);
+        if (vtxData && clusterCulling) {
+            meshlets.BuildStrips(N, M, [vtxData](unsigned int k) { return &vtxData[k].position.x; });
+            if (!ibo) glGenBuffers(1, &ibo);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);     // part of the state of vao
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, meshlets.indices.size() * sizeof(unsigned int), meshlets.indices.data(), GL_STATIC_DRAW);
+            std::vector<unsigned int>().swap(meshlets.indices);
+        }
+    }
+ 
+    void SetBounds(const VertexData * vtxData, int count) {
+        vec3 lo = vtxData[0].position, hi = vtxData[0].position;
+        for (int i = 1; i < count; i++) {
+            const vec3& p = vtxData[i].position;
+            lo = vec3(fmin(lo.x, p.x), fmin(lo.y, p.y), fmin(lo.z, p.z));
+            hi = vec3(fmax(hi.x, p.x), fmax(hi.y, p.y), fmax(hi.z, p.z));
+        }
+        boundsCenter = (lo + hi) / 2;
+        boundsRadius = length(hi - lo) / 2;
     }
  
     void Draw() {
         glBindVertexArray(vao);
         for (unsigned int i = 0; i < nStrips; i++) glDrawArrays(GL_TRIANGLE_STRIP, i *  nVtxPerStrip, nVtxPerStrip);
     }
+ 
+    // the meshlets in the frustum that face the eye, in as few ranges as they make
+    void DrawVisible(const mat4& MVP, const vec3& eye) {
+        if (meshlets.Count() == 0) {
+            Draw();
+            return;
+        }
+        meshlets.Cull(MVP, eye.x, eye.y, eye.z, clusterStats);
+        if (meshlets.counts.empty()) return;
+        offsets.resize(meshlets.firsts.size());
+        for (size_t i = 0; i < offsets.size(); i++) offsets[i] = (const void *)(meshlets.firsts[i] * sizeof(unsigned int));
+        glBindVertexArray(vao);
+        glMultiDrawElements(GL_TRIANGLES, meshlets.counts.data(), GL_UNSIGNED_INT, offsets.data(), (int)offsets.size());
+    }
 };
  
  
+#if defined(GL_COMPUTE_SHADER)
 //---------------------------
-class Terrain : public ParamSurface {
+class TerrainBaker : public GPUProgram {
 //---------------------------
-    Dnum2 a = 1.0f, b = 0.15f;
-public:
-    Terrain() { create(); }
+// Writes the strip vertex buffer of a Fourier terrain with a compute shader (OpenGL 4.3).
+// Pass 0 evaluates height and gradient once per grid vertex, stores it into both strips that share the
+// vertex and reduces the height range per work group into two atomics; pass 1 normalizes h in place.
+    static constexpr const char * sourceBegin = R"(
+        #version 430
+        layout(local_size_x = 64) in;
  
-    void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
-        //double h;
-        
-        //getTerrainInfo(U.f, V.f, 60, h);
-        //U = U * 15;
+        layout(std430, binding = 0) buffer Vertices { float vtx[]; };              // VertexData: position, normal, h
+        layout(std430, binding = 1) readonly buffer Harmonics { vec4 harmonics[]; }; // k1, k2, amplitude, phase
+        layout(std430, binding = 2) buffer Range { uint range[2]; };               // min, max as ordered bits
+ 
+        uniform int   nHarmonics, N, M, pass;
+        uniform float worldSize;
+ 
+        shared uint groupMin[64], groupMax[64];
+ 
+        uint orderedBits(float f) { uint u = floatBitsToUint(f); return (u & 0x80000000u) != 0u ? ~u : u | 0x80000000u; }
+        float orderedFloat(uint u) { return uintBitsToFloat((u & 0x80000000u) != 0u ? u & 0x7FFFFFFFu : ~u); }
+ 
+        void store(int slot, vec3 pos, vec3 norm, float h) {
+            vtx[slot * 7 + 0] = pos.x;  vtx[slot * 7 + 1] = pos.y;  vtx[slot * 7 + 2] = pos.z;
+            vtx[slot * 7 + 3] = norm.x; vtx[slot * 7 + 4] = norm.y; vtx[slot * 7 + 5] = norm.z;
+            vtx[slot * 7 + 6] = h;
+        }
+ 
+        void main() {
+            int id = int(gl_GlobalInvocationID.x), local = int(gl_LocalInvocationID.x);
+            if (pass == 1) {
+                float lo = orderedFloat(range[0]), hi = orderedFloat(range[1]);
+                if (id < N * (M + 1) * 2) vtx[id * 7 + 6] = hi > lo ? (vtx[id * 7 + 6] - lo) / (hi - lo) : 0.0;
+                return;
+            }
+            bool inside = id < (N + 1) * (M + 1);
+            int i = id / (M + 1), j = id % (M + 1);
+            vec2 uv = vec2(float(j) / float(M), float(i) / float(N));
+            vec2 xy = uv * 3.14159265 - 3.14159265;
+            float h = 0;
+            vec2 g = vec2(0, 0);
+            if (inside) {
+                for (int k = 0; k < nHarmonics; k++) {
+                    vec4 harmonic = harmonics[k];
+                    float angle = harmonic.x * xy.x + harmonic.y * xy.y + harmonic.w;
+                    h += harmonic.z * cos(angle);
+                    g -= harmonic.z * sin(angle) * harmonic.xy;
+                }
+    )";
+    static constexpr const char * sourceEnd = R"(
+                vec3 pos = vec3(uv.x * worldSize - worldSize / 2, h, uv.y * worldSize - worldSize / 2);
+                vec3 norm = vec3(-g.x, 1, -g.y);
+                if (i < N) store(i * (M + 1) * 2 + j * 2, pos, norm, h);            // lower vertex of strip i
+                if (i > 0) store((i - 1) * (M + 1) * 2 + j * 2 + 1, pos, norm, h);  // upper vertex of strip i - 1
+            }
+            groupMin[local] = inside ? orderedBits(h) : 0xFFFFFFFFu;
+            groupMax[local] = inside ? orderedBits(h) : 0u;
+            barrier();
+            for (int stride = 32; stride > 0; stride /= 2) {
+                if (local < stride) {
+                    groupMin[local] = min(groupMin[local], groupMin[local + stride]);
+                    groupMax[local] = max(groupMax[local], groupMax[local + stride]);
+                }
+                barrier();
+            }
+            if (local == 0) {
+                atomicMin(range[0], groupMin[0]);
+                atomicMax(range[1], groupMax[0]);
+            }
+        }
+    )";
+ 
+public:
+    static bool Available() {
+        int major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        return major > 4 || (major == 4 && minor >= 3);
+    }
+ 
+    // shapeGLSL post-processes h and g, see FourierSpectrum::shapeGLSL
+    TerrainBaker(const char * shapeGLSL) : GPUProgram(false) {
+        std::string source = std::string(sourceBegin) + shapeGLSL + sourceEnd;
+        createCompute(source.c_str());
+    }
+ 
+    // harmonics: k1, k2, amplitude, phase quadruples; the buffer must hold N strips of M quads
+    bool Bake(unsigned int vbo, int N, int M, const std::vector<float>& harmonics) {
+        if (getId() == 0) return false;
+        unsigned int buffers[2];
+        glGenBuffers(2, buffers);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[0]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, harmonics.size() * sizeof(float), harmonics.data(), GL_STATIC_DRAW);
+        unsigned int range[2] = { 0xFFFFFFFFu, 0 };
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[1]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(range), range, GL_DYNAMIC_COPY);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vbo);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, buffers[0]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, buffers[1]);
+ 
+        Use();
+        setUniform((int)harmonics.size() / 4, "nHarmonics");
+        setUniform(N, "N");
+        setUniform(M, "M");
+        setUniform(terrainWorldSize, "worldSize");
+        setUniform(0, "pass");
+        glDispatchCompute(((N + 1) * (M + 1) + 63) / 64, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        setUniform(1, "pass");
+        glDispatchCompute((N * (M + 1) * 2 + 63) / 64, 1, 1);
+        glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+ 
+        glDeleteBuffers(2, buffers);
+        return true;
+    }
+};
+#endif
+ 
+//---------------------------
+template<class Spectrum = TerrainSpectrum>
+class Terrain : public ParamSurface {
+//---------------------------
+    Dnum2 a = 1.0f, b = 0.15f;
+public:
+    // deferred: the vertices are left for GeometryCache to generate, unless they are baked on the GPU
+    Terrain(NormalMode mode = AnalyticNormals, bool gpuBake = false, bool deferred = false) {
+        normalMode = mode;
+        if (gpuBake && mode == AnalyticNormals && Bake()) return;
+        if (deferred) Defer();
+        else create();
+    }
+ 
+    // generates the vertex buffer with a compute shader, false if that is not supported
+    bool Bake(int N = tessellationLevel, int M = tessellationLevel) {
+#if defined(GL_COMPUTE_SHADER)
+        if (!TerrainBaker::Available()) {
+            printf("Compute shaders need OpenGL 4.3, terrain is generated on the CPU\n");
+            return false;
+        }
+        const int n = terrainHarmonics;
+        TablePhases phase(coeffs, n);
+        std::vector<float> harmonics;
+        double maxHeight = 0;   // |h| <= sum of the amplitudes, the heights stay on the GPU
+        for (int one = 0; one <= n; one++) {
+            for (int two = 0; two <= n; two++) {
+                double amplitude = Spectrum::amplitude(A, one, two, n);
+                if (amplitude == 0) continue;
+                harmonics.insert(harmonics.end(), { (float)one, (float)two, (float)amplitude, (float)phase(one, two) });
+                maxHeight += fabs(amplitude);
+            }
+        }
+        Upload(N, M, nullptr);
+        boundsCenter = vec3(0, 0, 0);
+        boundsRadius = length(vec3(terrainWorldSize / 2, maxHeight, terrainWorldSize / 2));
+        TerrainBaker baker(Spectrum::shapeGLSL());
+        return baker.Bake(vbo, N, M, harmonics);
+#else
+        return false;
+#endif
+    }
+ 
+    void sample(float u, float v, double& h, vec3& norm) {
+        getTerrainInfo<Spectrum>(u, v, terrainHarmonics, h, norm);
+    }
+ 
+    double sampleHeight(float u, float v) { return getTerrainHeight<Spectrum>(u, v, terrainHarmonics); }
+ 
+    void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {
+        //double h;
+        
+        //getTerrainInfo(U.f, V.f, 60, h);
+        //U = U * 15;
         //V = V * 15;
         //X = U - 7.5;
         //Z = V - 7.5;
@@ -399,42 +1198,1673 @@ public:
 };
  
 //---------------------------
-struct Object {
+class NoiseTerrain : public ParamSurface {
+//---------------------------
+    NoiseOptions options;
+    unsigned int seed;
+ 
+public:
+    NoiseTerrain(unsigned int _seed, bool deferred = false) : seed(_seed) {
+        if (deferred) Defer();
+        else create();
+    }
+ 
+    void sample(float u, float v, double& h, vec3& norm) {
+        float height, dhdu, dhdv;
+        gradientNoise(seed, options, 1, &u, &v, &height, &dhdu, &dhdv);
+        h = height;
+        norm = GradientNormal(dhdu, dhdv);
+    }
+ 
+    void GenRowData(float v, int M, VertexData * row) {
+        std::vector<float> u(M + 1), vs(M + 1, v), h(M + 1), dhdu(M + 1), dhdv(M + 1);
+        for (int j = 0; j <= M; j++) u[j] = (float)j / M;
+        gradientNoise(seed, options, M + 1, u.data(), vs.data(), h.data(), dhdu.data(), dhdv.data());
+        for (int j = 0; j <= M; j++) row[j] = MakeVertexData(u[j], v, h[j], GradientNormal(dhdu[j], dhdv[j]));
+    }
+ 
+    void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {}
+};
+ 
+//---------------------------
+class HeightFieldSurface : public Geometry {
+//---------------------------
+// Terrain drawn by HeightFieldShader: 2 (R16) or 4 (R32F) bytes per grid vertex in a texture instead of
+// a 28 byte VertexData per strip vertex, and one instanced draw of the same strip for every row.
+// The vertex array object stays empty, the shader pulls everything from the texture.
+    unsigned int heightMap = 0;
+    int N, M;
+    bool r16;
+    float minHeight, maxHeight;
+    vec2 decode;        // texel to height scale and offset
+    static const int heightMapUnit = 1;
+public:
+    HeightFieldSurface(std::function<double(float, float)> height, bool _r16 = false,
+                       int _N = tessellationLevel, int _M = tessellationLevel) : N(_N), M(_M), r16(_r16) {
+        const int W = M + 3, H = N + 3;
+        std::vector<float> heights(W * H);
+        for (int i = -1; i <= N + 1; i++)
+            for (int j = -1; j <= M + 1; j++) heights[(i + 1) * W + j + 1] = height((float)j / M, (float)i / N);
+ 
+        minHeight = maxHeight = heights[W + 1];     // range of the grid, not the halo
+        for (int i = 1; i <= N + 1; i++) {
+            for (int j = 1; j <= M + 1; j++) {
+                minHeight = fmin(minHeight, heights[i * W + j]);
+                maxHeight = fmax(maxHeight, heights[i * W + j]);
+            }
+        }
+ 
+        glGenTextures(1, &heightMap);
+        glBindTexture(GL_TEXTURE_2D, heightMap);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if (r16) {  // unsigned normalized, the halo may fall slightly outside the range of the grid
+            float lo = heights[0], hi = heights[0];
+            for (float h : heights) { lo = fmin(lo, h); hi = fmax(hi, h); }
+            std::vector<unsigned short> texels(W * H);
+            for (int i = 0; i < W * H; i++)
+                texels[i] = hi > lo ? (unsigned short)((heights[i] - lo) / (hi - lo) * 65535 + 0.5f) : 0;
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, W, H, 0, GL_RED, GL_UNSIGNED_SHORT, texels.data());
+            decode = vec2(hi > lo ? hi - lo : 1, lo);   // a flat grid is all texel 0, any scale decodes it
+        }
+        else {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, W, H, 0, GL_RED, GL_FLOAT, heights.data());
+            decode = vec2(1, 0);
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+ 
+        boundsCenter = vec3(0, (minHeight + maxHeight) / 2, 0);
+        boundsRadius = length(vec3(terrainWorldSize / 2, (maxHeight - minHeight) / 2, terrainWorldSize / 2));
+    }
+ 
+    // the grid of a program with the vertex stage of HeightFieldShader, its depth program included
+    void SetUniforms(GPUProgram& program) {
+        glActiveTexture(GL_TEXTURE0 + heightMapUnit);
+        glBindTexture(GL_TEXTURE_2D, heightMap);
+        program.setUniform(heightMapUnit, "heightMap");
+        program.setUniform(vec2((float)M, (float)N), "gridSize");
+        program.setUniform(decode, "heightDecode");
+        if (program.uses("heightRange")) program.setUniform(vec2(minHeight, maxHeight), "heightRange");  // for shading only
+        program.setUniform(terrainWorldSize, "worldSize");
+    }
+ 
+    void Draw() {
+        glBindVertexArray(vao);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, (M + 1) * 2, N);
+    }
+ 
+    ~HeightFieldSurface() { glDeleteTextures(1, &heightMap); }
+};
+ 
+//---------------------------
+class InstancedMesh : public Geometry {
+//---------------------------
+// A small triangle mesh drawn for every instance in one call, for InstanceShader
+    unsigned int instanceVbo, nVertices = 0, nInstances = 0;
+public:
+    struct Instance {
+        vec3 translation;   // in the modeling space of the terrain
+        float scale, angle;
+    };
+ 
+    // triangles: three corners each, flat shaded
+    InstancedMesh(const std::vector<vec3>& triangles) {
+        std::vector<vec3> vertices;     // position, normal
+        for (size_t i = 0; i + 2 < triangles.size(); i += 3) {
+            vec3 normal = normalize(cross(triangles[i + 1] - triangles[i], triangles[i + 2] - triangles[i]));
+            for (size_t k = i; k < i + 3; k++) vertices.insert(vertices.end(), { triangles[k], normal });
+        }
+        nVertices = (unsigned int)vertices.size() / 2;
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(vec3), vertices.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 2 * sizeof(vec3), (void*)0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 2 * sizeof(vec3), (void*)sizeof(vec3));
+ 
+        glGenBuffers(1, &instanceVbo);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+        glEnableVertexAttribArray(3);
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, translation));
+        glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, angle));
+        glVertexAttribDivisor(3, 1);
+        glVertexAttribDivisor(4, 1);
+    }
+ 
+    void SetInstances(const std::vector<Instance>& instances) {
+        nInstances = (unsigned int)instances.size();
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+        glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(Instance), instances.data(), GL_STATIC_DRAW);
+    }
+ 
+    void Draw() {
+        glBindVertexArray(vao);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, nVertices, nInstances);
+    }
+ 
+    ~InstancedMesh() { glDeleteBuffers(1, &instanceVbo); }
+ 
+    // tree: a cone of unit height and 0.3 base radius standing on the origin
+    static std::vector<vec3> Cone(int sides = 8) {
+        std::vector<vec3> triangles;
+        vec3 apex(0, 1, 0), center(0, 0.1f, 0);
+        for (int i = 0; i < sides; i++) {
+            float a0 = 2 * (float)M_PI * i / sides, a1 = 2 * (float)M_PI * (i + 1) / sides;
+            vec3 p0(0.3f * cosf(a0), 0.1f, 0.3f * sinf(a0)), p1(0.3f * cosf(a1), 0.1f, 0.3f * sinf(a1));
+            triangles.insert(triangles.end(), { p0, apex, p1, p0, p1, center });
+        }
+        return triangles;
+    }
+ 
+    // rock: a flattened octahedron of unit radius with its corners moved a little at random
+    static std::vector<vec3> Rock(unsigned int seed = 1) {
+        std::mt19937 generator(seed);
+        auto jitter = [&]() { return 0.8f + 0.4f * (float)generator() / std::mt19937::max(); };
+        vec3 corners[6] = { vec3(jitter(), 0, 0), vec3(-jitter(), 0, 0), vec3(0, 0.6f * jitter(), 0),
+                            vec3(0, -0.3f, 0), vec3(0, 0, jitter()), vec3(0, 0, -jitter()) };
+        const int faces[8][3] = { { 0, 2, 4 }, { 4, 2, 1 }, { 1, 2, 5 }, { 5, 2, 0 },
+                                  { 0, 4, 3 }, { 4, 1, 3 }, { 1, 5, 3 }, { 5, 0, 3 } };
+        std::vector<vec3> triangles;
+        for (const int * face : faces) triangles.insert(triangles.end(), { corners[face[0]], corners[face[1]], corners[face[2]] });
+        return triangles;
+    }
+};
+ 
+// Blue noise points of the domain of options on the terrain that pass rule, with heights normalized to
+// [0, 1] by the range [minHeight, maxHeight]. The filter caches a height grid per tile, 1 / 128 of the
+// unit square apart, and interpolates height and slope from it.
+inline std::vector<ScatterPoint> scatterOnTerrain(const ScatterOptions& options, const ScatterRule& rule,
+                                                  const HeightGridFunction& heightGrid, float minHeight, float maxHeight) {
+    const double step = 1.0 / 128;
+    PoissonDiskScatter scatter;
+    return scatter.Generate(options, [&](const ScatterTile& tile, std::vector<ScatterPoint>& points) {
+        if (points.empty()) return;
+        // nodes -1 .. n + 1 along both axes: a halo for the central differences
+        const int nu = (int)ceil((tile.u1 - tile.u0) / step), nv = (int)ceil((tile.v1 - tile.v0) / step), W = nu + 3;
+        std::vector<float> h(W * (nv + 3));
+        heightGrid(tile.u0 - step, tile.v0 - step, step, W, nv + 3, h.data());
+        auto node = [&](int i, int j, float& value, float& slope) {
+            const float * c = &h[(i + 1) * W + j + 1];
+            float dhdu = (c[1] - c[-1]) / (2 * step), dhdv = (c[W] - c[-W]) / (2 * step);
+            value = c[0];
+            slope = sqrtf(dhdu * dhdu + dhdv * dhdv) / terrainWorldSize;   // rise over run in modeling space
+        };
+        size_t kept = 0;
+        for (const ScatterPoint& point : points) {
+            float x = (float)((point.u - tile.u0) / step), y = (float)((point.v - tile.v0) / step);
+            int j = std::min((int)x, nu - 1), i = std::min((int)y, nv - 1);
+            float fx = x - j, fy = y - i, value = 0, slope = 0;
+            for (int k = 0; k < 4; k++) {
+                float nodeValue, nodeSlope, weight = (k & 1 ? fx : 1 - fx) * (k & 2 ? fy : 1 - fy);
+                node(i + (k >> 1), j + (k & 1), nodeValue, nodeSlope);
+                value += weight * nodeValue;
+                slope += weight * nodeSlope;
+            }
+            if (!rule.Accepts((value - minHeight) / (maxHeight - minHeight), slope)) continue;
+            points[kept] = point;
+            points[kept++].h = value;
+        }
+        points.resize(kept);
+    });
+}
+ 
+//---------------------------
+class TerrainTile : public ParamSurface {
+//---------------------------
+// Tile (tx, tz) of an endless terrain: parameters [tx, tx + 1] x [tz, tz + 1], drawn around the
+// translation (tx, 0, tz) * terrainWorldSize. The vertices are generated into a shared Block on a worker
+// thread and uploaded on the GL thread, so a job never touches the tile and the tile can be dropped any time.
+public:
+    // height and parameter space gradient (per radian, as getTerrainInfo) on a res x res grid from (u0, v0)
+    typedef std::function<void(double u0, double v0, int res, double * h, double * dx, double * dy)> GridFunction;
+ 
+    struct Block {
+        std::atomic<bool> started{false}, ready{false};
+        std::vector<VertexData> vtxData;
+    };
+ 
+    static const int tessellation = 64;
+    const int tx, tz;
+    std::shared_ptr<Block> block = std::make_shared<Block>();
+ 
+private:
+    GridFunction grid;
+    bool uploaded = false;
+ 
+public:
+    TerrainTile(int _tx, int _tz, GridFunction _grid) : tx(_tx), tz(_tz), grid(_grid) {}
+ 
+    // fills block with the strips of tile (tx, tz) on any thread, once even if it is queued several times.
+    // h is normalized with the fixed range [minHeight, maxHeight] so neighbouring tiles agree at the border.
+    static void Generate(int tx, int tz, const GridFunction& grid, float minHeight, float maxHeight, Block& block) {
+        if (block.started.exchange(true)) return;
+        const int N = tessellation, R = N + 1;
+        std::vector<double> h(R * R), dx(R * R), dy(R * R);
+        grid(tx, tz, R, h.data(), dx.data(), dy.data());
+        std::vector<VertexData> vtxData;
+        vtxData.reserve(R * 2 * N);
+        for (int i = 0; i < N; i++) {
+            for (int j = 0; j <= N; j++) {
+                for (int k = i * R + j; k <= (i + 1) * R + j; k += R) {
+                    VertexData vertex = MakeVertexData((float)j / N, (float)(k / R) / N, h[k], vec3(-dx[k], 1, -dy[k]));
+                    vertex.h = fmin(fmax((h[k] - minHeight) / (maxHeight - minHeight), 0), 1);
+                    vtxData.push_back(vertex);
+                }
+            }
+        }
+        block.vtxData.swap(vtxData);
+        block.ready = true;
+    }
+ 
+    // uploads the vertices once they are generated, true if the tile can be drawn
+    bool UploadIfReady() {
+        if (!uploaded && block->ready) {
+            Upload(tessellation, tessellation, block->vtxData.data());
+            std::vector<VertexData>().swap(block->vtxData);
+            uploaded = true;
+        }
+        return uploaded;
+    }
+ 
+    void sample(float u, float v, double& h, vec3& norm) {
+        double dx, dy;
+        grid(tx + u, tz + v, 1, &h, &dx, &dy);
+        norm = vec3(-dx, 1, -dy);
+    }
+ 
+    void eval(Dnum2& U, Dnum2& V, Dnum2& X, Dnum2& Y, Dnum2& Z) {}
+ 
+    void Draw() { if (uploaded) ParamSurface::Draw(); }
+};
+ 
+//---------------------------
+struct GeometryKey {
+//---------------------------
+// The parameters a mesh is generated from, in words: their 64 bit FNV-1a hash finds the entry and the
+// words themselves decide equality, so meshes with colliding hashes are never shared
+    uint64_t hash = 14695981039346656037ull;
+    std::string text;
+ 
+    GeometryKey(const char * kind) { Add(kind); }
+ 
+    GeometryKey& Add(const std::string& word) {
+        for (char c : word + " ") {
+            hash ^= (unsigned char)c;
+            hash *= 1099511628211ull;
+        }
+        text += word + " ";
+        return *this;
+    }
+    GeometryKey& operator()(const char * name, const std::string& value) { return Add(std::string(name) + "=" + value); }
+    GeometryKey& operator()(const char * name, double value) {
+        char number[32];
+        snprintf(number, sizeof(number), "%.17g", value);
+        return (*this)(name, std::string(number));
+    }
+ 
+    bool operator==(const GeometryKey& key) const { return hash == key.hash && text == key.text; }
+    struct Hash { size_t operator()(const GeometryKey& key) const { return (size_t)key.hash; } };
+};
+ 
+//---------------------------
+class GeometryCache {
+//---------------------------
+// Geometry shared by the objects that need the same mesh: Get returns the geometry of a key as long as
+// anything holds it, so every unique mesh is generated and stored once and freed with its last user.
+// A mesh that can be generated in halves (Geometry::Pending) is generated by one job on the workers;
+// requests for its key that arrive meanwhile get the same geometry and wait for the same job.
+// The cache holds such geometry until Update has uploaded it, so GL objects are only ever deleted on the
+// GL thread. Get and Update are called on the GL thread.
+    struct Entry {
+        std::weak_ptr<Geometry> geometry;
+        std::shared_ptr<Geometry> generating;   // until its job is done and Finish has run
+        std::shared_future<void> done;
+    };
+    std::unordered_map<GeometryKey, Entry, GeometryKey::Hash> entries;
+    std::unique_ptr<JobQueue> workers;      // after entries: destroyed first, it waits for the running jobs
+ 
+public:
+    int requests = 0, generated = 0;
+ 
+    // the geometry of key, made by make() if no one holds it
+    std::shared_ptr<Geometry> Get(const GeometryKey& key, const std::function<Geometry *()>& make) {
+        requests++;
+        Entry& entry = entries[key];
+        if (std::shared_ptr<Geometry> geometry = entry.geometry.lock()) return geometry;
+        std::shared_ptr<Geometry> geometry(make());
+        generated++;
+        entry.geometry = geometry;
+        if (geometry->Pending()) {
+            if (!workers) workers.reset(new JobQueue(0, false));
+            auto promise = std::make_shared<std::promise<void>>();
+            entry.done = promise->get_future().share();
+            entry.generating = geometry;
+            Geometry * job = geometry.get();
+            workers->Push(0, makeCancelToken(), [job, promise]() {
+                job->Generate();
+                promise->set_value();
+            });
+        }
+        return geometry;
+    }
+ 
+    // finishes the geometry whose jobs are done, or waits for all of them, and forgets unused keys
+    void Update(bool wait = false) {
+        for (auto it = entries.begin(); it != entries.end();) {
+            Entry& entry = it->second;
+            if (entry.generating && (wait || entry.done.wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+                entry.done.wait();
+                entry.generating->Finish();
+                entry.generating.reset();
+            }
+            if (!entry.generating && entry.geometry.expired()) it = entries.erase(it);
+            else ++it;
+        }
+    }
+ 
+    int Unique() const { return (int)entries.size(); }
+};
+ 
+//---------------------------
+struct Object {
+//---------------------------
+    Shader *   shader;
+    Material * material;
+    Texture *  texture;
+    Geometry * geometry;
+    std::shared_ptr<Geometry> sharedGeometry;   // keeps geometry of a GeometryCache alive
+    vec3 scale, translation, rotationAxis;
+    float rotationAngle;
+public:
+    Object(Shader * _shader, Material * _material, Texture * _texture, Geometry * _geometry) :
+        scale(vec3(1, 1, 1)), translation(vec3(0, 0, 0)), rotationAxis(0, 0, 1), rotationAngle(0) {
+        shader = _shader;
+        texture = _texture;
+        material = _material;
+        geometry = _geometry;
+    }
+ 
+    Object(Shader * _shader, Material * _material, Texture * _texture, std::shared_ptr<Geometry> _geometry) :
+        Object(_shader, _material, _texture, _geometry.get()) { sharedGeometry = _geometry; }
+ 
+    virtual ~Object() {}
+ 
+    virtual void SetModelingTransform(mat4& M, mat4& Minv) {
+        M = ScaleMatrix(scale) * RotationMatrix(rotationAngle, rotationAxis) * TranslateMatrix(translation);
+        Minv = TranslateMatrix(-translation) * RotationMatrix(-rotationAngle, rotationAxis) * ScaleMatrix(vec3(1 / scale.x, 1 / scale.y, 1 / scale.z));
+    }
+ 
+    void Draw(RenderState state) {
+        mat4 M, Minv;
+        SetModelingTransform(M, Minv);
+        state.M = M;
+        state.Minv = Minv;
+        state.MVP = state.M * state.V * state.P;
+        state.material = material;
+        state.texture = texture;
+        Shader * program = state.multiView ? shader->MultiView() : shader;
+        if (!program) return;
+        program->Bind(state);
+        geometry->SetUniforms(*program);
+        if (state.multiView) geometry->Draw();     // no single frustum to cull with
+        else {
+            vec4 eye = vec4(state.wEye.x, state.wEye.y, state.wEye.z, 1) * Minv;
+            geometry->DrawVisible(state.MVP, vec3(eye.x, eye.y, eye.z));
+        }
+    }
+};
+ 
+//---------------------------
+class ImpostorShader : public GPUProgram {
+//---------------------------
+// Camera facing quad over the bounding sphere of an object, textured from its atlas slot. The captured
+// depth moves every texel back to its place inside the sphere, so impostors intersect correctly.
+    const char * vertexSource = R"(
+        #version 330
+        precision highp float;
+ 
+        uniform mat4  VP;
+        uniform vec3  center, right, up;    // world space, right and up span the view plane
+        uniform float radius;
+        uniform vec4  slot;                 // atlas offset and size
+ 
+        layout(location = 0) in vec2 corner;    // [-1,1]^2
+ 
+        out vec2 texcoord;
+        out vec2 local;
+ 
+        void main() {
+            gl_Position = vec4(center + (right * corner.x + up * corner.y) * radius, 1) * VP;
+            texcoord = slot.xy + (corner * 0.5 + 0.5) * slot.zw;
+            local = corner;
+        }
+    )";
+ 
+    const char * fragmentSource = R"(
+        #version 330
+        precision highp float;
+ 
+        uniform mat4  VP;
+        uniform vec3  center, right, up, toEye;
+        uniform float radius;
+        uniform sampler2D colorAtlas, depthAtlas;
+ 
+        in  vec2 texcoord;
+        in  vec2 local;
+        out vec4 fragmentColor;
+ 
+        void main() {
+            vec4 color = texture(colorAtlas, texcoord);
+            if (color.a < 0.5) discard;
+            float depth = texture(depthAtlas, texcoord).r;  // 0 at the front of the sphere, 1 at the back
+            vec3 wPos = center + (right * local.x + up * local.y + toEye * (1 - 2 * depth)) * radius;
+            vec4 clip = vec4(wPos, 1) * VP;
+            gl_FragDepth = clip.z / clip.w * 0.5 + 0.5;
+            fragmentColor = color;
+        }
+    )";
+public:
+    ImpostorShader() { create(vertexSource, fragmentSource, "fragmentColor"); }
+};
+ 
+//---------------------------
+class ImpostorAtlas {
+//---------------------------
+// Objects farther than a distance are drawn as a single quad textured with an earlier capture of the object
+// (color and depth) in a slot of a shared atlas. A capture is redone when the view direction, measured in
+// the modeling space of the object so that its own rotation counts, turns more than a threshold angle.
+    struct Impostor {
+        int slot;
+        bool captured;      // the slot holds a capture of the object
+        vec3 viewDir;       // modeling space direction towards the eye at capture time
+    };
+ 
+    static const int slotSize = 256, slotsPerRow = 4;
+    unsigned int fbo, colorTexture, depthTexture, vao, vbo;
+    ImpostorShader shader;
+    std::vector<std::pair<Object *, Impostor>> impostors;
+    float distance, cosThreshold;
+public:
+    int captures = 0;   // number of object renderings into the atlas so far
+ 
+    // thresholdDegrees in [0, 180)
+    ImpostorAtlas(float _distance, float thresholdDegrees) {
+        distance = _distance;
+        cosThreshold = cosf(thresholdDegrees * (float)M_PI / 180);
+        const int size = slotSize * slotsPerRow;
+        glGenTextures(1, &colorTexture);
+        glBindTexture(GL_TEXTURE_2D, colorTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glGenTextures(1, &depthTexture);
+        glBindTexture(GL_TEXTURE_2D, depthTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("Impostor atlas is incomplete\n");
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+ 
+        float corners[] = { -1, -1, 1, -1, -1, 1, 1, 1 };
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+    }
+ 
+    // draws the object as an impostor if it is far enough, returns false if it should be drawn normally
+    bool Draw(Object& object, const RenderState& state) {
+        Geometry * geometry = object.geometry;
+        if (geometry->boundsRadius <= 0) return false;
+        mat4 M, Minv;
+        object.SetModelingTransform(M, Minv);
+        vec4 c = vec4(geometry->boundsCenter.x, geometry->boundsCenter.y, geometry->boundsCenter.z, 1) * M;
+        vec3 center(c.x, c.y, c.z);
+        float radius = geometry->boundsRadius * fmax(fabs(object.scale.x), fmax(fabs(object.scale.y), fabs(object.scale.z)));
+        vec3 toEye = state.wEye - center;
+        if (length(toEye) - radius < distance) return false;
+        toEye = normalize(toEye);
+ 
+        vec4 d = vec4(toEye.x, toEye.y, toEye.z, 0) * Minv;     // direction to modeling space
+        vec3 viewDir = normalize(vec3(d.x, d.y, d.z));
+        Impostor * impostor = Find(&object);
+        if (!impostor) {
+            if ((int)impostors.size() == slotsPerRow * slotsPerRow) return false;   // atlas is full
+            impostors.push_back({ &object, { (int)impostors.size(), false, vec3(0, 0, 0) } });
+            impostor = &impostors.back().second;
+        }
+        vec3 right, up;
+        Basis(toEye, right, up);
+        if (!impostor->captured || dot(impostor->viewDir, viewDir) < cosThreshold) {
+            Capture(object, state, impostor->slot, center, radius, toEye);
+            impostor->captured = true;
+            impostor->viewDir = viewDir;
+        }
+ 
+        shader.Use();
+        mat4 VP = state.V * state.P;
+        shader.setUniform(VP, "VP");
+        shader.setUniform(center, "center");
+        shader.setUniform(right, "right");
+        shader.setUniform(up, "up");
+        shader.setUniform(toEye, "toEye");
+        shader.setUniform(radius, "radius");
+        float slotUV = 1.0f / slotsPerRow;
+        shader.setUniform(vec4((impostor->slot % slotsPerRow) * slotUV, (impostor->slot / slotsPerRow) * slotUV, slotUV, slotUV), "slot");
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, colorTexture);
+        shader.setUniform(0, "colorAtlas");
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, depthTexture);
+        shader.setUniform(1, "depthAtlas");
+        glBindVertexArray(vao);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        return true;
+    }
+ 
+    ~ImpostorAtlas() {
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteTextures(1, &colorTexture);
+        glDeleteTextures(1, &depthTexture);
+        glDeleteBuffers(1, &vbo);
+        glDeleteVertexArrays(1, &vao);
+    }
+ 
+private:
+    Impostor * Find(Object * object) {
+        for (auto& entry : impostors) if (entry.first == object) return &entry.second;
+        return nullptr;
+    }
+ 
+    // view plane axes for a view direction, the same ones Camera::V builds
+    static void Basis(const vec3& toEye, vec3& right, vec3& up) {
+        vec3 vup = fabs(toEye.y) > 0.99f ? vec3(0, 0, 1) : vec3(0, 1, 0);
+        right = normalize(cross(vup, toEye));
+        up = cross(toEye, right);
+    }
+ 
+    // renders the object into its slot with an orthographic camera whose view volume is the bounding sphere
+    void Capture(Object& object, RenderState state, int slot, const vec3& center, float radius, const vec3& toEye) {
+        Camera camera;
+        camera.wEye = center + toEye * (2 * radius);
+        camera.wLookat = center;
+        camera.wVup = fabs(toEye.y) > 0.99f ? vec3(0, 0, 1) : vec3(0, 1, 0);
+        state.V = camera.V();
+        float n = radius, f = 3 * radius;     // near and far planes touch the sphere
+        state.P = mat4(1 / radius, 0,          0,                  0,
+                       0,          1 / radius, 0,                  0,
+                       0,          0,          -2 / (f - n),       0,
+                       0,          0,          -(f + n) / (f - n), 1);
+ 
+        int viewport[4], draw, read;     // of the pass the capture interrupts
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &draw);
+        glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        int x = (slot % slotsPerRow) * slotSize, y = (slot / slotsPerRow) * slotSize;
+        glViewport(x, y, slotSize, slotSize);
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(x, y, slotSize, slotSize);
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glDisable(GL_SCISSOR_TEST);
+        object.Draw(state);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, read);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        captures++;
+    }
+};
+ 
+//---------------------------
+class TerrainStreamer {
+//---------------------------
+// Endless terrain of TerrainTiles around the camera. Besides the tiles in view it extrapolates the motion
+// of wEye and wLookat, ranks the tiles the camera is about to see by expected time to visibility and
+// generates them ahead on low priority workers, most urgent first. When the predicted path changes, the
+// queued tiles it no longer passes are cancelled. A tile that comes into view before it is generated is
+// a miss: it is queued ahead of everything else and pops in when ready.
+    typedef std::pair<int, int> Key;
+    struct Entry {
+        TerrainTile * tile;
+        Object * object;
+        CancelToken token;
+        float priority;     // of the last queued job
+        bool seen;          // has been in view, counted as a hit or a miss
+    };
+    std::map<Key, Entry> tiles;
+    std::vector<Object *> visible;
+    JobQueue workers;
+    TerrainTile::GridFunction grid;
+    float minHeight, maxHeight;
+    Shader * shader;
+    Material * material;
+    Texture * texture;
+ 
+    vec3 lastEye, lastLookat, eyeVelocity, lookatVelocity;
+    float lastTime = -1, lastReport = 0;
+ 
+    static int TileIndex(float x) { return (int)floorf(x / terrainWorldSize + 0.5f); }
+ 
+    // conservative: the bounding sphere of the tile against the view distance and a cone around the
+    // view direction that contains the frustum
+    bool InView(const Camera& camera, const vec3& eye, const vec3& lookat, int tx, int tz) const {
+        vec3 d = vec3(tx * terrainWorldSize, (minHeight + maxHeight) / 2, tz * terrainWorldSize) - eye;
+        float radius = length(vec3(terrainWorldSize / 2, (maxHeight - minHeight) / 2, terrainWorldSize / 2));
+        float distance = length(d);
+        if (distance <= radius) return true;
+        if (distance - radius > camera.bp) return false;
+        float halfAngle = atanf(tanf(camera.fov / 2) * sqrtf(1 + camera.asp * camera.asp));
+        float cosAngle = dot(d / distance, normalize(lookat - eye));
+        return acosf(fmin(fmax(cosAngle, -1.0f), 1.0f)) - asinf(radius / distance) <= halfAngle;
+    }
+ 
+    template<class F> void ForTilesInView(const Camera& camera, const vec3& eye, const vec3& lookat, F f) const {
+        float reach = camera.bp + terrainWorldSize;
+        for (int tz = TileIndex(eye.z - reach); tz <= TileIndex(eye.z + reach); tz++)
+            for (int tx = TileIndex(eye.x - reach); tx <= TileIndex(eye.x + reach); tx++)
+                if (InView(camera, eye, lookat, tx, tz)) f(tx, tz);
+    }
+ 
+    Entry& Request(int tx, int tz) {
+        auto it = tiles.find(Key(tx, tz));
+        if (it != tiles.end()) return it->second;
+        TerrainTile * tile = new TerrainTile(tx, tz, grid);
+        Object * object = new Object(shader, material, texture, tile);
+        object->translation = vec3(tx * terrainWorldSize, 0, tz * terrainWorldSize);
+        Entry entry = { tile, object, nullptr, 0, false };
+        return tiles[Key(tx, tz)] = entry;
+    }
+ 
+    // queues the generation of the tile unless it is done or already queued at about the same urgency
+    void Queue(Entry& entry, float priority) {
+        if (entry.tile->block->started) return;
+        if (entry.token) {
+            if (priority > entry.priority - 0.5f) return;
+            entry.token->store(true);   // superseded by the more urgent job below
+        }
+        else if (priority >= 0) prefetched++;
+        entry.token = makeCancelToken();
+        entry.priority = priority;
+        std::shared_ptr<TerrainTile::Block> block = entry.tile->block;
+        int tx = entry.tile->tx, tz = entry.tile->tz;
+        TerrainTile::GridFunction f = grid;
+        float lo = minHeight, hi = maxHeight;
+        workers.Push(priority, entry.token, [block, tx, tz, f, lo, hi]() { TerrainTile::Generate(tx, tz, f, lo, hi, *block); });
+    }
+ 
+    void Drop(std::map<Key, Entry>::iterator it) {
+        delete it->second.object;
+        delete it->second.tile;
+        tiles.erase(it);
+    }
+ 
+public:
+    float horizon = 3;      // seconds of look ahead
+    float step = 0.25f;     // seconds between predicted camera positions
+    int hits = 0, misses = 0, prefetched = 0, cancelled = 0;
+ 
+    TerrainStreamer(TerrainTile::GridFunction _grid, float _minHeight, float _maxHeight,
+                    Shader * _shader, Material * _material, Texture * _texture) :
+        workers(defaultThreadCount() > 2 ? defaultThreadCount() / 2 : 1), grid(_grid),
+        minHeight(_minHeight), maxHeight(_maxHeight), shader(_shader), material(_material), texture(_texture) {}
+ 
+    // call once per frame before Draw, time in seconds
+    void Update(const Camera& camera, float time) {
+        // velocities of the eye and the look at point, smoothed over about a quarter second
+        if (lastTime >= 0 && time > lastTime) {
+            float dt = time - lastTime, k = fmin(dt / 0.25f, 1);
+            eyeVelocity = eyeVelocity * (1 - k) + (camera.wEye - lastEye) * (k / dt);
+            lookatVelocity = lookatVelocity * (1 - k) + (camera.wLookat - lastLookat) * (k / dt);
+        }
+        lastEye = camera.wEye;
+        lastLookat = camera.wLookat;
+        lastTime = time;
+ 
+        std::set<Key> inView;
+        visible.clear();
+        ForTilesInView(camera, camera.wEye, camera.wLookat, [&](int tx, int tz) {
+            Entry& entry = Request(tx, tz);
+            inView.insert(Key(tx, tz));
+            bool ready = entry.tile->UploadIfReady();
+            if (!entry.seen) {
+                entry.seen = true;
+                if (ready) hits++;
+                else misses++;
+            }
+            if (ready) visible.push_back(entry.object);
+            else Queue(entry, -1);
+        });
+ 
+        // tiles coming into view along the extrapolated path, with the first time they do
+        std::map<Key, float> ahead;
+        for (float t = step; t <= horizon; t += step) {
+            vec3 eye = camera.wEye + eyeVelocity * t, lookat = camera.wLookat + lookatVelocity * t;
+            ForTilesInView(camera, eye, lookat, [&](int tx, int tz) {
+                Key key(tx, tz);
+                if (!inView.count(key) && !ahead.count(key)) ahead[key] = t;
+            });
+        }
+        for (auto& tile : ahead) Queue(Request(tile.first.first, tile.first.second), tile.second);
+ 
+        // the path no longer passes the rest: cancel what is still pending, keep generated tiles close by
+        for (auto it = tiles.begin(); it != tiles.end();) {
+            auto next = std::next(it);
+            Entry& entry = it->second;
+            if (!inView.count(it->first) && !ahead.count(it->first)) {
+                vec3 center(entry.tile->tx * terrainWorldSize, 0, entry.tile->tz * terrainWorldSize);
+                if (!entry.tile->block->ready) {
+                    if (entry.token) entry.token->store(true);
+                    cancelled++;
+                    Drop(it);
+                }
+                else if (length(center - camera.wEye) > camera.bp + terrainWorldSize * 2) Drop(it);
+            }
+            it = next;
+        }
+ 
+        if (time - lastReport >= 5) {
+            lastReport = time;
+            printf("Streaming: %d tiles in view, %d cached, %d queued, %d hits, %d misses, %d prefetched, %d cancelled\n",
+                   (int)inView.size(), (int)tiles.size(), workers.Pending(), hits, misses, prefetched, cancelled);
+        }
+    }
+ 
+    const std::vector<Object *>& Visible() const { return visible; }
+ 
+    void Draw(const RenderState& state) {
+        for (Object * object : visible) object->Draw(state);
+    }
+};
+ 
+//---------------------------
+class ShadowCascades {
+//---------------------------
+// Cascaded shadow map of one directional light. The eye distances [fp, bp] are split into cascades,
+// half logarithmically and half uniformly, and each cascade is an orthographic light view of a sphere
+// around its slice of the view frustum, enlarged by a margin. A cascade keeps its depth layer until the
+// slice leaves the margin, or the light turns or a caster moves past a threshold; such changes re-render
+// cascade c at most every 2^c frames, so the far cascades, which cover the most, are updated the least.
+    struct Cascade {
+        vec3 center;                    // world space center of the sphere the layer covers
+        float radius = 0;               // 0: not rendered yet
+        vec3 lightDir;
+        std::vector<Object *> casters;  // and their modeling transforms when the layer was rendered
+        std::vector<mat4> casterM;
+    };
+    static const int size = 1024;
+    unsigned int fbo;
+    std::vector<Cascade> cascades;
+    long long frame = 0;
+ 
+    bool CastersMoved(const Cascade& cascade, const std::vector<Object *>& casters) {
+        if (cascade.casters != casters) return true;
+        for (unsigned int i = 0; i < casters.size(); i++) {
+            mat4 M, Minv;
+            casters[i]->SetModelingTransform(M, Minv);
+            for (int r = 0; r < 4; r++)
+                for (int k = 0; k < 4; k++)
+                    if (fabs(M[r][k] - cascade.casterM[i][r][k]) > transformTolerance) return true;
+        }
+        return false;
+    }
+ 
+    void Render(int c, vec3 center, float radius, const vec3& lightDir, const std::vector<Object *>& casters) {
+        // light space basis; snapping the center to whole texels keeps the edges of static shadows still
+        vec3 vup = fabs(lightDir.y) > 0.99f ? vec3(0, 0, 1) : vec3(0, 1, 0);
+        vec3 u = normalize(cross(vup, lightDir)), v = cross(lightDir, u);
+        float texel = 2 * radius / size;
+        center = u * (roundf(dot(center, u) / texel) * texel) + v * (roundf(dot(center, v) / texel) * texel) +
+                 lightDir * dot(center, lightDir);
+ 
+        Camera light;
+        light.wEye = center + lightDir * (2 * radius);     // casters up to a radius outside the sphere count
+        light.wLookat = center;
+        light.wVup = vup;
+        float n = 0, f = 3 * radius;
+        mat4 P(1 / radius, 0,          0,                  0,
+               0,          1 / radius, 0,                  0,
+               0,          0,          -2 / (f - n),       0,
+               0,          0,          -(f + n) / (f - n), 1);
+        mat4 VP = light.V() * P;
+ 
+        int viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, state.depthArray, 0, c);
+        glViewport(0, 0, size, size);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(2, 4);
+        Cascade& cascade = cascades[c];
+        cascade.casterM.clear();
+        for (Object * object : casters) {
+            mat4 M, Minv;
+            object->SetModelingTransform(M, Minv);
+            cascade.casterM.push_back(M);
+            GPUProgram * depth = object->shader->DepthProgram();
+            if (!depth) continue;
+            depth->Use();
+            depth->setUniform(M * VP, "MVP");
+            object->geometry->SetUniforms(*depth);
+            object->geometry->Draw();
+        }
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+ 
+        cascade.center = center;
+        cascade.lightDir = lightDir;
+        cascade.casters = casters;
+        state.VP[c] = VP;
+        renders++;
+    }
+ 
+public:
+    ShadowState state;
+    float margin = 0.15f;               // of the radius the slice may drift before its cascade is re-centered
+    float angleThreshold = 0.25f;       // degrees the light may turn before the cascades are re-rendered
+    float transformTolerance = 1e-3f;   // largest change of a modeling matrix element that is ignored
+    int renders = 0;                    // cascade layers rendered so far
+ 
+    ShadowCascades(int nCascades) {
+        state.nCascades = nCascades < 1 ? 1 : nCascades > ShadowState::maxCascades ? ShadowState::maxCascades : nCascades;
+        cascades.resize(state.nCascades);
+        glGenTextures(1, &state.depthArray);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, state.depthArray);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, size, size, state.nCascades, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);     // 2 x 2 filtered comparisons
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, state.depthArray, 0, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("Shadow map is incomplete\n");
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+ 
+    // brings the cascades of the directional light up to date for this frame
+    void Update(const Camera& camera, const vec4& wLightPos, const std::vector<Object *>& casters) {
+        frame++;
+        state.wLightPos = wLightPos;
+        vec3 lightDir = normalize(vec3(wLightPos.x, wLightPos.y, wLightPos.z));
+        vec3 viewDir = normalize(camera.wLookat - camera.wEye);
+        float tanV = tanf(camera.fov / 2), tanH = tanV * camera.asp, spread = sqrtf(tanV * tanV + tanH * tanH);
+        for (int c = 0; c < state.nCascades; c++) {
+            float t = (float)(c + 1) / state.nCascades;
+            state.end[c] = 0.5f * camera.fp * powf(camera.bp / camera.fp, t) + 0.5f * (camera.fp + (camera.bp - camera.fp) * t);
+            float nearEnd = c > 0 ? state.end[c - 1] : camera.fp, farEnd = state.end[c];
+ 
+            // sphere around the slice: centered between its ends, through its farthest corner
+            float mid = (nearEnd + farEnd) / 2;
+            vec3 center = camera.wEye + viewDir * mid;
+            float radius = fmax(length(vec2(mid - nearEnd, nearEnd * spread)), length(vec2(farEnd - mid, farEnd * spread)));
+            radius *= 1 + margin;
+ 
+            Cascade& cascade = cascades[c];
+            bool uncovered = fabs(cascade.radius - radius) > 1e-4f * radius ||
+                             length(center - cascade.center) > radius * margin / (1 + margin);
+            bool due = frame % (1 << c) == 0;
+            bool changed = dot(cascade.lightDir, lightDir) < cosf(angleThreshold * (float)M_PI / 180) ||
+                           CastersMoved(cascade, casters);
+            if (uncovered || (due && changed)) {
+                cascade.radius = radius;
+                Render(c, center, radius, lightDir, casters);
+            }
+        }
+    }
+};
+ 
+//---------------------------
+class PipelineStatistics {
+//---------------------------
+// GL_ARB_pipeline_statistics_query counters around the named passes of a frame: vertices submitted,
+// vertex and fragment shader invocations and the primitives going into and out of clipping. The queries
+// are read a few frames late, once they are available, so counting does not stall the pipeline; the
+// per frame means of every pass are printed every 5 seconds. Many fragment invocations per vertex
+// invocation mean a fragment bound pass, the other way round a vertex bound one.
+    static const int nCounters = 6;
+    struct Pass {
+        std::string name;
+        double sums[nCounters] = {};
+        int count = 0;              // results collected
+    };
+    struct Pending {
+        int pass;
+        unsigned int queries[nCounters];
+    };
+    std::vector<Pass> passes;
+    std::vector<Pending> pending;   // oldest first
+    std::vector<unsigned int> freeQueries[nCounters];  // a query object keeps the target it was first used with
+    int active = -1, frames = 0;
+    double lastReport = -1;
+    bool checked = false;
+    unsigned int current[nCounters];
+ 
+#if defined(GL_VERTICES_SUBMITTED_ARB)
+    static GLenum Target(int counter) {
+        static const GLenum targets[nCounters] = {
+            GL_VERTICES_SUBMITTED_ARB, GL_PRIMITIVES_SUBMITTED_ARB, GL_VERTEX_SHADER_INVOCATIONS_ARB,
+            GL_CLIPPING_INPUT_PRIMITIVES_ARB, GL_CLIPPING_OUTPUT_PRIMITIVES_ARB, GL_FRAGMENT_SHADER_INVOCATIONS_ARB
+        };
+        return targets[counter];
+    }
+#endif
+ 
+    bool Supported() {
+        if (!checked) {
+            checked = true;
+#if defined(GL_VERTICES_SUBMITTED_ARB)
+            int major = 0, minor = 0, extensions = 0;
+            glGetIntegerv(GL_MAJOR_VERSION, &major);
+            glGetIntegerv(GL_MINOR_VERSION, &minor);
+            supported = major > 4 || (major == 4 && minor >= 6);
+            glGetIntegerv(GL_NUM_EXTENSIONS, &extensions);
+            for (int i = 0; i < extensions && !supported; i++)
+                supported = strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_pipeline_statistics_query") == 0;
+#endif
+            if (!supported) printf("Pipeline statistics need GL_ARB_pipeline_statistics_query, they are not collected\n");
+        }
+        return supported;
+    }
+ 
+    // adds the results that are available to their passes
+    void Collect() {
+#if defined(GL_VERTICES_SUBMITTED_ARB)
+        while (!pending.empty()) {
+            Pending& front = pending.front();
+            GLint available = 0;
+            glGetQueryObjectiv(front.queries[nCounters - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) return;
+            Pass& pass = passes[front.pass];
+            for (int k = 0; k < nCounters; k++) {
+                GLuint64 value = 0;
+                glGetQueryObjectui64v(front.queries[k], GL_QUERY_RESULT, &value);
+                pass.sums[k] += (double)value;
+                freeQueries[k].push_back(front.queries[k]);
+            }
+            pass.count++;
+            pending.erase(pending.begin());
+        }
+#endif
+    }
+ 
+public:
+    bool enabled = false;
+    bool supported = false;
+ 
+    // starts counting for the pass of this name; passes do not nest
+    void Begin(const char * name) {
+        if (!enabled || !Supported() || active >= 0) return;
+#if defined(GL_VERTICES_SUBMITTED_ARB)
+        active = 0;
+        while (active < (int)passes.size() && passes[active].name != name) active++;
+        if (active == (int)passes.size()) {
+            passes.push_back(Pass());
+            passes.back().name = name;
+        }
+        for (int k = 0; k < nCounters; k++) {
+            if (freeQueries[k].empty()) glGenQueries(1, &current[k]);
+            else {
+                current[k] = freeQueries[k].back();
+                freeQueries[k].pop_back();
+            }
+            glBeginQuery(Target(k), current[k]);
+        }
+#endif
+    }
+ 
+    void End() {
+        if (active < 0) return;
+#if defined(GL_VERTICES_SUBMITTED_ARB)
+        Pending entry;
+        entry.pass = active;
+        for (int k = 0; k < nCounters; k++) {
+            glEndQuery(Target(k));
+            entry.queries[k] = current[k];
+        }
+        pending.push_back(entry);
+#endif
+        active = -1;
+    }
+ 
+    // once per frame, after its passes
+    void EndFrame(float time) {
+        if (!enabled || !supported) return;
+        frames++;
+        Collect();
+        if (lastReport < 0) lastReport = time;
+        if (time - lastReport < 5) return;
+        lastReport = time;
+        printf("Pipeline statistics per frame over %d frames:\n", frames);
+        for (Pass& pass : passes) {
+            if (pass.count == 0) continue;
+            double perFrame = 1.0 / frames, vs = pass.sums[2];
+            printf("  %-9s %5.2f passes, %.0f vertices, %.0f primitives, %.0f VS, clipping %.0f -> %.0f, %.0f FS (%.1f per VS)\n",
+                   pass.name.c_str(), pass.count * perFrame, pass.sums[0] * perFrame, pass.sums[1] * perFrame, vs * perFrame,
+                   pass.sums[3] * perFrame, pass.sums[4] * perFrame, pass.sums[5] * perFrame, vs > 0 ? pass.sums[5] / vs : 0);
+            for (double& sum : pass.sums) sum = 0;
+            pass.count = 0;
+        }
+        frames = 0;
+    }
+};
+ 
+PipelineStatistics pipelineStats;
+ 
+//---------------------------
+class FrameGraph {
+//---------------------------
+// The passes of a frame and the targets they render to and sample from, declared anew every frame. Each
+// pass names the resources it reads and writes; Execute culls the passes whose results nothing reads,
+// gives every transient target a pooled texture for the span from its first use to its last, and runs
+// the remaining passes in order. Transients of the same description whose spans do not overlap share a
+// texture, so a frame holds only as many as are alive at once, and textures no frame asked for in a while
+// are deleted: GPU memory follows the targets alive together, not the number of passes. The first write
+// of a resource with a clear value clears it.
+// Imported resources, the window and textures kept across frames, are not pooled; passes that write an
+// output or are marked with side effects are always kept.
+public:
+    typedef int Resource;
+    enum Access {
+        Sampled,        // through a sampler
+        Attachment,     // render target, bound by the graph before the pass runs
+        Direct          // bound by the pass itself: single layers, blits, read backs
+    };
+    struct TextureDesc {
+        GLenum target = GL_TEXTURE_2D;  // or GL_TEXTURE_2D_ARRAY
+        GLenum format = GL_RGBA8;       // sized color or depth format, normalized or float
+        int width = 0, height = 0, layers = 1;
+        GLenum filter = GL_NEAREST;
+        bool operator==(const TextureDesc& d) const {
+            return target == d.target && format == d.format && width == d.width && height == d.height &&
+                   layers == d.layers && filter == d.filter;
+        }
+    };
+ 
+    class PassBuilder {
+        FrameGraph& graph;
+        int pass;
+    public:
+        PassBuilder(FrameGraph& _graph, int _pass) : graph(_graph), pass(_pass) {}
+        PassBuilder& Read(Resource r, Access access = Sampled) {
+            graph.passes[pass].reads.push_back({ r, access });
+            return *this;
+        }
+        PassBuilder& Write(Resource r, Access access = Attachment) {
+            graph.passes[pass].writes.push_back({ r, access });
+            return *this;
+        }
+        PassBuilder& SideEffect() {     // kept even if nothing reads what it writes
+            graph.passes[pass].sideEffect = true;
+            return *this;
+        }
+    };
+ 
+private:
+    static const int maxColors = 4, keepFrames = 60;   // keepFrames: idle frames before a pooled texture is deleted
+    struct Node {
+        const char * name;
+        TextureDesc desc;
+        unsigned int texture;           // imported: 0 is the window; transient: valid during its span
+        bool imported, output, clears, cleared, needed;
+        vec4 clearColor;
+        int firstWriter, first, last;   // declared pass, span over the kept passes
+        int pooled;                     // entry of the texture in pool, -1 outside the span
+    };
+    struct Use {
+        Resource resource;
+        Access access;
+    };
+    struct Pass {
+        const char * name;
+        std::vector<Use> reads, writes;
+        std::function<void()> run;
+        bool sideEffect, kept;
+    };
+    struct Pooled {
+        TextureDesc desc;
+        unsigned int texture;
+        bool busy;
+        long long lastFrame;
+    };
+    struct FramebufferKey {
+        unsigned int color[maxColors], depth;
+        int layer;                      // -1: every layer
+        bool operator<(const FramebufferKey& k) const { return memcmp(this, &k, sizeof(k)) < 0; }
+    };
+ 
+    std::vector<Node> nodes;
+    std::vector<Pass> passes;           // the first nPasses are this frame's, the rest keep their capacity
+    int nPasses = 0, current = -1;
+    std::vector<Pooled> pool;
+    std::map<FramebufferKey, unsigned int> framebuffers;
+    long long frame = 0;
+ 
+    static bool IsDepth(GLenum format) {
+        return format == GL_DEPTH_COMPONENT16 || format == GL_DEPTH_COMPONENT24 || format == GL_DEPTH_COMPONENT32F;
+    }
+    static int TexelBytes(GLenum format) {
+        switch (format) {
+        case GL_R8: return 1;
+        case GL_R16F: case GL_RG8: case GL_DEPTH_COMPONENT16: return 2;
+        case GL_RG16F: case GL_RGBA8: case GL_R32F: case GL_DEPTH_COMPONENT24: case GL_DEPTH_COMPONENT32F: return 4;
+        case GL_RG32F: case GL_RGBA16F: return 8;
+        case GL_RGBA32F: return 16;
+        default: return 4;
+        }
+    }
+    static double Bytes(const TextureDesc& desc) { return (double)desc.width * desc.height * desc.layers * TexelBytes(desc.format); }
+ 
+    unsigned int CreateTexture(const TextureDesc& desc) {
+        GLenum external = IsDepth(desc.format) ? GL_DEPTH_COMPONENT
+                        : desc.format == GL_R8 || desc.format == GL_R16F || desc.format == GL_R32F ? GL_RED
+                        : desc.format == GL_RG8 || desc.format == GL_RG16F || desc.format == GL_RG32F ? GL_RG : GL_RGBA;
+        unsigned int texture;
+        glGenTextures(1, &texture);
+        glBindTexture(desc.target, texture);
+        if (desc.target == GL_TEXTURE_2D_ARRAY)
+            glTexImage3D(desc.target, 0, desc.format, desc.width, desc.height, desc.layers, 0, external, GL_FLOAT, nullptr);
+        else glTexImage2D(desc.target, 0, desc.format, desc.width, desc.height, 0, external, GL_FLOAT, nullptr);
+        glTexParameteri(desc.target, GL_TEXTURE_MIN_FILTER, desc.filter);
+        glTexParameteri(desc.target, GL_TEXTURE_MAG_FILTER, desc.filter);
+        glTexParameteri(desc.target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(desc.target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(desc.target, 0);
+        return texture;
+    }
+ 
+    // a free pooled texture of the same description, or a new one
+    void Acquire(Node& node, int& created) {
+        int found = -1;
+        for (int i = 0; i < (int)pool.size() && found < 0; i++)
+            if (!pool[i].busy && pool[i].desc == node.desc) found = i;
+        if (found < 0) {
+            pool.push_back({ node.desc, CreateTexture(node.desc), false, 0 });
+            found = (int)pool.size() - 1;
+            created++;
+        }
+        pool[found].busy = true;
+        pool[found].lastFrame = frame;
+        node.pooled = found;
+        node.texture = pool[found].texture;
+    }
+ 
+    unsigned int Framebuffer(const FramebufferKey& key) {
+        auto found = framebuffers.find(key);
+        if (found != framebuffers.end()) return found->second;
+        auto attach = [&](GLenum point, unsigned int texture) {
+            if (key.layer < 0) glFramebufferTexture(GL_FRAMEBUFFER, point, texture, 0);
+            else glFramebufferTextureLayer(GL_FRAMEBUFFER, point, texture, 0, key.layer);
+        };
+        int draw, read;         // left bound as they were
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &draw);
+        glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read);
+        unsigned int fbo;
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        GLenum buffers[maxColors];
+        int n = 0;
+        for (; n < maxColors && key.color[n]; n++) {
+            attach(GL_COLOR_ATTACHMENT0 + n, key.color[n]);
+            buffers[n] = GL_COLOR_ATTACHMENT0 + n;
+        }
+        if (key.depth) attach(GL_DEPTH_ATTACHMENT, key.depth);
+        if (n > 0) glDrawBuffers(n, buffers);
+        else glDrawBuffer(GL_NONE);
+        glReadBuffer(n > 0 ? GL_COLOR_ATTACHMENT0 : GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("Frame graph target is incomplete\n");
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, read);
+        framebuffers[key] = fbo;
+        return fbo;
+    }
+ 
+    // the render targets of the pass, at one layer or all; false if it draws into the window
+    bool TargetKey(const Pass& pass, int layer, FramebufferKey& key) const {
+        memset(&key, 0, sizeof(key));
+        key.layer = layer;
+        int n = 0;
+        for (const Use& use : pass.writes) {
+            if (use.access != Attachment) continue;
+            const Node& node = nodes[use.resource];
+            if (node.imported && node.texture == 0) return false;
+            if (IsDepth(node.desc.format)) key.depth = node.texture;
+            else if (n < maxColors) key.color[n++] = node.texture;
+        }
+        return true;
+    }
+ 
+    void Clear(Node& node, int colorIndex) {
+        node.cleared = true;
+        if (node.imported && node.texture == 0) {
+            glClearColor(node.clearColor.x, node.clearColor.y, node.clearColor.z, node.clearColor.w);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        }
+        else if (IsDepth(node.desc.format)) {
+            float depth = 1;
+            glClearBufferfv(GL_DEPTH, 0, &depth);
+        }
+        else glClearBufferfv(GL_COLOR, colorIndex, &node.clearColor.x);
+    }
+ 
+    // binds the render targets of the pass, sets the viewport to them and clears what is written first
+    void BindTargets(const Pass& pass) {
+        for (const Use& use : pass.writes) {       // direct writes are cleared through a target of their own
+            Node& node = nodes[use.resource];
+            if (use.access != Direct || !node.clears || node.cleared) continue;
+            glBindFramebuffer(GL_FRAMEBUFFER, node.imported && node.texture == 0 ? 0
+                              : IsDepth(node.desc.format) ? Target(-1, use.resource) : Target(use.resource));
+            glViewport(0, 0, node.desc.width, node.desc.height);
+            Clear(node, 0);
+        }
+        FramebufferKey key;
+        const Node * size = nullptr;
+        for (const Use& use : pass.writes)
+            if (use.access == Attachment && !size) size = &nodes[use.resource];
+        if (!size) return;
+        glBindFramebuffer(GL_FRAMEBUFFER, TargetKey(pass, -1, key) ? Framebuffer(key) : 0);
+        glViewport(0, 0, size->desc.width, size->desc.height);
+        int colorIndex = 0;
+        for (const Use& use : pass.writes) {
+            if (use.access != Attachment) continue;
+            Node& node = nodes[use.resource];
+            if (node.clears && !node.cleared) Clear(node, colorIndex);
+            if (!IsDepth(node.desc.format)) colorIndex++;
+        }
+    }
+ 
+public:
+    int created = 0;                    // pooled textures created so far
+ 
+    // starts the declarations of a frame
+    void Reset() {
+        nodes.clear();
+        nPasses = 0;
+    }
+ 
+    // a target that lives within the frame; it is cleared to clearColor (depth to 1) by its first write
+    Resource Create(const char * name, const TextureDesc& desc, vec4 clearColor = vec4(0, 0, 0, 0)) {
+        Resource r = Import(name, 0, desc);
+        nodes[r].imported = false;
+        nodes[r].clears = true;
+        nodes[r].clearColor = clearColor;
+        return r;
+    }
+ 
+    // a texture owned elsewhere, texture 0 is the window with its depth buffer
+    Resource Import(const char * name, unsigned int texture, const TextureDesc& desc) {
+        nodes.push_back({ name, desc, texture, true, false, false, false, false, vec4(0, 0, 0, 0), -1, -1, -1, -1 });
+        return (Resource)nodes.size() - 1;
+    }
+ 
+    void Clear(Resource r, vec4 clearColor) {     // at the first write of an imported resource
+        nodes[r].clears = true;
+        nodes[r].clearColor = clearColor;
+    }
+    void Output(Resource r) { nodes[r].output = true; }    // the passes writing it are kept
+ 
+    // run is called from Execute, with the render targets of the pass bound, if the pass is kept
+    PassBuilder AddPass(const char * name, const std::function<void()>& run) {
+        if (nPasses == (int)passes.size()) passes.push_back(Pass());
+        Pass& pass = passes[nPasses];
+        pass.name = name;
+        pass.reads.clear();
+        pass.writes.clear();
+        pass.run = run;
+        pass.sideEffect = false;
+        return PassBuilder(*this, nPasses++);
+    }
+ 
+    // during the passes that use the resource
+    const TextureDesc& Desc(Resource r) const { return nodes[r].desc; }
+    unsigned int Texture(Resource r) const { return nodes[r].texture; }
+    unsigned int Target(Resource color, Resource depth = -1, int layer = -1) {
+        if (color >= 0 && nodes[color].imported && nodes[color].texture == 0) return 0;
+        FramebufferKey key;
+        memset(&key, 0, sizeof(key));
+        key.color[0] = color >= 0 ? nodes[color].texture : 0;
+        key.depth = depth >= 0 ? nodes[depth].texture : 0;
+        key.layer = layer;
+        return Framebuffer(key);
+    }
+ 
+    // within a pass: its render targets again, at a single layer of the arrays
+    void BindLayer(int layer) {
+        FramebufferKey key;
+        if (TargetKey(passes[current], layer, key)) glBindFramebuffer(GL_FRAMEBUFFER, Framebuffer(key));
+    }
+ 
+    void Execute() {
+        frame++;
+        for (Node& node : nodes) node.firstWriter = -1;
+        for (int p = 0; p < nPasses; p++)
+            for (const Use& use : passes[p].writes)
+                if (nodes[use.resource].firstWriter < 0) nodes[use.resource].firstWriter = p;
+ 
+        // from the last pass back: a pass is kept if a kept pass after it reads what it writes; a write
+        // after the first keeps what is already there, so it reads too
+        for (Node& node : nodes) node.needed = false;
+        for (int p = nPasses - 1; p >= 0; p--) {
+            Pass& pass = passes[p];
+            pass.kept = pass.sideEffect;
+            for (const Use& use : pass.writes) pass.kept = pass.kept || nodes[use.resource].output || nodes[use.resource].needed;
+            if (!pass.kept) continue;
+            for (const Use& use : pass.reads) nodes[use.resource].needed = true;
+            for (const Use& use : pass.writes)
+                if (nodes[use.resource].firstWriter != p) nodes[use.resource].needed = true;
+        }
+        for (int p = 0; p < nPasses; p++) {
+            if (!passes[p].kept) continue;
+            for (const std::vector<Use> * uses : { &passes[p].reads, &passes[p].writes }) {
+                for (const Use& use : *uses) {
+                    Node& node = nodes[use.resource];
+                    if (node.first < 0) node.first = p;
+                    node.last = p;
+                }
+            }
+        }
+ 
+        int culled = 0, newTextures = 0, transients = 0;
+        for (const Node& node : nodes) transients += !node.imported && node.first >= 0;
+        for (int p = 0; p < nPasses; p++) {
+            Pass& pass = passes[p];
+            if (!pass.kept) {
+                culled++;
+                continue;
+            }
+            for (const std::vector<Use> * uses : { &pass.reads, &pass.writes }) {
+                for (const Use& use : *uses) {
+                    Node& node = nodes[use.resource];
+                    if (!node.imported && node.first == p && node.pooled < 0) Acquire(node, newTextures);
+                }
+            }
+            BindTargets(pass);
+            current = p;
+            pass.run();
+            current = -1;
+            for (const std::vector<Use> * uses : { &pass.reads, &pass.writes }) {     // spans ending here
+                for (const Use& use : *uses) {
+                    Node& node = nodes[use.resource];
+                    if (node.imported || node.last != p || node.pooled < 0) continue;
+                    pool[node.pooled].busy = false;
+                    node.pooled = -1;
+                }
+            }
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, windowWidth, windowHeight);
+ 
+        int deleted = 0;
+        for (size_t i = 0; i < pool.size();) {
+            if (frame - pool[i].lastFrame <= keepFrames) {
+                i++;
+                continue;
+            }
+            for (auto it = framebuffers.begin(); it != framebuffers.end();) {
+                const FramebufferKey& key = it->first;
+                bool uses = key.depth == pool[i].texture;
+                for (int c = 0; c < maxColors; c++) uses = uses || key.color[c] == pool[i].texture;
+                if (!uses) {
+                    ++it;
+                    continue;
+                }
+                glDeleteFramebuffers(1, &it->second);
+                it = framebuffers.erase(it);
+            }
+            glDeleteTextures(1, &pool[i].texture);
+            pool[i] = pool.back();
+            pool.pop_back();
+            deleted++;
+        }
+        created += newTextures;
+        if (newTextures > 0 || deleted > 0) {
+            double bytes = 0;
+            for (const Pooled& pooled : pool) bytes += Bytes(pooled.desc);
+            printf("Frame graph: %d passes, %d culled, %d transient targets in %d pooled textures of %.1f MB\n",
+                   nPasses, culled, transients, (int)pool.size(), bytes / (1 << 20));
+        }
+    }
+};
+ 
+//---------------------------
+class OverdrawView : public GPUProgram {
 //---------------------------
-    Shader *   shader;
-    Material * material;
-    Texture *  texture;
-    Geometry * geometry;
-    vec3 scale, translation, rotationAxis;
-    float rotationAngle;
+// Replaces the shaded image with the number of fragments rasterized at every pixel: each object is drawn
+// with the vertex stage of its shader (Shader::DepthProgram) into a float target with additive blending
+// and no depth test, so hidden layers count too, then the counts are shown as a heat map from blue (1)
+// through green and yellow to red (8 or more). Every 5 seconds the counts are read back for a histogram.
+    const char * vertexSource = R"(
+        #version 330
+        precision highp float;
+        out vec2 texcoord;
+        void main() {
+            vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+            texcoord = corner;
+            gl_Position = vec4(corner * 2 - 1, 0, 1);
+        }
+    )";
+ 
+    const char * fragmentSource = R"(
+        #version 330
+        precision highp float;
+        uniform sampler2D counts;
+        in vec2 texcoord;
+        out vec4 fragmentColor;
+        void main() {
+            float n = texture(counts, texcoord).r;
+            if (n < 0.5) { fragmentColor = vec4(0, 0, 0, 1); return; }
+            float t = clamp((n - 1) / 7, 0, 1);     // 1 .. 8 layers
+            vec3 ramp = t < 0.33 ? mix(vec3(0, 0, 1), vec3(0, 1, 0), t / 0.33)
+                      : t < 0.67 ? mix(vec3(0, 1, 0), vec3(1, 1, 0), (t - 0.33) / 0.34)
+                      : mix(vec3(1, 1, 0), vec3(1, 0, 0), (t - 0.67) / 0.33);
+            fragmentColor = vec4(ramp, 1);
+        }
+    )";
+ 
+    unsigned int vao;
+    double lastReport = -1;
+ 
+    // covered pixels per number of layers: 1, 2, 3, 4, 5-8, 9-16, 17 or more
+    void Histogram(unsigned int fbo, int width, int height) {
+        std::vector<float> counts(width * height);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        glReadPixels(0, 0, width, height, GL_RED, GL_FLOAT, counts.data());
+        const int limits[] = { 1, 2, 3, 4, 8, 16, INT_MAX };
+        const char * labels[] = { "1", "2", "3", "4", "5-8", "9-16", "17+" };
+        int bins[7] = {}, covered = 0, maxLayers = 0;
+        double total = 0;
+        for (float count : counts) {
+            int n = (int)(count + 0.5f);
+            if (n == 0) continue;
+            covered++;
+            total += n;
+            maxLayers = std::max(maxLayers, n);
+            int b = 0;
+            while (n > limits[b]) b++;
+            bins[b]++;
+        }
+        printf("Overdraw: %.1f%% of the pixels covered, %.2f fragments per covered pixel, at most %d\n",
+               100.0 * covered / (width * height), covered ? total / covered : 0, maxLayers);
+        printf("  layers");
+        for (int b = 0; b < 7; b++) printf(" %s: %.1f%%", labels[b], covered ? 100.0 * bins[b] / covered : 0);
+        printf("\n");
+    }
+ 
 public:
-    Object(Shader * _shader, Material * _material, Texture * _texture, Geometry * _geometry) :
-        scale(vec3(1, 1, 1)), translation(vec3(0, 0, 0)), rotationAxis(0, 0, 1), rotationAngle(0) {
-        shader = _shader;
-        texture = _texture;
-        material = _material;
-        geometry = _geometry;
+    OverdrawView() {
+        create(vertexSource, fragmentSource, "fragmentColor");
+        glGenVertexArrays(1, &vao);     // the full screen quad comes from gl_VertexID
     }
  
-    virtual void SetModelingTransform(mat4& M, mat4& Minv) {
-        M = ScaleMatrix(scale) * RotationMatrix(rotationAngle, rotationAxis) * TranslateMatrix(translation);
-        Minv = TranslateMatrix(-translation) * RotationMatrix(-rotationAngle, rotationAxis) * ScaleMatrix(vec3(1 / scale.x, 1 / scale.y, 1 / scale.z));
+    // the counts into a transient target, then the heat map of them into target
+    void AddPasses(FrameGraph& graph, FrameGraph::Resource target, const std::vector<Object *>& objects,
+                   const RenderState& state, float time) {
+        FrameGraph::TextureDesc desc;
+        desc.format = GL_R32F;
+        desc.width = graph.Desc(target).width;
+        desc.height = graph.Desc(target).height;
+        FrameGraph::Resource counts = graph.Create("overdraw counts", desc);
+        graph.AddPass("overdraw", [this, &graph, &objects, state, time, counts]() {
+            pipelineStats.Begin("overdraw");
+            glDisable(GL_DEPTH_TEST);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE, GL_ONE);
+            mat4 VP = state.V * state.P;
+            for (Object * object : objects) {
+                GPUProgram * program = object->shader->DepthProgram();
+                if (!program) continue;
+                mat4 M, Minv;
+                object->SetModelingTransform(M, Minv);
+                program->Use();
+                program->setUniform(M * VP, "MVP");
+                object->geometry->SetUniforms(*program);
+                object->geometry->Draw();
+            }
+            glDisable(GL_BLEND);
+            glEnable(GL_DEPTH_TEST);
+            pipelineStats.End();
+            if (lastReport < 0) lastReport = time;
+            if (time - lastReport >= 5) {
+                lastReport = time;
+                Histogram(graph.Target(counts), graph.Desc(counts).width, graph.Desc(counts).height);
+            }
+        }).Write(counts);
+        graph.AddPass("heat map", [this, &graph, counts]() {
+            glDisable(GL_DEPTH_TEST);
+            Use();
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, graph.Texture(counts));
+            setUniform(0, "counts");
+            glBindVertexArray(vao);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            glEnable(GL_DEPTH_TEST);
+        }).Read(counts).Write(target);
     }
+};
  
-    void Draw(RenderState state) {
-        mat4 M, Minv;
-        SetModelingTransform(M, Minv);
-        state.M = M;
-        state.Minv = Minv;
-        state.MVP = state.M * state.V * state.P;
-        state.material = material;
-        state.texture = texture;
-        shader->Bind(state);
-        geometry->Draw();
+//---------------------------
+class MultiView {
+//---------------------------
+// Renders the scene from up to maxViews cameras into the layers of a texture array. In a single pass
+// every object is bound and drawn once, with the multi-view program of its shader and the matrices of all
+// the views in one uniform buffer written per frame; separately, the layers are rendered one camera at a
+// time with a traversal each, as Scene::Render would be called per camera. Both give the same images.
+// The layers are shown as thumbnails along the bottom of the window. The arrays are transient targets
+// of the frame graph.
+    int nViews, size;
+    unsigned int viewsBuffer;
+    struct ViewsBlock {                     // std140 layout of the Views block
+        float VP[maxViews][16];
+        float eye[maxViews][4];
+        int nViews, padding[3];
+    };
+    double cpuSeconds = 0;
+    int frames = 0, draws = 0;          // draws: object binds and draw calls
+    float lastReport = 0;
+ 
+public:
+    bool separate = false;              // a traversal per view instead of the single pass
+ 
+    MultiView(int views, int _size = 256) {
+        nViews = views < 1 ? 1 : views > maxViews ? maxViews : views;
+        size = _size;
+        glGenBuffers(1, &viewsBuffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, viewsBuffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(ViewsBlock), nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
     }
  
-    virtual void Animate(float tstart, float tend) { rotationAngle = 0.8f * tend;
-        
+    int Views() const { return nViews; }
+ 
+    // the pass rendering the first Views() cameras, which should have an aspect ratio of 1; returns the
+    // array of their images, cleared to clearColor
+    FrameGraph::Resource AddPass(FrameGraph& graph, std::vector<Camera>& cameras, const std::vector<Object *>& objects,
+                                 RenderState state, float time, vec4 clearColor) {
+        FrameGraph::TextureDesc desc;
+        desc.target = GL_TEXTURE_2D_ARRAY;
+        desc.width = desc.height = size;
+        desc.layers = nViews;
+        desc.filter = GL_LINEAR;
+        FrameGraph::Resource colors = graph.Create("view colors", desc, clearColor);
+        desc.format = GL_DEPTH_COMPONENT24;
+        desc.filter = GL_NEAREST;
+        FrameGraph::Resource depths = graph.Create("view depths", desc);
+        state.shadows = nullptr;        // the cascades fit the main camera
+        graph.AddPass("views", [this, &graph, &cameras, &objects, state, time]() mutable {
+            pipelineStats.Begin("views");
+            auto start = std::chrono::steady_clock::now();
+            if (!separate) {            // the graph has bound every layer
+                ViewsBlock block = {};
+                for (int v = 0; v < nViews; v++) {
+                    mat4 VP = cameras[v].V() * cameras[v].P();
+                    memcpy(block.VP[v], (float *)VP, sizeof(block.VP[v]));
+                    block.eye[v][0] = cameras[v].wEye.x;
+                    block.eye[v][1] = cameras[v].wEye.y;
+                    block.eye[v][2] = cameras[v].wEye.z;
+                    block.eye[v][3] = 1;
+                }
+                block.nViews = nViews;
+                glBindBuffer(GL_UNIFORM_BUFFER, viewsBuffer);
+                glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+                glBindBuffer(GL_UNIFORM_BUFFER, 0);
+                glBindBufferBase(GL_UNIFORM_BUFFER, viewsBinding, viewsBuffer);
+ 
+                state.V = state.P = TranslateMatrix(vec3(0, 0, 0));
+                state.wEye = cameras[0].wEye;
+                state.multiView = true;
+                for (Object * object : objects) object->Draw(state);
+                draws += (int)objects.size();
+            }
+            else {
+                for (int v = 0; v < nViews; v++) {
+                    graph.BindLayer(v);
+                    state.V = cameras[v].V();
+                    state.P = cameras[v].P();
+                    state.wEye = cameras[v].wEye;
+                    for (Object * object : objects) object->Draw(state);
+                    draws += (int)objects.size();
+                }
+            }
+ 
+            cpuSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            pipelineStats.End();
+            frames++;
+            if (time - lastReport >= 5) {
+                lastReport = time;
+                printf("Views: %d %s, %.3f ms CPU and %d object draws per frame\n", nViews,
+                       separate ? "rendered separately" : "in one pass", cpuSeconds * 1000 / frames, draws / frames);
+                cpuSeconds = 0;
+                frames = draws = 0;
+            }
+        }).Write(colors).Write(depths);
+        return colors;
+    }
+ 
+    // the layers of colors side by side along the bottom of target, thumb pixels wide
+    void AddShow(FrameGraph& graph, FrameGraph::Resource colors, FrameGraph::Resource target, int thumb) {
+        graph.AddPass("thumbnails", [this, &graph, colors, target, thumb]() {
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, graph.Target(target));
+            for (int v = 0; v < nViews; v++) {
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, graph.Target(colors, -1, v));
+                glBlitFramebuffer(0, 0, size, size, v * thumb, 0, (v + 1) * thumb, thumb, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+            }
+        }).Read(colors, FrameGraph::Direct).Write(target, FrameGraph::Direct);
     }
 };
  
@@ -444,6 +2874,143 @@ class Scene {
     std::vector<Object *> objects;
     Camera camera; // 3D camera
     std::vector<Light> lights;
+    ImpostorAtlas * impostors = nullptr;
+    TerrainStreamer * streamer = nullptr;
+    ShadowCascades * shadows = nullptr;
+    OverdrawView * overdraw = nullptr;
+    MultiView * views = nullptr;
+    FrameGraph graph;           // the passes of the frame, declared again every frame
+    GeometryCache geometries;
+    std::vector<Camera> viewCameras;    // of views: around the point the camera looks at
+    AnimationTracks tracks;     // keyframed object and material parameters, evaluated once per frame
+    LightProbe probe;
+    std::vector<Light> exactLights, probedLights;    // probedLights: the lights probe was built from
+    float heading = 0, turnRate = 0;    // flight over the streamed terrain, radians and radians per second
+    float lastClusterReport = 0;
+ 
+    void Fly() {
+        vec3 forward(sinf(heading), 0, cosf(heading));
+        camera.wLookat = camera.wEye + forward * 10 - vec3(0, camera.wEye.y, 0);
+    }
+ 
+    // streamed terrain over the spectrum or noise the command line selected; the height range for the
+    // colors comes from a 2 x 2 block of tiles, which is a whole period of the Fourier terrain
+    void BuildStreamer(Shader * shader, Material * material, Texture * texture) {
+        TerrainTile::GridFunction grid;
+        if (noiseTerrain) {
+            NoiseOptions noise;
+            unsigned int seed = terrainSeed;
+            grid = [noise, seed](double u0, double v0, int res, double * h, double * dx, double * dy) {
+                std::vector<float> x(res * res), y(res * res), fh(res * res), fdx(res * res), fdy(res * res);
+                for (int i = 0; i < res * res; i++) {
+                    x[i] = u0 + (res > 1 ? (float)(i % res) / (res - 1) : 0);
+                    y[i] = v0 + (res > 1 ? (float)(i / res) / (res - 1) : 0);
+                }
+                gradientNoise(seed, noise, res * res, x.data(), y.data(), fh.data(), fdx.data(), fdy.data());
+                for (int i = 0; i < res * res; i++) {
+                    h[i] = fh[i];
+                    dx[i] = fdx[i] / M_PI;
+                    dy[i] = fdy[i] / M_PI;
+                }
+            };
+        }
+        else withTerrainSpectrum(terrainStyle, [&](auto spectrum) {
+            grid = [](double u0, double v0, int res, double * h, double * dx, double * dy) {
+                terrainSampleGrid<decltype(spectrum)>(TablePhases(coeffs, terrainHarmonics), A, terrainHarmonics,
+                                                      res, h, dx, dy, u0, v0);
+            };
+        });
+        const int res = 33;
+        std::vector<double> h(res * res), dx(res * res), dy(res * res);
+        float minHeight = 0, maxHeight = 0;
+        for (int tile = 0; tile < 4; tile++) {
+            grid(tile % 2, tile / 2, res, h.data(), dx.data(), dy.data());
+            for (int i = 0; i < res * res; i++) {
+                if (tile == 0 && i == 0) minHeight = maxHeight = h[0];
+                minHeight = fmin(minHeight, h[i]);
+                maxHeight = fmax(maxHeight, h[i]);
+            }
+        }
+        streamer = new TerrainStreamer(grid, minHeight, maxHeight, shader, material, texture);
+    }
+ 
+    // trees on the gentle slopes of the middle heights and rocks on the steep ones, one instanced object of
+    // each kind with the modeling transform of the terrain
+    std::vector<Object *> Scatter(const Object& terrain, const HeightGridFunction& heightGrid) {
+        std::vector<float> range(65 * 65);      // for rules on normalized heights
+        heightGrid(0, 0, 1.0 / 64, 65, 65, range.data());
+        float minHeight = *std::min_element(range.begin(), range.end()), maxHeight = *std::max_element(range.begin(), range.end());
+        struct Kind {
+            const char * name;
+            float radius, minScale, maxScale;
+            ScatterRule rule;
+            vec3 kd;
+            std::vector<vec3> mesh;
+        };
+        Kind kinds[2] = { { "trees", 0.012f, 0.25f, 0.45f, ScatterRule(), vec3(0.1f, 0.35f, 0.1f), InstancedMesh::Cone() },
+                          { "rocks", 0.02f, 0.06f, 0.14f, ScatterRule(), vec3(0.35f, 0.33f, 0.3f), InstancedMesh::Rock(terrainSeed) } };
+        kinds[0].rule.minHeight = 0.2f;
+        kinds[0].rule.maxHeight = 0.8f;
+        kinds[0].rule.maxSlope = 1;
+        kinds[1].rule.minSlope = 1;
+ 
+        Shader * shader = new InstanceShader();
+        std::vector<Object *> result;
+        for (int k = 0; k < 2; k++) {
+            const Kind& kind = kinds[k];
+            ScatterOptions options;
+            options.radius = kind.radius;
+            options.seed = scatterHash(terrainSeed, k, 0);
+            auto start = std::chrono::steady_clock::now();
+            std::vector<ScatterPoint> points = scatterOnTerrain(options, kind.rule, heightGrid, minHeight, maxHeight);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::vector<InstancedMesh::Instance> instances(points.size());
+            for (size_t i = 0; i < points.size(); i++) {
+                const ScatterPoint& point = points[i];
+                instances[i].translation = vec3(point.u * terrainWorldSize - terrainWorldSize / 2, point.h,
+                                                point.v * terrainWorldSize - terrainWorldSize / 2);
+                instances[i].scale = kind.minScale + (kind.maxScale - kind.minScale) * (point.random & 0xFFFF) / 65535.0f;
+                instances[i].angle = (point.random >> 16) * (2 * (float)M_PI / 65536);
+            }
+            printf("Scattered %d %s in %.1f ms\n", (int)instances.size(), kind.name, seconds * 1000);
+            InstancedMesh * mesh = new InstancedMesh(kind.mesh);
+            mesh->SetInstances(instances);
+            Material * material = new Material;
+            material->kd = kind.kd;
+            material->ks = vec3(0.05f, 0.05f, 0.05f);
+            material->shininess = 1;
+            Object * object = new Object(shader, material, nullptr, mesh);
+            object->translation = terrain.translation;
+            object->scale = terrain.scale;
+            object->rotationAxis = terrain.rotationAxis;
+            result.push_back(object);
+        }
+        return result;
+    }
+ 
+    static float Luminance(const vec3& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+ 
+    // splits the lights into the probeExactLights brightest ones plus the point lights, evaluated per
+    // fragment (at most 8), and the directional rest, projected into probe with the sum of La as the sky;
+    // nothing is done while the lights stay the same
+    void ProjectLights() {
+        if (probedLights.size() == lights.size() && !probedLights.empty() &&
+            memcmp(probedLights.data(), lights.data(), lights.size() * sizeof(Light)) == 0) return;
+        probedLights = lights;
+        std::vector<Light> sorted = lights;
+        std::stable_sort(sorted.begin(), sorted.end(), [](const Light& a, const Light& b) { return Luminance(a.Le) > Luminance(b.Le); });
+        exactLights.clear();
+        probe.Clear();
+        vec3 sky;
+        for (const Light& light : sorted) {
+            sky = sky + light.La;
+            bool point = light.wLightPos.w != 0;
+            if (exactLights.size() < 8 && (point || (int)exactLights.size() < probeExactLights)) exactLights.push_back(light);
+            else if (!point) probe.AddDirectional(vec3(light.wLightPos.x, light.wLightPos.y, light.wLightPos.z), light.Le);
+        }
+        probe.AddAmbient(sky, vec3(0, 0, 0));
+    }
+ 
 public:
     void Build() {
         // Shaders
@@ -453,12 +3020,67 @@ public:
         material1->ks = vec3(0.2f, 0.2f, 0.2f);
         // material1->ka = vec3(0.2f, 0.2f, 0.2f);
         material1->shininess = 1;
-        Geometry * terrain = new Terrain();
-        Object * terrainobject = new Object(phongShader, material1, new CheckerBoardTexture(20, 20), terrain);
-        terrainobject->translation = vec3(0, -3, 0);
-        terrainobject->scale = vec3(0.3f, 0.3f, 0.3f);
-        terrainobject->rotationAxis = vec3(0, 1, 0);
-        objects.push_back(terrainobject);
+        // the terrain function for the height map, and the same on whole grids for the scattering
+        std::function<double(float, float)> height;
+        HeightGridFunction heightGrid = terrainHeightGrid();
+        NoiseOptions noise;
+        unsigned int seed = terrainSeed;
+        if (noiseTerrain) {
+            height = [noise, seed](float u, float v) {
+                float h, dhdu, dhdv;
+                gradientNoise(seed, noise, 1, &u, &v, &h, &dhdu, &dhdv);
+                return (double)h;
+            };
+        }
+        else withTerrainSpectrum(terrainStyle, [&](auto spectrum) {
+            typedef decltype(spectrum) Spectrum;
+            height = [](float u, float v) { return getTerrainHeight<Spectrum>(u, v, terrainHarmonics); };
+        });
+        // every terrain object asks the cache, which generates the mesh of the options once
+        GeometryKey key("terrain");
+        key("style", noiseTerrain ? std::string("noise") : terrainStyle)("seed", terrainSeed)("amplitude", A)
+           ("harmonics", terrainHarmonics)("tessellation", tessellationLevel)("size", terrainWorldSize);
+        std::function<Geometry *()> makeTerrain;
+        if (heightMapFormat != NoHeightMap) {
+            phongShader = new HeightFieldShader();
+            key("heightmap", heightMapFormat == HeightMapR16 ? "r16" : "r32f");
+            makeTerrain = [&]() { return new HeightFieldSurface(height, heightMapFormat == HeightMapR16); };
+        }
+        else if (noiseTerrain) makeTerrain = [&]() { return new NoiseTerrain(terrainSeed, true); };
+        else withTerrainSpectrum(terrainStyle, [&](auto spectrum) {
+            key("normals", gridNormals ? "grid" : "analytic")("gpu", gpuBake);
+            makeTerrain = []() {
+                return new Terrain<decltype(spectrum)>(gridNormals ? ParamSurface::GridNormals : ParamSurface::AnalyticNormals, gpuBake, true);
+            };
+        });
+        if (streamTerrain) BuildStreamer(phongShader, material1, new CheckerBoardTexture(20, 20));
+        else {
+            auto start = std::chrono::steady_clock::now();
+            std::vector<Object *> spinning;
+            for (int c = 0; c < terrainCopies; c++) {   // copies in a row on both sides of the first
+                Object * terrainobject = new Object(phongShader, material1, new CheckerBoardTexture(20, 20), geometries.Get(key, makeTerrain));
+                terrainobject->translation = vec3(5.0f * ((c + 1) / 2) * (c % 2 ? 1 : -1), -3, 0);
+                terrainobject->scale = vec3(0.3f, 0.3f, 0.3f);
+                terrainobject->rotationAxis = vec3(0, 1, 0);
+                objects.push_back(terrainobject);
+                spinning.push_back(terrainobject);
+            }
+            geometries.Update(true);
+            if (terrainCopies > 1)
+                printf("Geometry cache: %d terrain objects, %d requests, %d meshes generated in %.1f ms\n", terrainCopies,
+                       geometries.requests, geometries.generated,
+                       std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000);
+            Object * terrainobject = objects[0];
+            if (scatterInstances) {
+                std::vector<Object *> instances = Scatter(*terrainobject, heightGrid);
+                objects.insert(objects.end(), instances.begin(), instances.end());
+                spinning.insert(spinning.end(), instances.begin(), instances.end());
+            }
+            const float turn = 2 * (float)M_PI, angularVelocity = 0.8f;
+            for (Object * object : spinning)
+                tracks.AddChannel(&object->rotationAngle, { 0, turn / angularVelocity }, { 0, turn },
+                                  AnimationTracks::Linear, true);
+        }
  
         /*int nObjects = objects.size();
         for (int i = 0; i < 1; i++) {
@@ -472,10 +3094,24 @@ public:
             objects.push_back(object);
         }*/
  
+        if (impostorDistance > 0) impostors = new ImpostorAtlas(impostorDistance, impostorAngle);
+        if (shadowCascades > 0) shadows = new ShadowCascades(shadowCascades);
+        if (overdrawMode) overdraw = new OverdrawView();
+        if (multiViews > 0) {
+            views = new MultiView(multiViews);
+            views->separate = separateViews;
+            viewCameras.resize(views->Views());
+        }
+ 
         // Camera
         camera.wEye = vec3(0, -1, 4);
         camera.wLookat = vec3(0, -2.3, 0);
         camera.wVup = vec3(0, 1, 0);
+        if (streamer) {
+            camera.wEye = vec3(0, 6, 0);
+            camera.bp = 40;
+            Fly();
+        }
  
  
         // Lights
@@ -499,24 +3135,718 @@ public:
         state.V = camera.V();
         state.P = camera.P();
         state.lights = lights;
-        for (Object * obj : objects) obj->Draw(state);
+        if (probeExactLights >= 0) {
+            ProjectLights();
+            state.lights = exactLights;
+            state.probe = &probe;
+        }
+        float time = glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
+        geometries.Update();
+        tracks.Evaluate(time);
+        if (streamer) streamer->Update(camera, time);
+        std::vector<Object *> drawn = objects;
+        if (streamer) drawn.insert(drawn.end(), streamer->Visible().begin(), streamer->Visible().end());
+ 
+        graph.Reset();
+        FrameGraph::TextureDesc windowDesc;
+        windowDesc.width = windowWidth;
+        windowDesc.height = windowHeight;
+        FrameGraph::Resource window = graph.Import("window", 0, windowDesc);
+        const vec4 background(0.2f, 0.2f, 0.2f, 1);
+        graph.Clear(window, background);
+        graph.Output(window);
+        FrameGraph::Resource shadowMap = -1;
+        if (shadows) {      // the cascades are kept across frames, so the graph does not own them
+            FrameGraph::TextureDesc desc;
+            desc.target = GL_TEXTURE_2D_ARRAY;
+            desc.format = GL_DEPTH_COMPONENT24;
+            shadowMap = graph.Import("shadow map", shadows->state.depthArray, desc);
+            graph.AddPass("shadows", [&]() {
+                pipelineStats.Begin("shadows");
+                shadows->Update(camera, lights[0].wLightPos, drawn);
+                pipelineStats.End();
+            }).Write(shadowMap, FrameGraph::Direct);
+            state.shadows = &shadows->state;
+        }
+        FrameGraph::Resource viewColors = -1;
+        if (views) {
+            for (int v = 0; v < views->Views(); v++) {      // monitors circling the point the camera looks at
+                float angle = 2 * (float)M_PI * v / views->Views() + time * 0.2f;
+                viewCameras[v].wLookat = camera.wLookat;
+                viewCameras[v].wEye = camera.wLookat + vec3(4 * cosf(angle), 2, 4 * sinf(angle));
+                viewCameras[v].wVup = vec3(0, 1, 0);
+                viewCameras[v].asp = 1;
+            }
+            viewColors = views->AddPass(graph, viewCameras, drawn, state, time, background);
+        }
+        if (overdraw) overdraw->AddPasses(graph, window, drawn, state, time);
+        else {
+            FrameGraph::PassBuilder scenePass = graph.AddPass("scene", [&]() {
+                if (streamer) {
+                    pipelineStats.Begin("terrain");
+                    streamer->Draw(state);
+                    pipelineStats.End();
+                }
+                pipelineStats.Begin("objects");
+                for (Object * obj : objects) {
+                    if (impostors && impostors->Draw(*obj, state)) continue;
+                    obj->Draw(state);
+                }
+                pipelineStats.End();
+            });
+            scenePass.Write(window);
+            if (shadowMap >= 0) scenePass.Read(shadowMap);
+        }
+        if (views) views->AddShow(graph, viewColors, window, windowWidth / maxViews);
+        graph.Execute();
+        if (clusterStats.meshlets > 0 && time - lastClusterReport >= 5) {
+            lastClusterReport = time;
+            const MeshletCullStats& c = clusterStats;
+            printf("Clusters: %.1f%% of the triangles drawn; of the meshlets %.1f%% outside the view, %.1f%% facing away\n",
+                   100.0 * c.drawn / c.triangles, 100.0 * c.outside / c.meshlets, 100.0 * c.backfacing / c.meshlets);
+            clusterStats = MeshletCullStats();
+        }
+        pipelineStats.EndFrame(time);
     }
  
     void Animate(float tstart, float tend) {
-        for (Object * obj : objects) obj->Animate(tstart, tend);
+        if (streamer) {
+            heading += turnRate * (tend - tstart);
+            camera.wEye = camera.wEye + vec3(sinf(heading), 0, cosf(heading)) * (flightSpeed * (tend - tstart));
+            Fly();
+        }
+    }
+ 
+    // flight controls over the streamed terrain: w / s faster / slower, a / d turn while held
+    void Steer(unsigned char key, bool down) {
+        if (!streamer) return;
+        if (down && key == 'w') flightSpeed += 2;
+        if (down && key == 's') flightSpeed -= 2;
+        if (key == 'a') turnRate = down ? 0.5f : 0;
+        if (key == 'd') turnRate = down ? -0.5f : 0;
     }
 };
  
 Scene scene;
  
+//---------------------------
+class FramePacer {
+//---------------------------
+// Caps the frames the driver may queue: every frame ends with a fence, and a new frame does not start
+// while maxFramesInFlight older ones are unfinished. Latencies come from a GL_TIMESTAMP query written
+// right after the swap, mapped to the CPU clock with an offset calibrated from glGetInteger64v.
+// Frame latency runs from the start of onDisplay to that timestamp, input latency from the first input
+// event the frame consumed.
+    struct Frame {
+        GLsync fence;
+        unsigned int query;
+        double start, input;    // CPU seconds, input < 0 if no input arrived before the frame
+    };
+    std::vector<Frame> pending;     // oldest first
+    std::vector<unsigned int> freeQueries;
+    double gpuOffset = 0, lastCalibration = -1, lastReport = 0, nextInput = -1;
+ 
+    static double Now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+ 
+    void Calibrate(double now) {
+        GLint64 gpu;
+        glGetInteger64v(GL_TIMESTAMP, &gpu);
+        gpuOffset = Now() - gpu * 1e-9;
+        lastCalibration = now;
+    }
+ 
+    // reads the timestamps of the finished frames at the front, waits for the front frame if wait is set
+    void Retire(bool wait) {
+        while (!pending.empty()) {
+            Frame& frame = pending.front();
+            GLenum status = glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 100000000 : 0);
+            if (status == GL_TIMEOUT_EXPIRED) return;
+            GLuint64 timestamp;
+            glGetQueryObjectui64v(frame.query, GL_QUERY_RESULT, &timestamp);
+            double present = timestamp * 1e-9 + gpuOffset;
+            frameLatency.Add(present - frame.start);
+            if (frame.input >= 0) inputLatency.Add(present - frame.input);
+            glDeleteSync(frame.fence);
+            freeQueries.push_back(frame.query);
+            pending.erase(pending.begin());
+            wait = false;
+        }
+    }
+ 
+public:
+    struct Latency {
+        double last = 0, sum = 0, max = 0;
+        int count = 0;
+        void Add(double seconds) { last = seconds; sum += seconds; max = fmax(max, seconds); count++; }
+        double Mean() const { return count ? sum / count : 0; }
+    };
+    Latency frameLatency, inputLatency;     // since the last report
+    int maxFramesInFlight = 0;              // 1..3, 0: no control
+ 
+    // called from the input callbacks; the next frame to start carries the time of the first event
+    void Input() { if (nextInput < 0) nextInput = Now(); }
+ 
+    void BeginFrame() {
+        if (maxFramesInFlight <= 0) return;
+        double now = Now();
+        if (lastCalibration < 0 || now - lastCalibration > 1) Calibrate(now);
+        Retire(false);
+        while ((int)pending.size() >= maxFramesInFlight) Retire(true);
+        Frame frame;
+        frame.start = Now();
+        frame.input = nextInput;
+        nextInput = -1;
+        frame.fence = nullptr;
+        if (freeQueries.empty()) {
+            frame.query = 0;
+            glGenQueries(1, &frame.query);
+        }
+        else {
+            frame.query = freeQueries.back();
+            freeQueries.pop_back();
+        }
+        pending.push_back(frame);
+    }
+ 
+    // after the swap
+    void EndFrame() {
+        if (maxFramesInFlight <= 0) return;
+        Frame& frame = pending.back();
+        glQueryCounter(frame.query, GL_TIMESTAMP);
+        frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+ 
+        if (frame.start - lastReport >= 5 && frameLatency.count > 0) {
+            lastReport = frame.start;
+            printf("Latency: frame %.1f ms mean, %.1f ms max over %d frames, input %.1f ms mean, %.1f ms max over %d, %d frames in flight\n",
+                   frameLatency.Mean() * 1000, frameLatency.max * 1000, frameLatency.count,
+                   inputLatency.Mean() * 1000, inputLatency.max * 1000, inputLatency.count, maxFramesInFlight);
+            frameLatency = Latency();
+            inputLatency = Latency();
+        }
+    }
+};
+ 
+FramePacer framePacer;
+ 
+// Times the Dnum chain rule of a tractricoid against the same derivatives written out by hand (equal times:
+// the optimizer leaves no temporaries of the chain behind), and the modeling * view * projection product
+void benchmarkMath(int count) {
+    auto seconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    volatile float sink = 0;    // keeps the sums alive
+    float sum = sink;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        Dnum2 U((float)i / count * 6.28f, vec2(1, 0)), V((float)(i % 1000) / 1000 + 0.1f, vec2(0, 1));
+        Dnum2 C = Cosh(V), X = Cos(U) / C, Y = Sin(U) / C, Z = V - Tanh(V);
+        sum += X.f + X.d.x + X.d.y + Y.f + Y.d.x + Y.d.y + Z.f + Z.d.y;
+    }
+    sink = sum;
+    double chain = seconds(start);
+ 
+    sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        float u = (float)i / count * 6.28f, v = (float)(i % 1000) / 1000 + 0.1f;
+        float cu = cosf(u), su = sinf(u), ch = cosh(v), sh = sinh(v);
+        float X = cu / ch, Xdu = -su / ch, Xdv = -cu * sh / (ch * ch);
+        float Y = su / ch, Ydu = cu / ch, Ydv = -su * sh / (ch * ch);
+        float t = tanhf(v), Z = v - t, Zdv = t * t;
+        sum += X + Xdu + Xdv + Y + Ydu + Ydv + Z + Zdv;
+    }
+    sink = sum;
+    double hand = seconds(start);
+ 
+    Camera camera;
+    camera.wEye = vec3(0, -1, 4);
+    camera.wLookat = vec3(0, -2.3, 0);
+    camera.wVup = vec3(0, 1, 0);
+    mat4 VP = camera.V() * camera.P();
+    sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        mat4 M = ScaleMatrix(vec3(0.3f, 0.3f, 0.3f)) * RotationMatrix(i * 1e-6f, vec3(0, 1, 0)) * TranslateMatrix(vec3(0, -3, 0));
+        mat4 MVP = M * VP;
+        sum += MVP[3][3];
+    }
+    sink = sum;
+    double matrices = seconds(start);
+    printf("Dnum chain rule %.2f ns, hand written %.2f ns per sample, M * V * P %.2f ns per object\n",
+           chain * 1e9 / count, hand * 1e9 / count, matrices * 1e9 / count);
+}
+ 
+// Times AnimationTracks::Evaluate on count objects with 7 looping smooth channels each (translation,
+// rotation angle, scale), all of them animated, over a second of 60 frames
+void benchmarkAnimation(int count) {
+    struct Transform { vec3 translation, scale; float angle; };
+    std::vector<Transform> transforms(count);
+    AnimationTracks tracks;
+    std::mt19937 generator(1);
+    auto random = [&](float lo, float hi) { return lo + (hi - lo) * (float)generator() / std::mt19937::max(); };
+    for (Transform& transform : transforms) {
+        float * channels[7] = { &transform.translation.x, &transform.translation.y, &transform.translation.z,
+                                &transform.angle, &transform.scale.x, &transform.scale.y, &transform.scale.z };
+        for (float * channel : channels) {
+            float period = random(1, 4);
+            tracks.AddChannel(channel, { 0, period / 3, period * 2 / 3, period },
+                              { 0, random(-1, 1), random(-1, 1), 0 }, AnimationTracks::Smooth, true);
+        }
+    }
+    const int frames = 60;
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++) tracks.Evaluate(frame / 60.0f);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%d objects, %d channels: %.3f ms per frame, %.2f ns per channel\n", count, tracks.Channels(),
+           seconds * 1000 / frames, seconds * 1e9 / frames / tracks.Channels());
+}
+ 
+// Times a parallel sum over a buffer of megabytes MB written first by one thread, which puts every page
+// on the node of that thread, and by all the workers, which spreads the pages over their nodes.
+// On a single node machine the two are the same; across sockets the second adds up their bandwidth.
+void benchmarkMemory(int megabytes) {
+    size_t count = (size_t)megabytes * 1048576 / sizeof(double);
+    if (count == 0) return;
+    for (bool spread : { false, true }) {
+        LargeBuffer<double> buffer(count, hugePages);
+        if (!buffer.data()) return;
+        if (spread) buffer.FirstTouch();
+        else buffer.FirstTouch(1);
+        const int nThreads = defaultThreadCount();
+        const size_t chunk = buffer.PageSize() / sizeof(double);
+        const int chunks = (int)((count + chunk - 1) / chunk);
+        parallelFor(chunks, [&](int c) {
+            for (size_t i = c * chunk; i < count && i < (c + 1) * chunk; i++) buffer[i] = (double)(i & 255);
+        }, nThreads);
+        std::vector<double> sums(chunks);
+        double best = 1e30;
+        for (int pass = 0; pass < 5; pass++) {
+            auto start = std::chrono::steady_clock::now();
+            parallelFor(chunks, [&](int c) {
+                double sum = 0;
+                for (size_t i = c * chunk; i < count && i < (c + 1) * chunk; i++) sum += buffer[i];
+                sums[c] = sum;
+            }, nThreads);
+            best = fmin(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        double total = 0;
+        for (double sum : sums) total += sum;
+        printf("%s first touch: %.1f GB/s with %d threads (checksum %.0f)\n", spread ? "Parallel" : "Serial",
+               count * sizeof(double) / best / 1e9, nThreads, total);
+        buffer.Placement(spread ? "  parallel touched" : "  serial touched");
+    }
+}
+ 
+// Times the Poisson disk sampling of about count points on the unit square, without terrain rules, on
+// one thread and on all of them, and checks that both give the same points
+void benchmarkScatter(int count) {
+    if (count <= 0) return;
+    ScatterOptions options;
+    options.radius = (float)sqrt(0.7 / count);     // a maximal Poisson disk set has about 0.7 / r^2 points per unit area
+    options.seed = 1;
+    std::vector<ScatterPoint> results[2];
+    for (int run = 0; run < 2; run++) {
+        options.threads = run == 0 ? 1 : defaultThreadCount();
+        PoissonDiskScatter scatter;
+        auto start = std::chrono::steady_clock::now();
+        results[run] = scatter.Generate(options, [](const ScatterTile&, std::vector<ScatterPoint>&) {});
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%d points with %d threads in %.1f ms, %.1f ns per point\n", (int)results[run].size(), options.threads,
+               seconds * 1000, seconds * 1e9 / std::max((int)results[run].size(), 1));
+    }
+    bool same = results[0].size() == results[1].size();
+    for (size_t i = 0; same && i < results[0].size(); i++)
+        same = results[0][i].u == results[1][i].u && results[0][i].v == results[1][i].v && results[0][i].random == results[1][i].random;
+    printf("Results %s\n", same ? "identical" : "DIFFER");
+}
+ 
+// Builds the nav grid of the terrain with resolution x resolution cells, then flattens a disk of the
+// terrain as an edit would, rebuilds the tiles under it and checks the regions against a full build
+void benchmarkNavGrid(int resolution) {
+    if (resolution <= 0) return;
+    initTerrainPhases();
+    NavSampler terrain = terrainNavSampler();
+    float centerHeight, centerSlope;
+    terrain(0.5, 0.5, 0, 1, &centerHeight, &centerSlope);
+    double editRadius = 0;
+    NavSampler edited = [&](double u0, double v0, double step, int n, float * height, float * slope) {
+        terrain(u0, v0, step, n, height, slope);
+        for (int i = 0; i < n * n && editRadius > 0; i++) {
+            double du = u0 + i % n * step - 0.5, dv = v0 + i / n * step - 0.5;
+            if (du * du + dv * dv < editRadius * editRadius) {
+                height[i] = centerHeight;
+                slope[i] = 0;
+            }
+        }
+    };
+    NavGridOptions options;
+    options.resolution = resolution;
+    options.pages = hugePages;
+    auto seconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    
+    NavGrid grid;
+    auto start = std::chrono::steady_clock::now();
+    if (!grid.Build(options, edited)) return;
+    double build = seconds(start);
+    long long walkable = 0, largest = 0;
+    for (int r = 0; r < grid.Regions(); r++) {
+        walkable += grid.RegionCells(r);
+        largest = std::max(largest, grid.RegionCells(r));
+    }
+    double cells = (double)resolution * resolution;
+    printf("%d x %d nav grid in %.1f ms with %d threads: %.1f%% walkable, %d regions, the largest %.1f%%\n",
+           resolution, resolution, build * 1000, defaultThreadCount(), 100 * walkable / cells, grid.Regions(), 100 * largest / cells);
+    
+    editRadius = 0.05;
+    start = std::chrono::steady_clock::now();
+    int rebuilt = grid.Rebuild(0.5 - editRadius, 0.5 - editRadius, 0.5 + editRadius, 0.5 + editRadius);
+    double update = seconds(start);
+    NavGrid full;
+    if (!full.Build(options, edited)) return;
+    std::vector<int> incremental(cells), reference(cells);
+    grid.RegionGrid(incremental.data());
+    full.RegionGrid(reference.data());
+    printf("Flattened disk: %d of %d tiles rebuilt in %.1f ms, %d regions, %s a full build\n", rebuilt,
+           grid.TilesPerSide() * grid.TilesPerSide(), update * 1000, grid.Regions(),
+           incremental == reference ? "same as" : "DIFFERENT from");
+}
+ 
+// Drainage of the terrain on resolution x resolution cells: depressions filled, flow directions by method,
+// accumulation and basins. Then flattens a disk of the terrain as an edit would, analyses again reusing
+// the floods of the other tiles and checks the result against a full build
+void benchmarkFlow(int resolution, FlowMethod method) {
+    if (resolution <= 0) return;
+    initTerrainPhases();
+    HeightGridFunction terrain = terrainHeightGrid();
+    float centerHeight;
+    terrain(0.5, 0.5, 0, 1, 1, &centerHeight);
+    double editRadius = 0;
+    FlowSampler edited = [&](double u0, double v0, double step, int nu, int nv, float * h) {
+        terrain(u0, v0, step, nu, nv, h);
+        for (int i = 0; i < nu * nv && editRadius > 0; i++) {
+            double du = u0 + i % nu * step - 0.5, dv = v0 + i / nu * step - 0.5;
+            if (du * du + dv * dv < editRadius * editRadius) h[i] = centerHeight;
+        }
+    };
+    FlowOptions options;
+    options.resolution = resolution;
+    options.method = method;
+    options.pages = hugePages;
+    const char * name = method == FlowD8 ? "D8" : "D-infinity";
+    auto report = [&](const FlowGrid& flow, double seconds) {
+        const FlowTimings& t = flow.Timings();
+        printf("  %.1f ms: flood %.1f, spill graph %.1f, directions %.1f, accumulation %.1f in %d rounds\n", seconds * 1000,
+               t.flood * 1000, t.spill * 1000, t.directions * 1000, t.accumulation * 1000, t.rounds);
+    };
+    
+    FlowGrid flow;
+    auto start = std::chrono::steady_clock::now();
+    if (!flow.Build(options, edited)) return;
+    double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const size_t cells = (size_t)resolution * resolution;
+    std::vector<int> basins(cells), referenceBasins(cells);
+    flow.Basins(basins.data());
+    long long lakeCells = 0, outlets = 0;
+    float deepest = 0, largest = 0;
+    for (int y = 0; y < resolution; y++) {
+        for (int x = 0; x < resolution; x++) {
+            float depth = flow.LakeDepth(x, y);
+            lakeCells += depth > 0;
+            deepest = std::max(deepest, depth);
+            largest = std::max(largest, flow.Accumulation(x, y));
+            outlets += basins[(size_t)y * resolution + x] == y * resolution + x;
+        }
+    }
+    printf("%d x %d %s drainage with %d threads: %.1f%% lakes up to %.3f deep, %lld basins, the largest river drains %.1f%%\n",
+           resolution, resolution, name, defaultThreadCount(), 100.0 * lakeCells / cells, deepest, outlets, 100.0 * largest / cells);
+    report(flow, build);
+    
+    editRadius = 0.05;
+    start = std::chrono::steady_clock::now();
+    int rebuilt = flow.Rebuild(0.5 - editRadius, 0.5 - editRadius, 0.5 + editRadius, 0.5 + editRadius);
+    double update = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    FlowGrid full;
+    if (!full.Build(options, edited)) return;
+    std::vector<float> accumulation(cells), reference(cells);
+    flow.AccumulationGrid(accumulation.data());
+    full.AccumulationGrid(reference.data());
+    flow.Basins(basins.data());
+    full.Basins(referenceBasins.data());
+    bool same = accumulation == reference && basins == referenceBasins;
+    for (int y = 0; same && y < resolution; y++)
+        for (int x = 0; same && x < resolution; x++) same = flow.Filled(x, y) == full.Filled(x, y);
+    printf("Flattened disk: %d of %d tiles flooded again, %s a full build\n", rebuilt,
+           flow.TilesPerSide() * flow.TilesPerSide(), same ? "same as" : "DIFFERENT from");
+    report(flow, update);
+}
+ 
+// Builds the meshlets of the terrain tessellated into N x N quads and culls them from two cameras over a
+// whole turn: the default one looking at the spinning terrain of the scene, and one just above the middle
+// of the terrain turning around; reports the triangles skipped and the time a cull takes
+void benchmarkClusters(int N) {
+    if (N <= 0) return;
+    initTerrainPhases();
+    HeightGridFunction terrain = terrainHeightGrid();
+    std::vector<float> h((size_t)(N + 1) * (N + 1));
+    terrain(0, 0, 1.0 / N, N + 1, N + 1, h.data());
+    std::vector<vec3> positions((size_t)(N + 1) * 2 * N);     // as ParamSurface lays out its strips
+    const float S = terrainWorldSize;
+    for (int i = 0; i < N; i++)
+        for (int j = 0; j <= N; j++)
+            for (int k = 0; k < 2; k++)
+                positions[(size_t)(i * (N + 1) + j) * 2 + k] = vec3((float)j / N * S - S / 2, h[(size_t)(i + k) * (N + 1) + j],
+                                                                    (float)(i + k) / N * S - S / 2);
+    Meshlets meshlets;
+    auto start = std::chrono::steady_clock::now();
+    meshlets.BuildStrips(N, N, [&](unsigned int k) { return &positions[k].x; });
+    double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%d x %d quads in %d meshlets, built in %.1f ms\n", N, N, meshlets.Count(), build * 1000);
+    
+    const int steps = 64;
+    auto turn = [&](const char * name, const std::function<void(float angle, Camera& camera, mat4& M, mat4& Minv)>& view) {
+        MeshletCullStats stats;
+        double seconds = 0;
+        for (int s = 0; s < steps; s++) {
+            Camera camera;
+            mat4 M, Minv;
+            view(2 * (float)M_PI * s / steps, camera, M, Minv);
+            mat4 MVP = M * camera.V() * camera.P();
+            vec4 eye = vec4(camera.wEye.x, camera.wEye.y, camera.wEye.z, 1) * Minv;
+            start = std::chrono::steady_clock::now();
+            meshlets.Cull(MVP, eye.x, eye.y, eye.z, stats);
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        printf("  %s: %.1f%% of the triangles skipped, %.1f%% of the meshlets outside the view, %.1f%% facing away, %.1f us per cull\n",
+               name, 100.0 - 100.0 * stats.drawn / stats.triangles, 100.0 * stats.outside / stats.meshlets,
+               100.0 * stats.backfacing / stats.meshlets, seconds * 1e6 / steps);
+    };
+    turn("spinning terrain", [](float angle, Camera& camera, mat4& M, mat4& Minv) {
+        camera.wEye = vec3(0, -1, 4);
+        camera.wLookat = vec3(0, -2.3, 0);
+        camera.wVup = vec3(0, 1, 0);
+        vec3 scale(0.3f, 0.3f, 0.3f), translation(0, -3, 0), axis(0, 1, 0);
+        M = ScaleMatrix(scale) * RotationMatrix(angle, axis) * TranslateMatrix(translation);
+        Minv = TranslateMatrix(-translation) * RotationMatrix(-angle, axis) * ScaleMatrix(vec3(1 / scale.x, 1 / scale.y, 1 / scale.z));
+    });
+    float center = h[(size_t)(N / 2) * (N + 1) + N / 2];
+    turn("close-up turning", [center](float angle, Camera& camera, mat4& M, mat4& Minv) {
+        camera.wEye = vec3(0, center + 0.3f, 0);
+        camera.wLookat = camera.wEye + vec3(cosf(angle), -0.2f, sinf(angle));
+        camera.wVup = vec3(0, 1, 0);
+        M = Minv = TranslateMatrix(vec3(0, 0, 0));
+    });
+}
+ 
+// Synthesizes N x N noise, gradient, splat and checker textures as RGBA8 and as R16 and reports the time
+// each took; with --texture-cache every one is built a second time, from the cache. The checker board is
+// also made the way it was before the generators, column by column into floats, for comparison.
+void benchmarkTextures(int N) {
+    if (N <= 0) return;
+    const float black[4] = { 0, 0, 0, 1 }, white[4] = { 1, 1, 1, 1 }, blue[4] = { 0, 0, 1, 1 }, yellow[4] = { 1, 1, 0, 1 };
+    const float sand[4] = { 0.76f, 0.7f, 0.5f, 1 }, grass[4] = { 0.2f, 0.5f, 0.1f, 1 };
+    const std::pair<const char *, std::shared_ptr<TextureGenerator>> generators[] = {
+        { "noise", std::make_shared<NoiseGenerator>(terrainSeed, NoiseOptions(), black, white) },
+        { "gradient", std::make_shared<GradientGenerator>(0.5f, blue, yellow) },
+        { "splats", std::make_shared<SplatGenerator>(terrainSeed, 64, 0.7f, sand, grass) },
+        { "checker", std::make_shared<CheckerGenerator>(1, blue, yellow) },
+    };
+    auto milliseconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000;
+    };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<vec4> image((size_t)N * N);
+    const vec4 yellow4(1, 1, 0, 1), blue4(0, 0, 1, 1);
+    for (int x = 0; x < N; x++) for (int y = 0; y < N; y++) image[(size_t)y * N + x] = (x & 1) ^ (y & 1) ? yellow4 : blue4;
+    printf("%d x %d texels, %d threads\n  checker as floats column by column: %.1f ms\n", N, N,
+           (int)std::thread::hardware_concurrency(), milliseconds(start));
+    for (const auto& generator : generators) {
+        for (TexelFormat format : { TexelRGBA8, TexelR16 }) {
+            ProcTextureOptions options;
+            options.width = options.height = N;
+            options.format = format;
+            options.cacheDirectory = textureCacheDirectory;
+            if (!options.cacheDirectory.empty())    // a cold build, whatever an earlier run left
+                remove(textureCachePath(options.cacheDirectory, textureCacheKey(*generator.second, options)).c_str());
+            bool cached = false;
+            start = std::chrono::steady_clock::now();
+            std::vector<uint8_t> texels = synthesizeTexture(*generator.second, options, &cached);
+            double built = milliseconds(start);
+            printf("  %s %s: %.1f ms, %.2f ns per texel", generator.first, format == TexelRGBA8 ? "RGBA8" : "R16", built,
+                   built * 1e6 / ((double)N * N));
+            if (!options.cacheDirectory.empty()) {
+                start = std::chrono::steady_clock::now();
+                std::vector<uint8_t> again = synthesizeTexture(*generator.second, options, &cached);
+                printf(", %s %.1f ms%s", cached ? "from the cache" : "built again", milliseconds(start), again == texels ? "" : ", DIFFERENT");
+            }
+            printf("\n");
+        }
+    }
+}
+ 
+// Command line: --seed S renders seed S, --spectrum NAME selects the terrain style,
+// --noise the gradient noise terrain, --grid-normals finite difference normals for the Fourier terrain,
+// --height-map r16|r32f vertex pulling from a height texture, --gpu-bake the compute shader terrain generator,
+// --impostor-distance D and --impostor-angle DEG impostors for far objects,
+// --stream an endless terrain generated ahead of the camera, --fly SPEED its initial flight speed (w/s/a/d steer),
+// --sh-lights K the K brightest lights exact and the rest as spherical harmonics,
+// --frames-in-flight N at most N (1..3) frames queued in the driver, with latency reports,
+// --shadows N cascaded shadow map of the first light with N (1..4) cascades,
+// --pipeline-stats per pass counts of vertices, primitives and shader invocations,
+// --overdraw fragments per pixel as a heat map with a histogram instead of the shaded image,
+// --scatter trees and rocks by Poisson disk sampling on the terrain, drawn instanced,
+// --copies N N terrain objects in a row that share one mesh of the geometry cache,
+// --views N N (1..6) more cameras rendered in one pass into a texture array and shown as thumbnails,
+// --views-separate the same with a traversal per camera, for comparison,
+// --clusters the terrain drawn as meshlets, skipping those outside the view or facing away.
+// --bench-math N times N evaluations of the vector and dual number math and exits,
+// --bench-animation N times the keyframe evaluation of N animated objects and exits,
+// --nav-grid N builds the N x N nav grid of the terrain, times a rebuild after an edit and exits,
+// --bench-clusters N times the meshlet culling of the N x N tessellated terrain over two turning views and exits,
+// --bench-textures N times the synthesis of N x N procedural textures and exits,
+// --flow N analyses the drainage of the terrain on N x N cells (--dinf: D-infinity directions instead of D8),
+// times a rebuild after an edit and exits,
+// --bench-scatter N times the Poisson disk sampling of about N points and exits,
+// --bench-memory MB times parallel reads of MB megabytes after serial and parallel first touch and exits,
+// --huge-pages off|transparent|explicit the pages of the large generation buffers, --placement reports them,
+// --texture-cache DIR keeps procedural textures in DIR, to be read instead of synthesized again.
+// --seed-stats FIRST COUNT writes terrain statistics as CSV (options: --res R, --bins B, --threads T,
+// --out FILE) and exits without opening a window
+bool onCommandLine(int argc, char * argv[]) {
+    SeedStatsOptions options;
+    options.A = terrainAmplitude;
+    options.n = terrainHarmonics;
+    bool stats = false;
+    unsigned int first = 0;
+    int count = 0, navResolution = 0, flowResolution = 0, clusterResolution = 0, textureResolution = 0;
+    FlowMethod flowMethod = FlowD8;
+    const char * out = nullptr;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--seed" && hasValue) terrainSeed = (unsigned int)strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--spectrum" && hasValue) terrainStyle = argv[++i];
+        else if (arg == "--noise") noiseTerrain = true;
+        else if (arg == "--grid-normals") gridNormals = true;
+        else if (arg == "--gpu-bake") gpuBake = true;
+        else if (arg == "--impostor-distance" && hasValue) impostorDistance = (float)atof(argv[++i]);
+        else if (arg == "--impostor-angle" && hasValue) {
+            impostorAngle = (float)atof(argv[++i]);
+            if (!(impostorAngle >= 0 && impostorAngle < 180)) {
+                printf("--impostor-angle takes degrees from 0 up to but not including 180\n");
+                return true;
+            }
+        }
+        else if (arg == "--sh-lights" && hasValue) probeExactLights = atoi(argv[++i]);
+        else if (arg == "--frames-in-flight" && hasValue) framePacer.maxFramesInFlight = std::min(std::max(atoi(argv[++i]), 1), 3);
+        else if (arg == "--shadows" && hasValue) shadowCascades = atoi(argv[++i]);
+        else if (arg == "--pipeline-stats") pipelineStats.enabled = true;
+        else if (arg == "--overdraw") overdrawMode = true;
+        else if (arg == "--scatter") scatterInstances = true;
+        else if (arg == "--copies" && hasValue) terrainCopies = std::max(atoi(argv[++i]), 1);
+        else if (arg == "--views" && hasValue) multiViews = std::min(std::max(atoi(argv[++i]), 1), maxViews);
+        else if (arg == "--views-separate") separateViews = true;
+        else if (arg == "--clusters") clusterCulling = true;
+        else if (arg == "--bench-clusters" && hasValue) clusterResolution = atoi(argv[++i]);
+        else if (arg == "--bench-textures" && hasValue) textureResolution = atoi(argv[++i]);
+        else if (arg == "--texture-cache" && hasValue) textureCacheDirectory = argv[++i];
+        else if (arg == "--bench-animation" && hasValue) {
+            benchmarkAnimation(atoi(argv[++i]));
+            return true;
+        }
+        else if (arg == "--nav-grid" && hasValue) navResolution = atoi(argv[++i]);
+        else if (arg == "--flow" && hasValue) flowResolution = atoi(argv[++i]);
+        else if (arg == "--dinf") flowMethod = FlowDInfinity;
+        else if (arg == "--bench-scatter" && hasValue) {
+            benchmarkScatter(atoi(argv[++i]));
+            return true;
+        }
+        else if (arg == "--bench-memory" && hasValue) {
+            benchmarkMemory(atoi(argv[++i]));
+            return true;
+        }
+        else if (arg == "--huge-pages" && hasValue) {
+            std::string pages = argv[++i];
+            if (pages == "off") hugePages = NoHugePages;
+            else if (pages == "transparent") hugePages = TransparentHugePages;
+            else if (pages == "explicit") hugePages = ExplicitHugePages;
+            else {
+                printf("unknown --huge-pages %s, use off, transparent or explicit\n", pages.c_str());
+                return true;
+            }
+        }
+        else if (arg == "--placement") reportPlacement = true;
+        else if (arg == "--bench-math" && hasValue) {
+            benchmarkMath(atoi(argv[++i]));
+            return true;
+        }
+        else if (arg == "--stream") streamTerrain = true;
+        else if (arg == "--fly" && hasValue) flightSpeed = (float)atof(argv[++i]);
+        else if (arg == "--height-map" && hasValue) {
+            std::string format = argv[++i];
+            if (format == "r16") heightMapFormat = HeightMapR16;
+            else if (format == "r32f") heightMapFormat = HeightMapR32F;
+            else {
+                printf("unknown --height-map %s, use r16 or r32f\n", format.c_str());
+                return true;
+            }
+        }
+        else if (arg == "--seed-stats" && i + 2 < argc) {
+            stats = true;
+            first = (unsigned int)strtoul(argv[++i], nullptr, 10);
+            count = atoi(argv[++i]);
+        }
+        else if (arg == "--res" && hasValue) options.resolution = atoi(argv[++i]);
+        else if (arg == "--bins" && hasValue) options.bins = atoi(argv[++i]);
+        else if (arg == "--threads" && hasValue) options.threads = atoi(argv[++i]);
+        else if (arg == "--out" && hasValue) out = argv[++i];
+    }
+    if (!withTerrainSpectrum(terrainStyle, [](auto) {})) {
+        printf("unknown spectrum %s, use classic, smooth, bandpass or ridged\n", terrainStyle.c_str());
+        return true;
+    }
+    if (clusterResolution > 0) {
+        benchmarkClusters(clusterResolution);
+        return true;
+    }
+    if (textureResolution > 0) {
+        benchmarkTextures(textureResolution);
+        return true;
+    }
+    if (navResolution > 0) {    // after the loop: the terrain options may follow it
+        benchmarkNavGrid(navResolution);
+        return true;
+    }
+    if (flowResolution > 0) {
+        benchmarkFlow(flowResolution, flowMethod);
+        return true;
+    }
+    if (!stats) return false;
+    if (count <= 0 || options.resolution < 2 || options.bins < 1) {
+        printf("--seed-stats needs a positive seed count, --res >= 2 and --bins >= 1\n");
+        return true;
+    }
+ 
+    FILE * file = out ? fopen(out, "w") : stdout;
+    if (!file) {
+        printf("%s cannot be opened\n", out);
+        return true;
+    }
+    withTerrainSpectrum(terrainStyle, [&](auto spectrum) {
+        writeSeedStatsCsv(file, computeSeedStats<decltype(spectrum)>(first, count, options));
+    });
+    if (out) fclose(file);
+    return true;
+}
+ 
 // Initialization, create an OpenGL context
 void onInitialization() {
-    srand(time(0));
-    A = 0.5;
-    
-    coeffs = new double[1000* 1000];
-    for (int i = 0; i < 1000* 1000; i++)
-        coeffs[i] = (double)rand() / RAND_MAX * 500;
+    initTerrainPhases();
+    printf("Terrain seed : %u\n", terrainSeed);
+    if (reportPlacement) coeffTable.Placement("Phase table");
  
     glViewport(0, 0, windowWidth, windowHeight);
     glEnable(GL_DEPTH_TEST);
@@ -526,23 +3856,30 @@ void onInitialization() {
  
 // Window has become invalid: Redraw
 void onDisplay() {
-    glClearColor(0.2f, 0.2f, 0.2f, 1.0f);                            // background color
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
-    scene.Render();
+    framePacer.BeginFrame();
+    scene.Render();                                       // clears the screen with its first pass
     glutSwapBuffers();                                    // exchange the two buffers
+    framePacer.EndFrame();
 }
  
 // Key of ASCII code pressed
-void onKeyboard(unsigned char key, int pX, int pY) { }
+void onKeyboard(unsigned char key, int pX, int pY) {
+    framePacer.Input();
+    scene.Steer(key, true);
+}
  
 // Key of ASCII code released
-void onKeyboardUp(unsigned char key, int pX, int pY) { }
+void onKeyboardUp(unsigned char key, int pX, int pY) {
+    framePacer.Input();
+    scene.Steer(key, false);
+}
  
 // Mouse click event
-void onMouse(int button, int state, int pX, int pY) { }
+void onMouse(int button, int state, int pX, int pY) { framePacer.Input(); }
  
 // Move mouse with key pressed
 void onMouseMotion(int pX, int pY) {
+    framePacer.Input();
 }
  
 // Idle event indicating that some time elapsed: do animation here
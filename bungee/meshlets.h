@@ -0,0 +1,184 @@
+//=============================================================================================
+// Meshlets of a tessellated surface: the quads of the strips ParamSurface draws are cut into blocks of
+// at most side x side quads (8 x 8: 128 triangles), each with an index range of its own, a bounding
+// sphere and a cone bounding the normals of its triangles. Every frame whole meshlets are culled before
+// drawing: those outside the view frustum, and those whose every triangle faces away from the eye.
+// The bounds are kept as structure of arrays and the culling loop has no branches, so the compiler
+// vectorizes it; the surviving meshlets become as few index ranges as possible for glMultiDrawElements.
+// Nothing here touches OpenGL.
+//=============================================================================================
+#pragma once
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "jobs.h"
+
+struct MeshletCullStats {
+    long long meshlets = 0, outside = 0, backfacing = 0;   // tested, culled by the frustum, by the normal cone
+    long long triangles = 0, drawn = 0;
+};
+
+//---------------------------
+class Meshlets {
+//---------------------------
+    // bounds of meshlet i: sphere (x, y, z, radius), normal cone around (ax, ay, az) of half angle alpha;
+    // coneCos = infinity marks a cone too wide to ever face away
+    std::vector<float> x, y, z, radius, ax, ay, az, coneSin2, coneCos;
+    std::vector<unsigned int> firstIndex, indexCount;
+    std::vector<uint8_t> visible;
+    long long totalTriangles = 0;
+
+    static void Cross(const float * a, const float * b, const float * c, float * n) {
+        float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] }, v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+        n[0] = u[1] * v[2] - u[2] * v[1];
+        n[1] = u[2] * v[0] - u[0] * v[2];
+        n[2] = u[0] * v[1] - u[1] * v[0];
+    }
+
+public:
+    std::vector<unsigned int> indices;      // GL_TRIANGLES, meshlet after meshlet
+    std::vector<int> counts;                // index ranges of the last Cull, for glMultiDrawElements
+    std::vector<size_t> firsts;
+
+    int Count() const { return (int)firstIndex.size(); }
+
+    // N strips of M quads laid out as ParamSurface uploads them: vertex (i, j) of strip i at 2 (i (M + 1) + j)
+    // and (i + 1, j) right after it. position(k) is the modeling space position of vertex k, 3 floats.
+    // Triangles keep the winding of the strips, so their normals are those the strips face with.
+    template<class Position> void BuildStrips(int N, int M, Position position, int side = 8) {
+        const int blocksN = (N + side - 1) / side, blocksM = (M + side - 1) / side, count = blocksN * blocksM;
+        for (auto * v : { &x, &y, &z, &radius, &ax, &ay, &az, &coneSin2, &coneCos }) v->resize(count);
+        firstIndex.resize(count);
+        indexCount.resize(count);
+        visible.resize(count);
+        unsigned int first = 0;
+        for (int b = 0; b < count; b++) {
+            int rows = std::min(side, N - b / blocksM * side), columns = std::min(side, M - b % blocksM * side);
+            firstIndex[b] = first;
+            indexCount[b] = rows * columns * 6;
+            first += indexCount[b];
+        }
+        indices.resize(first);
+        totalTriangles = first / 3;
+
+        parallelFor(count, [&](int b) {
+            const int i0 = b / blocksM * side, j0 = b % blocksM * side;
+            const int i1 = std::min(i0 + side, N), j1 = std::min(j0 + side, M);
+            unsigned int * out = &indices[firstIndex[b]];
+            float lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+            float sum[3] = { 0, 0, 0 };
+            std::vector<float> normals;     // unit face normals
+            normals.reserve((i1 - i0) * (j1 - j0) * 6);
+            for (int i = i0; i < i1; i++) {
+                for (int j = j0; j < j1; j++) {
+                    unsigned int k = 2 * (i * (M + 1) + j);     // (i, j), (i + 1, j), (i, j + 1), (i + 1, j + 1)
+                    unsigned int quad[6] = { k, k + 1, k + 2, k + 2, k + 1, k + 3 };
+                    for (int t = 0; t < 6; t += 3) {
+                        const float * p[3] = { position(quad[t]), position(quad[t + 1]), position(quad[t + 2]) };
+                        float n[3];
+                        Cross(p[0], p[1], p[2], n);
+                        float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                        if (length > 0) {               // degenerate triangles face nowhere
+                            for (int c = 0; c < 3; c++) {
+                                normals.push_back(n[c] / length);
+                                sum[c] += n[c] / length;
+                            }
+                        }
+                        for (int v = 0; v < 3; v++) {
+                            for (int c = 0; c < 3; c++) {
+                                lo[c] = fminf(lo[c], p[v][c]);
+                                hi[c] = fmaxf(hi[c], p[v][c]);
+                            }
+                            *out++ = quad[t + v];
+                        }
+                    }
+                }
+            }
+            x[b] = (lo[0] + hi[0]) / 2;
+            y[b] = (lo[1] + hi[1]) / 2;
+            z[b] = (lo[2] + hi[2]) / 2;
+            float r2 = 0;
+            for (int i = i0; i <= i1; i++) {
+                for (int j = j0; j <= j1; j++) {
+                    const float * p = position(2 * (std::min(i, N - 1) * (M + 1) + j) + (i == N));
+                    float dx = p[0] - x[b], dy = p[1] - y[b], dz = p[2] - z[b];
+                    r2 = fmaxf(r2, dx * dx + dy * dy + dz * dz);
+                }
+            }
+            radius[b] = sqrtf(r2);
+
+            // the axis is the mean normal, the half angle reaches the normal farthest from it
+            float length = sqrtf(sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+            float minDot = 1;
+            if (length > 0) {
+                for (int c = 0; c < 3; c++) sum[c] /= length;
+                for (size_t n = 0; n < normals.size(); n += 3)
+                    minDot = fminf(minDot, normals[n] * sum[0] + normals[n + 1] * sum[1] + normals[n + 2] * sum[2]);
+            }
+            ax[b] = sum[0];
+            ay[b] = sum[1];
+            az[b] = sum[2];
+            bool narrow = length > 0 && minDot > 0.01f;
+            coneCos[b] = narrow ? minDot : INFINITY;
+            coneSin2[b] = narrow ? 1 - minDot * minDot : 0;
+        });
+    }
+
+    // mvp: the row-major matrix taking modeling space row vectors to clip space, eye: the eye in modeling
+    // space. Leaves the index ranges to draw in counts and firsts, and returns the triangles in them.
+    long long Cull(const float * mvp, float ex, float ey, float ez, MeshletCullStats& stats) {
+        // frustum planes a x + b y + c z + d >= 0 from the columns of the matrix, normalized
+        float planes[6][4];
+        for (int p = 0; p < 6; p++) {
+            int column = p / 2;
+            float sign = p % 2 ? -1.0f : 1.0f;
+            for (int r = 0; r < 4; r++) planes[p][r] = mvp[r * 4 + 3] + sign * mvp[r * 4 + column];
+            float length = sqrtf(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] + planes[p][2] * planes[p][2]);
+            for (int r = 0; r < 4; r++) planes[p][r] /= length > 0 ? length : 1;
+        }
+
+        // A triangle through p with normal n faces away if dot(p - eye, n) >= 0. With every p within the
+        // sphere and every n within alpha of the axis, that holds for all of them if the axis is within
+        // 90 degrees - alpha - asin(r / d) of center - eye, d > r and that angle is not negative:
+        // dot(center - eye, axis) - cos(alpha) r >= sin(alpha) sqrt(d^2 - r^2) and cos(alpha) sqrt(d^2 - r^2) >= sin(alpha) r,
+        // squared below as both sides are >= 0
+        const int count = Count();
+        const float * px = x.data(), * py = y.data(), * pz = z.data(), * pr = radius.data();
+        const float * pax = ax.data(), * pay = ay.data(), * paz = az.data(), * psin2 = coneSin2.data(), * pcos = coneCos.data();
+        uint8_t * pvisible = visible.data();
+        int outside = 0, backfacing = 0;
+        for (int i = 0; i < count; i++) {
+            float cx = px[i], cy = py[i], cz = pz[i], r = pr[i];
+            int in = 1;
+            for (int p = 0; p < 6; p++) in &= planes[p][0] * cx + planes[p][1] * cy + planes[p][2] * cz + planes[p][3] >= -r;
+            float vx = cx - ex, vy = cy - ey, vz = cz - ez;
+            float d2 = vx * vx + vy * vy + vz * vz, r2 = r * r;
+            float t = vx * pax[i] + vy * pay[i] + vz * paz[i] - pcos[i] * r;
+            int away = (d2 > r2) & (t >= 0) & (t * t >= psin2[i] * (d2 - r2)) & ((1 - psin2[i]) * (d2 - r2) >= psin2[i] * r2);
+            outside += !in;
+            backfacing += in & away;
+            pvisible[i] = (uint8_t)(in & !away);
+        }
+
+        counts.clear();
+        firsts.clear();
+        long long drawn = 0;
+        for (int i = 0; i < count; i++) {
+            if (!visible[i]) continue;
+            drawn += indexCount[i] / 3;
+            if (!firsts.empty() && firsts.back() + counts.back() == firstIndex[i]) counts.back() += indexCount[i];
+            else {
+                firsts.push_back(firstIndex[i]);
+                counts.push_back(indexCount[i]);
+            }
+        }
+        stats.meshlets += count;
+        stats.outside += outside;
+        stats.backfacing += backfacing;
+        stats.triangles += totalTriangles;
+        stats.drawn += drawn;
+        return drawn;
+    }
+};
@@ -0,0 +1,265 @@
+//=============================================================================================
+// Walkable areas of the terrain for agents: a grid of cells over a square of parameter space, walkable
+// where the slope is at most maxSlope, neighbouring walkable cells connected when their heights differ
+// by at most maxStep, and the connected regions labelled.
+// The grid is stored tile by tile. Every tile is sampled and labelled on its own, in parallel, into
+// compact local components; a lock-free union-find over the components joined across tile borders
+// then gives the regions. When the terrain of a tile changes only that tile is sampled again and only
+// the union over components, which are few next to the cells, runs again.
+// Labels do not depend on the thread count: the root of a set is its smallest component and regions
+// are numbered in the order of their roots.
+// Nothing here touches OpenGL.
+//=============================================================================================
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "jobs.h"
+#include "largebuffer.h"
+
+// heights and slopes (rise over run in world units) at the n x n points (u0 + j * step, v0 + i * step), row-major
+typedef std::function<void(double u0, double v0, double step, int n, float * height, float * slope)> NavSampler;
+
+struct NavGridOptions {
+    double u0 = 0, v0 = 0, size = 1;    // square of parameter space covered
+    int resolution = 1024;              // cells along a side
+    int tileCells = 128;                // tile edge in cells, 8..255
+    float maxSlope = 1;                 // tangent of the steepest walkable incline, 45 degrees
+    float maxStep = 0.1f;               // greatest height difference of neighbouring cells an agent climbs
+    int threads = 0;                    // 0: one per core
+    HugePages pages = TransparentHugePages;
+};
+
+//---------------------------
+class NavGrid {
+//---------------------------
+    static const uint16_t blocked = 0xFFFF;
+
+    struct Tile {
+        int components = 0;
+        std::vector<int> cells;                             // cell count of every component
+        std::vector<std::pair<uint16_t, uint16_t>> east, south;  // (own component, neighbour's) joined across the border
+    };
+
+    NavGridOptions options;
+    NavSampler sampler;
+    int T = 0, tilesPerSide = 0;        // T: tile edge in cells
+    double step = 0;                    // cell edge in parameter space
+    LargeBuffer<float> height;          // tile after tile, rows of T inside a tile
+    LargeBuffer<uint16_t> local;        // component of the cell in its tile, blocked if not walkable
+    std::vector<Tile> tiles;
+
+    // union over the components of all tiles, component c of tile t is base[t] + c
+    std::vector<int> base, componentRegion;
+    std::unique_ptr<std::atomic<int>[]> parent;
+    std::vector<long long> regionCells;
+
+    size_t CellIndex(int x, int y) const {
+        int tx = x / T, ty = y / T;
+        return ((size_t)ty * tilesPerSide + tx) * T * T + (y - ty * T) * T + (x - tx * T);
+    }
+    bool Joined(size_t a, size_t b) const {
+        return local[a] != blocked && local[b] != blocked && fabsf(height[a] - height[b]) <= options.maxStep;
+    }
+
+    // samples tile t and labels its connected components in scan order
+    void BuildTile(int t) {
+        const int tx = t % tilesPerSide, ty = t / tilesPerSide;
+        float * h = &height[(size_t)t * T * T];
+        uint16_t * label = &local[(size_t)t * T * T];
+        std::vector<float> slope(T * T);
+        sampler(options.u0 + (tx * T + 0.5) * step, options.v0 + (ty * T + 0.5) * step, step, T, h, slope.data());
+
+        // union-find on the cells of the tile; cells past the end of the grid are blocked
+        std::vector<int> up(T * T);
+        auto find = [&](int c) {
+            while (up[c] != c) c = up[c] = up[up[c]];
+            return c;
+        };
+        auto join = [&](int a, int b) {
+            a = find(a);
+            b = find(b);
+            if (a != b) up[std::max(a, b)] = std::min(a, b);
+        };
+        for (int i = 0; i < T; i++) {
+            for (int j = 0; j < T; j++) {
+                int c = i * T + j;
+                up[c] = c;
+                bool inside = tx * T + j < options.resolution && ty * T + i < options.resolution;
+                label[c] = inside && slope[c] <= options.maxSlope ? 0 : blocked;
+                if (label[c] == blocked) continue;
+                if (j > 0 && label[c - 1] != blocked && fabsf(h[c] - h[c - 1]) <= options.maxStep) join(c, c - 1);
+                if (i > 0 && label[c - T] != blocked && fabsf(h[c] - h[c - T]) <= options.maxStep) join(c, c - T);
+            }
+        }
+        Tile& tile = tiles[t];
+        tile.cells.clear();
+        std::vector<int> component(T * T);
+        for (int c = 0; c < T * T; c++) {      // a root is the smallest cell of its set, so it comes first
+            if (label[c] == blocked) continue;
+            int root = find(c);
+            if (root == c) {
+                component[c] = (int)tile.cells.size();
+                tile.cells.push_back(0);
+            }
+            label[c] = (uint16_t)component[root];
+            tile.cells[component[root]]++;
+        }
+        tile.components = (int)tile.cells.size();
+    }
+
+    // components of tile t joined to those of its east and south neighbours
+    void LinkTile(int t) {
+        const int tx = t % tilesPerSide, ty = t / tilesPerSide;
+        Tile& tile = tiles[t];
+        tile.east.clear();
+        tile.south.clear();
+        const size_t own = (size_t)t * T * T;
+        if (tx + 1 < tilesPerSide) {
+            const size_t other = own + (size_t)T * T;
+            for (int i = 0; i < T; i++) {
+                size_t a = own + i * T + T - 1, b = other + i * T;
+                if (Joined(a, b)) tile.east.push_back({ local[a], local[b] });
+            }
+        }
+        if (ty + 1 < tilesPerSide) {
+            const size_t other = own + (size_t)tilesPerSide * T * T;
+            for (int j = 0; j < T; j++) {
+                size_t a = own + (T - 1) * T + j, b = other + j;
+                if (Joined(a, b)) tile.south.push_back({ local[a], local[b] });
+            }
+        }
+        for (auto * links : { &tile.east, &tile.south }) {
+            std::sort(links->begin(), links->end());
+            links->erase(std::unique(links->begin(), links->end()), links->end());
+        }
+    }
+
+    int Find(int x) {
+        for (;;) {
+            int p = parent[x].load(std::memory_order_relaxed);
+            if (p == x) return x;
+            int grand = parent[p].load(std::memory_order_relaxed);
+            if (grand != p) parent[x].compare_exchange_weak(p, grand, std::memory_order_relaxed);   // path halving
+            x = grand;
+        }
+    }
+
+    // the larger root goes under the smaller one, which cannot make cycles however the threads interleave
+    void Union(int a, int b) {
+        for (;;) {
+            a = Find(a);
+            b = Find(b);
+            if (a == b) return;
+            if (a > b) std::swap(a, b);
+            int expected = b;
+            if (parent[b].compare_exchange_strong(expected, a, std::memory_order_relaxed)) return;
+        }
+    }
+
+    // regions from the components and links of all tiles
+    void Resolve() {
+        const int nTiles = (int)tiles.size();
+        base.resize(nTiles + 1);
+        base[0] = 0;
+        for (int t = 0; t < nTiles; t++) base[t + 1] = base[t] + tiles[t].components;
+        const int total = base[nTiles];
+        parent.reset(new std::atomic<int>[std::max(total, 1)]);
+        componentRegion.assign(total, -1);
+        parallelFor(nTiles, [&](int t) {
+            for (int c = base[t]; c < base[t + 1]; c++) parent[c].store(c, std::memory_order_relaxed);
+        }, options.threads);
+        parallelFor(nTiles, [&](int t) {
+            for (const auto& link : tiles[t].east) Union(base[t] + link.first, base[t + 1] + link.second);
+            for (const auto& link : tiles[t].south) Union(base[t] + link.first, base[t + tilesPerSide] + link.second);
+        }, options.threads);
+
+        // roots numbered in order: a count per tile, a prefix sum, then the labels
+        std::vector<int> roots(nTiles + 1, 0);
+        parallelFor(nTiles, [&](int t) {
+            for (int c = base[t]; c < base[t + 1]; c++) roots[t + 1] += Find(c) == c;
+        }, options.threads);
+        for (int t = 0; t < nTiles; t++) roots[t + 1] += roots[t];
+        parallelFor(nTiles, [&](int t) {
+            int region = roots[t];
+            for (int c = base[t]; c < base[t + 1]; c++)
+                if (Find(c) == c) componentRegion[c] = region++;
+        }, options.threads);
+        parallelFor(nTiles, [&](int t) {
+            for (int c = base[t]; c < base[t + 1]; c++) componentRegion[c] = componentRegion[Find(c)];
+        }, options.threads);
+
+        regionCells.assign(roots[nTiles], 0);
+        for (int t = 0; t < nTiles; t++)
+            for (int c = 0; c < tiles[t].components; c++) regionCells[componentRegion[base[t] + c]] += tiles[t].cells[c];
+    }
+
+public:
+    // samples the whole grid; false if the memory cannot be had
+    bool Build(const NavGridOptions& _options, const NavSampler& _sampler) {
+        options = _options;
+        sampler = _sampler;
+        options.resolution = std::max(options.resolution, 1);
+        T = std::min(std::max(options.tileCells, 8), 255);    // local labels below blocked: 255 * 255 < 0xFFFF
+        tilesPerSide = (options.resolution + T - 1) / T;
+        step = options.size / options.resolution;
+        const size_t cells = (size_t)tilesPerSide * tilesPerSide * T * T;
+        if (!height.Allocate(cells, options.pages) || !local.Allocate(cells, options.pages)) return false;
+        tiles.assign(tilesPerSide * tilesPerSide, Tile());
+        // a tile at a time, so the pages of a tile are first written by the thread that samples it
+        parallelFor((int)tiles.size(), [&](int t) { BuildTile(t); }, options.threads);
+        parallelFor((int)tiles.size(), [&](int t) { LinkTile(t); }, options.threads);
+        Resolve();
+        return true;
+    }
+
+    // samples again the tiles that overlap [u0, u1] x [v0, v1] of parameter space, after the terrain
+    // there changed, and updates the regions; returns the number of tiles rebuilt
+    int Rebuild(double u0, double v0, double u1, double v1) {
+        if (tiles.empty()) return 0;
+        auto tileOf = [&](double p, double origin) {
+            return std::min(std::max((int)floor((p - origin) / (step * T)), 0), tilesPerSide - 1);
+        };
+        int tx0 = tileOf(u0, options.u0), tx1 = tileOf(u1, options.u0), ty0 = tileOf(v0, options.v0), ty1 = tileOf(v1, options.v0);
+        std::vector<int> changed, relink;
+        for (int ty = ty0; ty <= ty1; ty++)
+            for (int tx = tx0; tx <= tx1; tx++) changed.push_back(ty * tilesPerSide + tx);
+        // links of a changed tile and of its west and north neighbours, which point into it
+        for (int ty = std::max(ty0 - 1, 0); ty <= ty1; ty++)
+            for (int tx = std::max(tx0 - 1, 0); tx <= tx1; tx++) relink.push_back(ty * tilesPerSide + tx);
+        parallelFor((int)changed.size(), [&](int i) { BuildTile(changed[i]); }, options.threads);
+        parallelFor((int)relink.size(), [&](int i) { LinkTile(relink[i]); }, options.threads);
+        Resolve();
+        return (int)changed.size();
+    }
+
+    int Resolution() const { return options.resolution; }
+    int TilesPerSide() const { return tilesPerSide; }
+    int Regions() const { return (int)regionCells.size(); }
+    long long RegionCells(int region) const { return regionCells[region]; }
+
+    // cell (x, y) covers parameter space from (u0 + x * size / resolution, v0 + y * size / resolution)
+    bool Walkable(int x, int y) const { return local[CellIndex(x, y)] != blocked; }
+    float Height(int x, int y) const { return height[CellIndex(x, y)]; }
+    int Region(int x, int y) const {
+        size_t c = CellIndex(x, y);
+        return local[c] == blocked ? -1 : componentRegion[base[c / ((size_t)T * T)] + local[c]];
+    }
+    bool Reachable(int x0, int y0, int x1, int y1) const {
+        int region = Region(x0, y0);
+        return region >= 0 && region == Region(x1, y1);
+    }
+
+    // region of every cell, -1 where not walkable, row-major into resolution x resolution ints
+    void RegionGrid(int * out) const {
+        const int n = options.resolution;
+        parallelFor(n, [&](int y) {
+            for (int x = 0; x < n; x++) out[(size_t)y * n + x] = Region(x, y);
+        }, options.threads);
+    }
+};
@@ -0,0 +1,284 @@
+//=============================================================================================
+// Procedural textures: a generator is evaluated in tiles of 64 x 64 texels on every core, a row of a tile
+// at a time into one array per channel, so the loops of the generators run over contiguous floats and the
+// compiler vectorizes them, and the rows are packed straight into the texel format the GPU takes, RGBA8
+// or R16, with no float image in between. A texture may be cached on disk under a hash of everything it
+// depends on: the key of the generator, the size, the format and the version of the generators' code.
+// Building it again with the same key reads the file instead of evaluating anything; the key is stored
+// in the file too, so a hash collision only costs an evaluation.
+// Nothing here touches OpenGL.
+//=============================================================================================
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "jobs.h"
+#include "noise.h"
+
+enum TexelFormat {
+    TexelRGBA8,     // 4 bytes, red, green, blue, alpha
+    TexelR16        // 2 bytes, the red channel only
+};
+
+inline int texelBytes(TexelFormat format) { return format == TexelRGBA8 ? 4 : 2; }
+
+// the channels of the texels of a row, values in [0, 1]
+struct TexelRow {
+    float * r, * g, * b, * a;
+};
+
+//---------------------------
+class TextureGenerator {
+//---------------------------
+public:
+    static const int maxRow = 256;      // most texels Row() is asked for at once
+
+    // texels (x0 + i, y), i < count, of a width x height texture; texel (x, y) is at
+    // u = (x + 0.5) / width, v = (y + 0.5) / height. Called from several threads at once.
+    virtual void Row(int x0, int y, int count, int width, int height, const TexelRow& out) const = 0;
+
+    // everything the texels depend on besides the size, for the cache
+    virtual std::string Key() const = 0;
+
+    virtual ~TextureGenerator() {}
+
+protected:
+    // floats in keys with all their digits, so generators that differ anywhere have different keys
+    static std::string Float(float f) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.9g", f);
+        return text;
+    }
+    static std::string Color(const float * c) {
+        return Float(c[0]) + "," + Float(c[1]) + "," + Float(c[2]) + "," + Float(c[3]);
+    }
+    static void Mix(const float * c0, const float * c1, int count, const float * t, const TexelRow& out) {
+        for (int i = 0; i < count; i++) {
+            out.r[i] = c0[0] + (c1[0] - c0[0]) * t[i];
+            out.g[i] = c0[1] + (c1[1] - c0[1]) * t[i];
+            out.b[i] = c0[2] + (c1[2] - c0[2]) * t[i];
+            out.a[i] = c0[3] + (c1[3] - c0[3]) * t[i];
+        }
+    }
+};
+
+//---------------------------
+class CheckerGenerator : public TextureGenerator {
+//---------------------------
+    int cell;
+    float colors[2][4];
+public:
+    // squares of cell x cell texels, color0 at the origin
+    CheckerGenerator(int _cell, const float * color0, const float * color1) : cell(std::max(_cell, 1)) {
+        memcpy(colors[0], color0, sizeof(colors[0]));
+        memcpy(colors[1], color1, sizeof(colors[1]));
+    }
+    void Row(int x0, int y, int count, int width, int height, const TexelRow& out) const {
+        float t[maxRow];
+        const int odd = y / cell & 1;
+        for (int i = 0; i < count; i++) t[i] = (float)(((x0 + i) / cell & 1) ^ odd);
+        Mix(colors[0], colors[1], count, t, out);
+    }
+    std::string Key() const { return "checker " + std::to_string(cell) + " " + Color(colors[0]) + " " + Color(colors[1]); }
+};
+
+//---------------------------
+class GradientGenerator : public TextureGenerator {
+//---------------------------
+    float angle, colors[2][4];
+public:
+    // color0 to color1 across the texture in the direction angle (radians, 0: along u), through its center
+    GradientGenerator(float _angle, const float * color0, const float * color1) : angle(_angle) {
+        memcpy(colors[0], color0, sizeof(colors[0]));
+        memcpy(colors[1], color1, sizeof(colors[1]));
+    }
+    void Row(int x0, int y, int count, int width, int height, const TexelRow& out) const {
+        // t = 0.5 + ((u, v) - 0.5) . direction / extent, where extent is the span of the square along it
+        float cx = cosf(angle), cy = sinf(angle), extent = fabsf(cx) + fabsf(cy);
+        float du = cx / extent / width, base = 0.5f + (((y + 0.5f) / height - 0.5f) * cy - 0.5f * cx) / extent;
+        float t[maxRow];
+        for (int i = 0; i < count; i++) t[i] = std::min(std::max(base + (x0 + i + 0.5f) * du, 0.0f), 1.0f);
+        Mix(colors[0], colors[1], count, t, out);
+    }
+    std::string Key() const { return "gradient " + Float(angle) + " " + Color(colors[0]) + " " + Color(colors[1]); }
+};
+
+//---------------------------
+class NoiseGenerator : public TextureGenerator {
+//---------------------------
+    unsigned int seed;
+    NoiseOptions options;
+    float colors[2][4];
+public:
+    // the gradient noise of the terrain over the texture, heights -1..1 mapped from color0 to color1
+    NoiseGenerator(unsigned int _seed, const NoiseOptions& _options, const float * color0, const float * color1)
+        : seed(_seed), options(_options) {
+        memcpy(colors[0], color0, sizeof(colors[0]));
+        memcpy(colors[1], color1, sizeof(colors[1]));
+    }
+    void Row(int x0, int y, int count, int width, int height, const TexelRow& out) const {
+        float u[maxRow], v[maxRow], h[maxRow], dx[maxRow], dy[maxRow];
+        for (int i = 0; i < count; i++) {
+            u[i] = (x0 + i + 0.5f) / width;
+            v[i] = (y + 0.5f) / height;
+        }
+        gradientNoise(seed, options, count, u, v, h, dx, dy);
+        for (int i = 0; i < count; i++) h[i] = std::min(std::max(h[i] * 0.5f + 0.5f, 0.0f), 1.0f);
+        Mix(colors[0], colors[1], count, h, out);
+    }
+    std::string Key() const {
+        return "noise " + std::to_string(seed) + " " + std::to_string(options.octaves) + " " + Float(options.frequency) + " " +
+               Float(options.amplitude) + " " + Float(options.lacunarity) + " " + Float(options.gain) + " " +
+               Color(colors[0]) + " " + Color(colors[1]);
+    }
+};
+
+//---------------------------
+class SplatGenerator : public TextureGenerator {
+//---------------------------
+// One disc per cell of a cells x cells grid, at a hashed position with a hashed radius of up to
+// maxRadius cells, so a texel needs only the discs of its own and the 8 neighbouring cells
+    unsigned int seed;
+    int cells;
+    float maxRadius, colors[2][4];
+public:
+    // discs of color1 with soft edges over color0
+    SplatGenerator(unsigned int _seed, int _cells, float _maxRadius, const float * color0, const float * color1)
+        : seed(_seed), cells(std::max(_cells, 1)), maxRadius(std::min(std::max(_maxRadius, 0.0f), 1.0f)) {
+        memcpy(colors[0], color0, sizeof(colors[0]));
+        memcpy(colors[1], color1, sizeof(colors[1]));
+    }
+    void Row(int x0, int y, int count, int width, int height, const TexelRow& out) const {
+        // the discs of the cells under the row and around it, each over the texels it reaches
+        float t[maxRow];
+        for (int i = 0; i < count; i++) t[i] = 0;
+        const float scale = (float)cells / width, v = (y + 0.5f) / height * cells;
+        const int cy = std::min((int)v, cells - 1);
+        const int cx0 = std::min((int)((x0 + 0.5f) * scale), cells - 1) - 1;
+        const int cx1 = std::min((int)((x0 + count - 0.5f) * scale), cells - 1) + 1;
+        for (int ny = cy - 1; ny <= cy + 1; ny++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                unsigned int hash = noiseHash(cx, ny, seed);
+                float px = cx + (float)(hash & 0x3FF) / 1023, py = ny + (float)(hash >> 10 & 0x3FF) / 1023;
+                float radius = maxRadius * (0.25f + 0.75f * (float)(hash >> 20 & 0x3FF) / 1023);
+                float dy = v - py, reach2 = radius * radius - dy * dy;
+                if (reach2 <= 0) continue;
+                float reach = sqrtf(reach2);
+                int i0 = std::max((int)floorf((px - reach) / scale - 0.5f) - x0, 0);
+                int i1 = std::min((int)ceilf((px + reach) / scale - 0.5f) - x0 + 1, count);
+                const float rim = 1 / (0.2f * radius);
+                for (int i = i0; i < i1; i++) {
+                    float dx = (x0 + i + 0.5f) * scale - px, d = sqrtf(dx * dx + dy * dy);
+                    t[i] = std::max(t[i], std::min(std::max((radius - d) * rim, 0.0f), 1.0f));   // soft rim
+                }
+            }
+        }
+        Mix(colors[0], colors[1], count, t, out);
+    }
+    std::string Key() const {
+        return "splat " + std::to_string(seed) + " " + std::to_string(cells) + " " + Float(maxRadius) + " " +
+               Color(colors[0]) + " " + Color(colors[1]);
+    }
+};
+
+struct ProcTextureOptions {
+    int width = 256, height = 256;
+    TexelFormat format = TexelRGBA8;
+    int tile = 64;                      // tile edge in texels, up to TextureGenerator::maxRow
+    int threads = 0;                    // 0: one per core
+    std::string cacheDirectory;         // empty: no cache
+};
+
+// Raise when a generator or the packing makes different texels for the same key, so older cache files
+// no longer match
+const int textureCacheVersion = 1;
+
+// everything the texels of a texture depend on
+inline std::string textureCacheKey(const TextureGenerator& generator, const ProcTextureOptions& options) {
+    return "v" + std::to_string(textureCacheVersion) + " " + generator.Key() + " " + std::to_string(std::max(options.width, 1)) + "x" + std::to_string(std::max(options.height, 1)) +
+           (options.format == TexelRGBA8 ? " rgba8" : " r16");
+}
+
+// FNV-1a of the key, as the file name in the cache
+inline std::string textureCachePath(const std::string& directory, const std::string& key) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (unsigned char c : key) hash = (hash ^ c) * 0x100000001B3ull;
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.tex", (unsigned long long)hash);
+    return (std::filesystem::path(directory) / name).string();
+}
+
+// the texels of the generator, row after row from y = 0 as glTexImage2D takes them; cached tells if
+// they came from the cache
+inline std::vector<uint8_t> synthesizeTexture(const TextureGenerator& generator, const ProcTextureOptions& options,
+                                              bool * cached = nullptr) {
+    const int W = std::max(options.width, 1), H = std::max(options.height, 1), bytes = texelBytes(options.format);
+    std::vector<uint8_t> texels((size_t)W * H * bytes);
+    std::string key, path;
+    if (cached) *cached = false;
+    if (!options.cacheDirectory.empty()) {
+        key = textureCacheKey(generator, options);
+        path = textureCachePath(options.cacheDirectory, key);
+        if (FILE * file = fopen(path.c_str(), "rb")) {
+            uint32_t length = 0;
+            std::string stored;
+            bool ok = fread(&length, sizeof(length), 1, file) == 1 && length == key.size();
+            if (ok) {
+                stored.resize(length);
+                ok = fread(&stored[0], 1, length, file) == length && stored == key &&
+                     fread(texels.data(), 1, texels.size(), file) == texels.size();
+            }
+            fclose(file);
+            if (ok) {
+                if (cached) *cached = true;
+                return texels;
+            }
+        }
+    }
+
+    const int T = std::min(std::max(options.tile, 8), (int)TextureGenerator::maxRow);
+    const int tilesX = (W + T - 1) / T, tilesY = (H + T - 1) / T;
+    parallelFor(tilesX * tilesY, [&](int t) {
+        const int x0 = t % tilesX * T, y0 = t / tilesX * T, count = std::min(T, W - x0);
+        float r[TextureGenerator::maxRow], g[TextureGenerator::maxRow], b[TextureGenerator::maxRow], a[TextureGenerator::maxRow];
+        const TexelRow row = { r, g, b, a };
+        for (int y = y0; y < std::min(y0 + T, H); y++) {
+            generator.Row(x0, y, count, W, H, row);
+            uint8_t * out = &texels[((size_t)y * W + x0) * bytes];
+            if (options.format == TexelRGBA8) {
+                for (int i = 0; i < count; i++) {
+                    out[i * 4 + 0] = (uint8_t)(std::min(std::max(r[i], 0.0f), 1.0f) * 255 + 0.5f);
+                    out[i * 4 + 1] = (uint8_t)(std::min(std::max(g[i], 0.0f), 1.0f) * 255 + 0.5f);
+                    out[i * 4 + 2] = (uint8_t)(std::min(std::max(b[i], 0.0f), 1.0f) * 255 + 0.5f);
+                    out[i * 4 + 3] = (uint8_t)(std::min(std::max(a[i], 0.0f), 1.0f) * 255 + 0.5f);
+                }
+            }
+            else {
+                uint16_t * out16 = (uint16_t *)out;
+                for (int i = 0; i < count; i++) out16[i] = (uint16_t)(std::min(std::max(r[i], 0.0f), 1.0f) * 65535 + 0.5f);
+            }
+        }
+    }, options.threads);
+
+    if (!path.empty()) {        // written aside and renamed, so a reader never sees half a file
+        std::error_code error;
+        std::filesystem::create_directories(options.cacheDirectory, error);
+        std::string temporary = path + ".tmp";
+        FILE * file = fopen(temporary.c_str(), "wb");
+        uint32_t length = (uint32_t)key.size();
+        bool ok = file && fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(key.data(), 1, length, file) == length &&
+                  fwrite(texels.data(), 1, texels.size(), file) == texels.size();
+        if (file) ok = fclose(file) == 0 && ok;
+        if (ok) std::filesystem::rename(temporary, path, error);
+        if (!ok || error) {
+            printf("Texture cache %s is not writable\n", options.cacheDirectory.c_str());
+            std::filesystem::remove(temporary, error);
+        }
+    }
+    return texels;
+}
@@ -0,0 +1,155 @@
+//=============================================================================================
+// Blue noise placement of instances (rocks, trees...): Poisson disk points at least a radius apart,
+// generated tile by tile in parallel with Bridson's algorithm and filtered by rules on the terrain.
+// Tiles are colored like a 2 x 2 checkerboard and the four colors run one after the other: tiles of one
+// color are never neighbours, so they fill in parallel, and every tile sees exactly the points of the
+// neighbours of earlier colors. With a random generator per tile seeded from its position the result
+// depends only on the seed, never on the number of threads or their timing.
+// Nothing here touches OpenGL.
+//=============================================================================================
+#pragma once
+#include <math.h>
+#include <random>
+#include <vector>
+#include "jobs.h"
+
+struct ScatterPoint {
+    float u, v;                 // parameter space
+    float h;                    // terrain height, left to the filter
+    unsigned int random;        // per instance random bits for scale, rotation...
+};
+
+struct ScatterOptions {
+    double u0 = 0, v0 = 0, u1 = 1, v1 = 1;  // domain in parameter space
+    float radius = 0.02f;       // least distance of two points
+    unsigned int seed = 0;
+    int tileCells = 32;         // tile edge in acceleration grid cells of radius / sqrt(2)
+    int attempts = 30;          // candidates around an active point before it retires (Bridson's k)
+    int threads = 0;            // 0: one per core
+};
+
+// Rectangle of a tile in parameter space, for the filter
+struct ScatterTile {
+    double u0, v0, u1, v1;
+};
+
+// Height and slope limits; slope is the tangent of the angle to the horizontal
+struct ScatterRule {
+    float minHeight = -INFINITY, maxHeight = INFINITY;
+    float minSlope = 0, maxSlope = INFINITY;
+    bool Accepts(float height, float slope) const {
+        return height >= minHeight && height <= maxHeight && slope >= minSlope && slope <= maxSlope;
+    }
+};
+
+inline unsigned int scatterHash(unsigned int seed, int x, int y) {
+    unsigned int h = seed ^ ((unsigned int)x * 0x9E3779B1u) ^ ((unsigned int)y * 0x85EBCA77u);
+    h ^= h >> 16; h *= 0x7FEB352Du;
+    h ^= h >> 15; h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return h;
+}
+
+//---------------------------
+class PoissonDiskScatter {
+//---------------------------
+    ScatterOptions options;
+    double cell;
+    int W, H, tilesU, tilesV;
+    std::vector<ScatterPoint> grid;     // at most one point per cell, u = NAN if empty
+    std::vector<std::vector<ScatterPoint>> tilePoints;
+
+    bool Fits(double u, double v, int cx0, int cy0, int cx1, int cy1) const {
+        if (u < options.u0 || u >= options.u1 || v < options.v0 || v >= options.v1) return false;
+        int cx = (int)((u - options.u0) / cell), cy = (int)((v - options.v0) / cell);
+        if (cx < cx0 || cx >= cx1 || cy < cy0 || cy >= cy1) return false;
+        if (!isnan(grid[cy * W + cx].u)) return false;
+        double r2 = (double)options.radius * options.radius;
+        for (int y = std::max(cy - 2, 0); y <= std::min(cy + 2, H - 1); y++) {
+            for (int x = std::max(cx - 2, 0); x <= std::min(cx + 2, W - 1); x++) {
+                const ScatterPoint& p = grid[y * W + x];
+                if (isnan(p.u)) continue;
+                double du = p.u - u, dv = p.v - v;
+                if (du * du + dv * dv < r2) return false;
+            }
+        }
+        return true;
+    }
+
+    // Bridson's algorithm on the cells of tile (tx, ty), started from a few random points
+    void Fill(int tx, int ty) {
+        std::mt19937 generator(scatterHash(options.seed, tx, ty));
+        auto uniform = [&]() { return (double)generator() / 4294967296.0; };
+        int cx0 = tx * options.tileCells, cy0 = ty * options.tileCells;
+        int cx1 = std::min(cx0 + options.tileCells, W), cy1 = std::min(cy0 + options.tileCells, H);
+        std::vector<ScatterPoint>& points = tilePoints[ty * tilesU + tx];
+        std::vector<int> active;
+        auto add = [&](double u, double v) {
+            ScatterPoint p = { (float)u, (float)v, 0, (unsigned int)generator() };
+            int cx = (int)((u - options.u0) / cell), cy = (int)((v - options.v0) / cell);
+            grid[cy * W + cx] = p;
+            active.push_back((int)points.size());
+            points.push_back(p);
+        };
+        const double r = options.radius;
+        for (int start = 0; start < 8; start++) {
+            double u = options.u0 + (cx0 + uniform() * (cx1 - cx0)) * cell, v = options.v0 + (cy0 + uniform() * (cy1 - cy0)) * cell;
+            if (Fits(u, v, cx0, cy0, cx1, cy1)) add(u, v);
+            while (!active.empty()) {
+                int a = (int)(uniform() * active.size());
+                const ScatterPoint center = points[active[a]];
+                bool placed = false;
+                for (int k = 0; k < options.attempts && !placed; k++) {
+                    double angle = uniform() * 2 * M_PI, distance = r * sqrt(1 + 3 * uniform());   // uniform in the annulus [r, 2r]
+                    double pu = center.u + cos(angle) * distance, pv = center.v + sin(angle) * distance;
+                    if (Fits(pu, pv, cx0, cy0, cx1, cy1)) {
+                        add(pu, pv);
+                        placed = true;
+                    }
+                }
+                if (!placed) {
+                    active[a] = active.back();
+                    active.pop_back();
+                }
+            }
+        }
+    }
+
+public:
+    // keep(tile, points) removes the points of a tile that fail the rules; it runs on worker threads,
+    // one call per tile, after every point is placed. The result is in tile order, deterministic.
+    template<class Keep> std::vector<ScatterPoint> Generate(const ScatterOptions& _options, Keep keep) {
+        options = _options;
+        if (options.tileCells < 4) options.tileCells = 4;   // same colored tiles must not see each other's points
+        cell = options.radius / sqrt(2.0);
+        W = std::max((int)ceil((options.u1 - options.u0) / cell), 1);
+        H = std::max((int)ceil((options.v1 - options.v0) / cell), 1);
+        tilesU = (W + options.tileCells - 1) / options.tileCells;
+        tilesV = (H + options.tileCells - 1) / options.tileCells;
+        grid.assign((size_t)W * H, ScatterPoint{ NAN, NAN, 0, 0 });
+        tilePoints.assign(tilesU * tilesV, std::vector<ScatterPoint>());
+
+        for (int color = 0; color < 4; color++) {
+            std::vector<int> tiles;
+            for (int ty = color / 2; ty < tilesV; ty += 2)
+                for (int tx = color % 2; tx < tilesU; tx += 2) tiles.push_back(ty * tilesU + tx);
+            parallelFor((int)tiles.size(), [&](int i) { Fill(tiles[i] % tilesU, tiles[i] / tilesU); }, options.threads);
+        }
+        parallelFor(tilesU * tilesV, [&](int t) {
+            int tx = t % tilesU, ty = t / tilesU;
+            double tileSize = options.tileCells * cell;
+            ScatterTile tile = { options.u0 + tx * tileSize, options.v0 + ty * tileSize,
+                                 std::min(options.u0 + (tx + 1) * tileSize, options.u1), std::min(options.v0 + (ty + 1) * tileSize, options.v1) };
+            keep(tile, tilePoints[t]);
+        }, options.threads);
+
+        std::vector<ScatterPoint> result;
+        size_t total = 0;
+        for (const std::vector<ScatterPoint>& points : tilePoints) total += points.size();
+        result.reserve(total);
+        for (const std::vector<ScatterPoint>& points : tilePoints) result.insert(result.end(), points.begin(), points.end());
+        std::vector<ScatterPoint>().swap(grid);
+        tilePoints.clear();
+        return result;
+    }
+};
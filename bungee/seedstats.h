@@ -0,0 +1,117 @@
+//=============================================================================================
+// Headless terrain statistics for batches of seeds, without building meshes
+// Sampled statistics come from a reduced resolution grid of the tile,
+// spectral ones directly from the amplitudes (they are full-period expectations).
+//=============================================================================================
+#pragma once
+#include <stdio.h>
+#include <vector>
+#include "terrain.h"
+#include "jobs.h"
+
+//---------------------------
+struct SeedStatsOptions {
+//---------------------------
+    double A = 0.5;         // amplitude constant of E
+    int n = 35;             // harmonics per axis
+    int resolution = 64;    // samples per axis of the reduced grid
+    int bins = 16;          // height histogram bins between min and max
+    int threads = 0;        // 0: one per hardware thread
+};
+
+//---------------------------
+struct SeedStats {
+//---------------------------
+    unsigned int seed;
+    double min, max, mean, rms;             // sampled heights, rms around the mean
+    double meanSlope, maxSlope;             // sampled |grad h| in world units (rise / run)
+    double spectralRms, spectralRmsSlope;   // from the amplitudes
+    double dominantWavelength;              // world space wavelength of the most energetic radial band
+    double meanWavelength;                  // energy weighted mean world space wavelength
+    std::vector<int> histogram;
+};
+
+// Statistics of a single seed; spectral statistics describe the sum before the spectrum's shaping
+template<class Spectrum = TerrainSpectrum>
+inline SeedStats computeSeedStats(unsigned int seed, const SeedStatsOptions& options) {
+    const int n = options.n, res = options.resolution;
+    // x = u * pi - pi, so one world unit is pi / terrainWorldSize radians of phase
+    const double worldPerRadian = terrainWorldSize / M_PI;
+
+    SeedStats stats;
+    stats.seed = seed;
+
+    std::vector<double> phases(terrainPhasesUsed(n));
+    seedTerrainPhases(seed, phases.data(), (int)phases.size());
+
+    // sampled statistics
+    std::vector<double> h(res * res), dx(res * res), dy(res * res);
+    terrainSampleGrid<Spectrum>(TablePhases(phases.data(), n), options.A, n, res, h.data(), dx.data(), dy.data());
+    stats.min = stats.max = h[0];
+    double sum = 0, sum2 = 0, slopeSum = 0, slopeMax = 0;
+    for (int i = 0; i < res * res; i++) {
+        if (h[i] < stats.min) stats.min = h[i];
+        if (h[i] > stats.max) stats.max = h[i];
+        sum += h[i];
+        sum2 += h[i] * h[i];
+        double slope = sqrt(dx[i] * dx[i] + dy[i] * dy[i]) / worldPerRadian;
+        slopeSum += slope;
+        if (slope > slopeMax) slopeMax = slope;
+    }
+    stats.mean = sum / (res * res);
+    stats.rms = sqrt(fmax(sum2 / (res * res) - stats.mean * stats.mean, 0));
+    stats.meanSlope = slopeSum / (res * res);
+    stats.maxSlope = slopeMax;
+
+    stats.histogram.assign(options.bins, 0);
+    double range = stats.max - stats.min;
+    for (int i = 0; i < res * res; i++) {
+        int bin = range > 0 ? (int)((h[i] - stats.min) / range * options.bins) : 0;
+        stats.histogram[bin < options.bins ? bin : options.bins - 1]++;
+    }
+
+    // spectral statistics: every harmonic contributes E^2 / 2 to the variance
+    std::vector<double> bandEnergy(n * 2 + 2, 0);
+    double energy = 0, slopeEnergy = 0, wavelengthSum = 0;
+    for (int one = 0; one <= n; one++) {
+        for (int two = 0; two <= n; two++) {
+            double e = Spectrum::amplitude(options.A, one, two, n), k = sqrt(one * one + two * two);
+            if (e == 0) continue;
+            double var = e * e / 2;
+            energy += var;
+            slopeEnergy += var * k * k;
+            wavelengthSum += var * 2 * M_PI / k * worldPerRadian;
+            bandEnergy[(int)(k + 0.5)] += var;
+        }
+    }
+    int dominantBand = 1;
+    for (int band = 1; band < (int)bandEnergy.size(); band++)
+        if (bandEnergy[band] > bandEnergy[dominantBand]) dominantBand = band;
+    stats.spectralRms = sqrt(energy);
+    stats.spectralRmsSlope = sqrt(slopeEnergy) / worldPerRadian;
+    stats.dominantWavelength = 2 * M_PI / dominantBand * worldPerRadian;
+    stats.meanWavelength = energy > 0 ? wavelengthSum / energy : 0;
+    return stats;
+}
+
+// Statistics of seeds first, first + 1, ..., first + count - 1, computed in parallel
+template<class Spectrum = TerrainSpectrum>
+inline std::vector<SeedStats> computeSeedStats(unsigned int first, int count, const SeedStatsOptions& options) {
+    std::vector<SeedStats> results(count);
+    parallelFor(count, [&](int i) { results[i] = computeSeedStats<Spectrum>(first + i, options); }, options.threads);
+    return results;
+}
+
+inline void writeSeedStatsCsv(FILE * file, const std::vector<SeedStats>& results) {
+    fprintf(file, "seed,min,max,mean,rms,mean_slope,max_slope,spectral_rms,spectral_rms_slope,"
+                  "dominant_wavelength,mean_wavelength");
+    int bins = results.empty() ? 0 : (int)results[0].histogram.size();
+    for (int b = 0; b < bins; b++) fprintf(file, ",hist%d", b);
+    fprintf(file, "\n");
+    for (const SeedStats& s : results) {
+        fprintf(file, "%u,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g", s.seed, s.min, s.max, s.mean, s.rms,
+                s.meanSlope, s.maxSlope, s.spectralRms, s.spectralRmsSlope, s.dominantWavelength, s.meanWavelength);
+        for (int count : s.histogram) fprintf(file, ",%d", count);
+        fprintf(file, "\n");
+    }
+}
@@ -0,0 +1,285 @@
+//=============================================================================================
+// Fourier terrain shared by the renderer and the headless tools
+// h(x, y) = sum over 0 <= k1, k2 <= n of E(A, k1, k2) * cos(k1 x + k2 y + phase[k1 * n + k2])
+// where the amplitude law, frequency set, phase source and output shape are policies.
+// The unit parameter square [0,1]^2 is mapped to [-pi, 0]^2, i.e. a quarter of the period.
+// Nothing here touches OpenGL.
+//=============================================================================================
+#pragma once
+#define _USE_MATH_DEFINES		// M_PI
+#include <math.h>
+#include <complex>
+#include <random>
+#include <string>
+#include <vector>
+
+// Size of the phase table the application allocates
+const int terrainPhaseCount = 1000 * 1000;
+
+// Width of the terrain tile in world space (ParamSurface maps u, v in [0,1] onto it)
+const float terrainWorldSize = 15;
+
+// Amplitude of harmonic (one, two): A / |k|, the constant term is dropped
+inline double E(double A, int one, int two) {
+    return one + two == 0 ? 0 : A / sqrt(powf(one, 2) + powf( two, 2));
+}
+
+// Number of phase table entries read by a terrain of n harmonics per axis
+inline int terrainPhasesUsed(int n) { return n * n + n + 1; }
+
+// Fills the phase table deterministically from a seed, uniform in [0, 500]: the top draw of the generator gives 500 itself
+inline void seedTerrainPhases(unsigned int seed, double* phases, int count) {
+    std::mt19937 generator(seed);
+    for (int i = 0; i < count; i++)
+        phases[i] = (double)generator() / std::mt19937::max() * 500;
+}
+
+//---------------------------
+// Spectrum policies: amplitude law, frequency set and output shape are static members,
+// so every combination is compiled into its own inner loop with the choices folded in.
+//---------------------------
+
+// A / |k|: the classic look
+struct InverseFrequency {
+    static double amplitude(double A, int one, int two) { return E(A, one, two); }
+};
+
+// A / |k|^2: smoother, rolling hills
+struct InverseSquareFrequency {
+    static double amplitude(double A, int one, int two) {
+        return one + two == 0 ? 0 : A / (one * one + two * two);
+    }
+};
+
+// A / |k| restricted to the band low <= |k| <= high
+template<int low, int high> struct BandPass {
+    static double amplitude(double A, int one, int two) {
+        int k2 = one * one + two * two;
+        return k2 < low * low || k2 > high * high ? 0 : A / sqrt((double)k2);
+    }
+};
+
+// Every harmonic with 0 <= k1, k2 <= n
+struct SquareFrequencies {
+    static bool contains(int one, int two, int n) { return true; }
+};
+
+// Only harmonics with |k| <= n, which removes the diagonal bias of the square
+struct DiscFrequencies {
+    static bool contains(int one, int two, int n) { return one * one + two * two <= n * n; }
+};
+
+// The sum itself
+struct LinearShape {
+    static void apply(double& height, double& dx, double& dy) {}
+    static const char * glsl() { return ""; }  // the same on float h and vec2 g, for GPU evaluators
+};
+
+// -|sum|: sharp crests along the zero crossings of the sum
+struct RidgedShape {
+    static void apply(double& height, double& dx, double& dy) {
+        if (height > 0) { height = -height; dx = -dx; dy = -dy; }
+    }
+    static const char * glsl() { return "if (h > 0.0) { h = -h; g = -g; }"; }
+};
+
+template<class Amplitude, class Frequencies = SquareFrequencies, class Shape = LinearShape>
+struct FourierSpectrum {
+    static double amplitude(double A, int one, int two, int n) {
+        return Frequencies::contains(one, two, n) ? Amplitude::amplitude(A, one, two) : 0;
+    }
+    static void shape(double& height, double& dx, double& dy) { Shape::apply(height, dx, dy); }
+    static const char * shapeGLSL() { return Shape::glsl(); }
+};
+
+typedef FourierSpectrum<InverseFrequency>                               TerrainSpectrum;    // the original terrain
+typedef FourierSpectrum<InverseSquareFrequency>                         SmoothSpectrum;
+typedef FourierSpectrum<BandPass<4, 16>, DiscFrequencies>               BandPassSpectrum;
+typedef FourierSpectrum<InverseFrequency, SquareFrequencies, RidgedShape> RidgedSpectrum;
+
+// Calls f(Spectrum()) with the spectrum named by style ("classic", "smooth", "bandpass" or "ridged"),
+// so a runtime choice selects a compiled instantiation once instead of branching per harmonic.
+// Returns false for an unknown name.
+template<class F> bool withTerrainSpectrum(const std::string& style, F f) {
+    if (style == "classic") f(TerrainSpectrum());
+    else if (style == "smooth") f(SmoothSpectrum());
+    else if (style == "bandpass") f(BandPassSpectrum());
+    else if (style == "ridged") f(RidgedSpectrum());
+    else return false;
+    return true;
+}
+
+//---------------------------
+// Phase sources
+//---------------------------
+
+// Phases read from a table filled by seedTerrainPhases
+struct TablePhases {
+    const double* phases;
+    int n;
+    TablePhases(const double* _phases, int _n) : phases(_phases), n(_n) {}
+    double operator()(int one, int two) const { return phases[one * n + two]; }
+};
+
+// Phases hashed from the seed and the wave vector, no table needed
+struct HashPhases {
+    unsigned int seed;
+    HashPhases(unsigned int _seed) : seed(_seed) {}
+    double operator()(int one, int two) const {
+        unsigned int h = seed ^ ((unsigned int)one * 0x9E3779B1u) ^ ((unsigned int)two * 0x85EBCA77u);
+        h ^= h >> 16; h *= 0x7FEB352Du;
+        h ^= h >> 15; h *= 0x846CA68Bu;
+        h ^= h >> 16;
+        return h * (2 * M_PI / 4294967296.0);
+    }
+};
+
+// Height and parameter space gradient of the terrain at (x, y) in [0,1]^2
+template<class Spectrum, class Phases>
+inline void terrainSample(const Phases& phase, double A, int n, float x, float y,
+                          double& height, double& dx, double& dy) {
+    x = x * M_PI - M_PI;
+    y = y * M_PI - M_PI;
+    double total = 0;
+
+    for (float one = 0; one <= n; one++) {
+        for (float two = 0; two <= n; two++) {
+            double e= Spectrum::amplitude(A, one, two, n);
+            double c = cosf(one * x + two * y + phase(one, two));
+            total += e * c;
+        }
+    }
+
+    height = total;
+
+    dx = 0;
+
+    for (float one = 0; one <= n; one++) {
+        for (float two = 0; two <= n; two++) {
+            double e= Spectrum::amplitude(A, one, two, n);
+            double c = -1 * sinf(one * x + two * y + phase(one, two)) * one;
+            dx += e * c;
+        }
+    }
+
+    dy = 0;
+
+    for (float one = 0; one <= n; one++) {
+        for (float two = 0; two <= n; two++) {
+            double e= Spectrum::amplitude(A, one, two, n);
+            double c = -1 * sinf(one * x + two * y + phase(one, two)) * two;
+            dy += e * c;
+        }
+    }
+
+    Spectrum::shape(height, dx, dy);
+}
+
+// Height only: the first of the three passes of terrainSample
+template<class Spectrum, class Phases>
+inline double terrainHeight(const Phases& phase, double A, int n, float x, float y) {
+    x = x * M_PI - M_PI;
+    y = y * M_PI - M_PI;
+    double total = 0;
+
+    for (float one = 0; one <= n; one++) {
+        for (float two = 0; two <= n; two++) {
+            double e= Spectrum::amplitude(A, one, two, n);
+            double c = cosf(one * x + two * y + phase(one, two));
+            total += e * c;
+        }
+    }
+
+    double dx = 0, dy = 0;
+    Spectrum::shape(total, dx, dy);
+    return total;
+}
+
+// The original terrain from a phase table
+inline void terrainSample(const double* phases, double A, int n, float x, float y,
+                          double& height, double& dx, double& dy) {
+    terrainSample<TerrainSpectrum>(TablePhases(phases, n), A, n, x, y, height, dx, dy);
+}
+
+// Height and gradient at the points (u0 + spanU * j / (resU - 1), v0 + spanV * i / (resV - 1)), j < resU,
+// of the rows rowBegin <= i < rowEnd, handed to output(i, j, height, dx, dy) as they are computed.
+// The sum is separable: exp(i(k1 x + k2 y + phase)) = exp(i k1 x) exp(i k2 y) exp(i phase), so each row
+// folds the k2 axis once in O(n^2) and every sample costs O(n) complex multiplies and no trigonometry.
+// Disjoint row ranges may be computed on different threads.
+template<class Spectrum, class Phases, class Output>
+inline void terrainSampleRect(const Phases& phase, double A, int n, double u0, double v0, double spanU, double spanV,
+                              int resU, int resV, int rowBegin, int rowEnd, Output output) {
+    typedef std::complex<double> complex;
+    const int m = n + 1, rows = rowEnd - rowBegin;
+    if (rows <= 0 || resU <= 0) return;
+    std::vector<complex> c(m * m), ey(rows * m), w(m), wy(m);
+    // exp(i k x) of the columns as real and imaginary planes, k major, so a row runs down contiguous columns
+    std::vector<double> exRe(m * resU), exIm(m * resU), h(resU), gx(resU), gy(resU);
+    for (int one = 0; one <= n; one++)
+        for (int two = 0; two <= n; two++)
+            c[one * m + two] = Spectrum::amplitude(A, one, two, n) * std::polar(1.0, phase(one, two));
+    for (int j = 0; j < resU; j++) {
+        double x = (u0 + (resU > 1 ? spanU * ((double)j / (resU - 1)) : 0)) * M_PI - M_PI;
+        for (int k = 0; k <= n; k++) {
+            complex e = std::polar(1.0, k * x);
+            exRe[k * resU + j] = e.real();
+            exIm[k * resU + j] = e.imag();
+        }
+    }
+    for (int i = rowBegin; i < rowEnd; i++) {
+        double y = (v0 + (resV > 1 ? spanV * ((double)i / (resV - 1)) : 0)) * M_PI - M_PI;
+        for (int k = 0; k <= n; k++) ey[(i - rowBegin) * m + k] = std::polar(1.0, k * y);
+    }
+
+    for (int i = rowBegin; i < rowEnd; i++) {
+        for (int one = 0; one <= n; one++) {
+            complex sum = 0, sumy = 0;
+            for (int two = 0; two <= n; two++) {
+                complex t = c[one * m + two] * ey[(i - rowBegin) * m + two];
+                sum += t;
+                sumy += t * (double)two;
+            }
+            w[one] = sum;
+            wy[one] = sumy;
+        }
+        // only the real part of the sum and the imaginary parts of the derivative sums are needed;
+        // the products are spelled out for those and every column adds its terms in k order
+        std::fill(h.begin(), h.end(), 0.0);
+        std::fill(gx.begin(), gx.end(), 0.0);
+        std::fill(gy.begin(), gy.end(), 0.0);
+        double * __restrict hp = h.data(), * __restrict gxp = gx.data(), * __restrict gyp = gy.data();
+        for (int one = 0; one <= n; one++) {
+            const double * er = &exRe[one * resU], * ei = &exIm[one * resU];
+            const double wr = w[one].real(), wi = w[one].imag(), yr = wy[one].real(), yi = wy[one].imag(), k = one;
+            for (int j = 0; j < resU; j++) {
+                hp[j] += er[j] * wr - ei[j] * wi;
+                gxp[j] += (er[j] * wi + ei[j] * wr) * k;
+                gyp[j] += er[j] * yi + ei[j] * yr;
+            }
+        }
+        for (int j = 0; j < resU; j++) {
+            double height = h[j], dx = -gx[j], dy = -gy[j];
+            Spectrum::shape(height, dx, dy);
+            output(i, j, height, dx, dy);
+        }
+    }
+}
+
+// Height and gradient on a res x res grid of the unit square (u, v = j / (res - 1)), row-major with v as row.
+// u0 and v0 shift the grid, e.g. to the neighbouring tiles of an endless terrain.
+// dx and dy may be null when only heights are needed.
+template<class Spectrum, class Phases>
+inline void terrainSampleGrid(const Phases& phase, double A, int n, int res,
+                              double* height, double* dx, double* dy, double u0 = 0, double v0 = 0) {
+    terrainSampleRect<Spectrum>(phase, A, n, u0, v0, 1, 1, res, res, 0, res,
+                                [&](int i, int j, double h, double gx, double gy) {
+        height[i * res + j] = h;
+        if (dx) dx[i * res + j] = gx;
+        if (dy) dy[i * res + j] = gy;
+    });
+}
+
+inline void terrainSampleGrid(const double* phases, double A, int n, int res,
+                              double* height, double* dx, double* dy) {
+    terrainSampleGrid<TerrainSpectrum>(TablePhases(phases, n), A, n, res, height, dx, dy);
+}